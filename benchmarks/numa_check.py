@@ -0,0 +1,52 @@
+""" Checks that NUMA renders trace every pixel exactly once whatever the tile
+size. The per-node canvas regions are page aligned, so tile sizes that do not
+divide a page's worth of pixels end each region with a short tile. A made-up
+topology (RENDER_NUMA_NODE_DIR) gives the render several nodes on any machine.
+
+    python3 benchmarks/numa_check.py [--size 80] [--nodes 3]
+"""
+import argparse
+import os
+import sys
+import tempfile
+
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "libpyrender"))
+import render as R  # noqa: E402
+from relight_check import teapot_scene  # noqa: E402
+
+TILE_SIZES = [100, 300, 1000, 1024, 1500, 5000]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--size", type=int, default=80)
+    parser.add_argument("--nodes", type=int, default=3)
+    args = parser.parse_args()
+
+    scene = teapot_scene()
+    reference = R.render(scene, R.Canvas(args.size, args.size), options=R.RenderOptions(n_threads=1))
+    failures = []
+    with tempfile.TemporaryDirectory() as node_dir:
+        for node in range(args.nodes):
+            os.makedirs(os.path.join(node_dir, "node%d" % node))
+            with open(os.path.join(node_dir, "node%d" % node, "cpulist"), "w") as out:
+                out.write("%d\n" % node)
+        os.environ["RENDER_NUMA_NODE_DIR"] = node_dir
+        for tile_pixels in TILE_SIZES:
+            options = R.RenderOptions(n_threads=2 * args.nodes, cpus=range(args.nodes), numa=True,
+                                      tile_pixels=tile_pixels)
+            image = R.render(scene, R.Canvas(args.size, args.size), options=options)
+            differing = int(np.sum(image != reference))
+            print("tile %-5d differing pixels %d" % (tile_pixels, differing))
+            if differing:
+                failures.append("tile %d: %d pixels differ from a single-worker render" % (tile_pixels, differing))
+        del os.environ["RENDER_NUMA_NODE_DIR"]
+    for failure in failures:
+        print("REGRESSION " + failure, file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
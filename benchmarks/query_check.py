@@ -0,0 +1,65 @@
+""" Checks that intersect_rays and occluded_rays give the same hits whatever
+the length of the ray directions, with distances and t_max in units of that
+length. Very short directions used to leave the octree walk stuck in one cell,
+so the check gives up, and fails, after --timeout seconds.
+
+    python3 benchmarks/query_check.py [--rays 2000] [--timeout 120]
+"""
+import argparse
+import os
+import signal
+import sys
+
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "libpyrender"))
+import render as R  # noqa: E402
+from relight_check import teapot_scene  # noqa: E402
+
+LENGTHS = [1e-4, 0.01, 0.02, 0.1, 0.5, 100, 1e4]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rays", type=int, default=2000)
+    parser.add_argument("--timeout", type=int, default=120)
+    args = parser.parse_args()
+    signal.alarm(args.timeout)
+
+    query = R.RayQuery(teapot_scene())
+    rng = np.random.default_rng(0)
+    origins = np.tile(np.array([0, 2, -20], dtype=np.float32), (args.rays, 1))
+    targets = rng.uniform([-10, -4, -2], [0, 4, 8], (args.rays, 3)).astype(np.float32)
+    unit = targets - origins
+    unit /= np.linalg.norm(unit, axis=1)[:, None]
+    reference = R.intersect_rays(query, origins, unit)
+    hit = np.isfinite(reference["distance"])
+    # Just beyond and just short of each hit, so occlusion depends on t_max being scaled too.
+    beyond = np.where(hit, reference["distance"] * 1.01, 1e30).astype(np.float32)
+    short = np.where(hit, reference["distance"] * 0.99, 1e30).astype(np.float32)
+    failures = []
+    for length in LENGTHS:
+        directions = (unit * length).astype(np.float32)
+        result = R.intersect_rays(query, origins, directions)
+        same_hits = np.array_equal(np.isfinite(result["distance"]), hit) and \
+            np.array_equal(result["primitive"], reference["primitive"])
+        distance_error = np.max(np.abs(result["distance"][hit] * length - reference["distance"][hit]) /
+                                reference["distance"][hit], initial=0)
+        occluded_beyond = R.occluded_rays(query, origins, directions, beyond / length)
+        occluded_short = R.occluded_rays(query, origins, directions, short / length)
+        same_occlusion = np.array_equal(occluded_beyond, hit) and not occluded_short[hit].any()
+        print("length %-7g hits %d/%d same hits %-5s distance error %.1e same occlusion %s"
+              % (length, hit.sum(), args.rays, same_hits, distance_error, same_occlusion))
+        if not same_hits:
+            failures.append("length %g: hits differ from unit directions" % length)
+        if distance_error > 1e-4:
+            failures.append("length %g: distances off by %.1e" % (length, distance_error))
+        if not same_occlusion:
+            failures.append("length %g: occlusion ignores the scaled t_max" % length)
+    for failure in failures:
+        print("REGRESSION " + failure, file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,212 @@
+""" End-to-end performance regression harness for the native renderer.
+
+Renders each reference scene in scenes/ with bin/render a fixed number of
+times, one process per run. It records wall time, render time, rays per
+second, peak RSS, the output's checksum and its PSNR against the committed
+images/<scene>.png to a JSON history. It fails when a scene got slower than
+the recent runs on this host by more than the threshold, or when its image
+drifted from the reference.
+
+    python3 benchmarks/regress.py [--runs 3] [--threshold 0.1] [--size 300]
+"""
+import argparse
+import datetime
+import hashlib
+import json
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+import numpy as np
+
+SCENES = ["plane_teacup_front", "plane_teapot_frosted_front", "plane_teapot_refract_behind", "instances"]
+# Entries on the same host and settings that make up the baseline.
+BASELINE_ENTRIES = 5
+# Channels per pixel of the PNG colour types read_png handles: grey, RGB, grey + alpha, RGBA.
+CHANNELS = {0: 1, 2: 3, 4: 2, 6: 4}
+
+
+def run_once(renderer, scene, output, extra_args):
+    """ Renders scene once; returns wall seconds, peak RSS in KiB and the renderer's stats. """
+    start = time.perf_counter()
+    process = subprocess.Popen([renderer, scene, output, "--stats"] + extra_args,
+                               stdout=subprocess.PIPE, universal_newlines=True)
+    out = process.stdout.read()
+    _, status, usage = os.wait4(process.pid, 0)
+    wall = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode != 0:
+        raise RuntimeError("%s exited with %d" % (renderer, process.returncode))
+    return wall, usage.ru_maxrss, json.loads(out.splitlines()[-1])
+
+
+def read_png(path):
+    """ First channel of an 8-bit, non-interlaced PNG as floats in [0, 1]. Enough for
+    the renderer's greyscale output and plt.imsave's RGBA, without an imaging library. """
+    with open(path, "rb") as f:
+        data = f.read()
+    chunks, at = {}, 8
+    while at < len(data):
+        length = int.from_bytes(data[at:at + 4], "big")
+        kind = data[at + 4:at + 8]
+        chunks[kind] = chunks.get(kind, b"") + data[at + 8:at + 8 + length]
+        at += 12 + length
+    width, height = int.from_bytes(chunks[b"IHDR"][0:4], "big"), int.from_bytes(chunks[b"IHDR"][4:8], "big")
+    depth, color, interlace = chunks[b"IHDR"][8], chunks[b"IHDR"][9], chunks[b"IHDR"][12]
+    if depth != 8 or interlace != 0 or color not in CHANNELS:
+        raise ValueError("unsupported PNG " + path)
+    channels = CHANNELS[color]
+    stride = width * channels
+    raw = np.frombuffer(zlib.decompress(chunks[b"IDAT"]), dtype=np.uint8).reshape(height, stride + 1)
+    pixels = np.zeros((height, stride), dtype=np.uint8)
+    previous = np.zeros(stride, dtype=np.uint8)
+    for row in range(height):
+        kind, line = raw[row, 0], raw[row, 1:].astype(np.int32)
+        if kind == 1:
+            line = np.cumsum(line.reshape(width, channels), axis=0).reshape(stride)
+        elif kind == 2:
+            line = line + previous
+        elif kind in (3, 4):
+            # Average and Paeth depend on the reconstructed pixel to the left.
+            out, up = line.tolist(), previous.tolist()
+            for k in range(stride):
+                left = out[k - channels] if k >= channels else 0
+                if kind == 3:
+                    out[k] = (out[k] + (left + up[k]) // 2) & 255
+                    continue
+                upper_left = up[k - channels] if k >= channels else 0
+                estimate = left + up[k] - upper_left
+                pa, pb, pc = abs(estimate - left), abs(estimate - up[k]), abs(estimate - upper_left)
+                out[k] = (out[k] + (left if pa <= pb and pa <= pc else up[k] if pb <= pc else upper_left)) & 255
+            line = np.array(out)
+        pixels[row] = previous = (line & 255).astype(np.uint8)
+    return pixels.reshape(height, width, channels)[:, :, 0] / 255.0
+
+
+def psnr(path, reference_path):
+    """ PSNR in dB of a greyscale PNG against a reference saved by plt.imsave, None if
+    their sizes differ. """
+    image = read_png(path)
+    reference = read_png(reference_path)
+    if image.shape != reference.shape:
+        return None
+    mse = float(np.mean((image.astype(np.float64) - reference) ** 2))
+    return float("inf") if mse == 0 else float(10 * np.log10(1 / mse))
+
+
+def measure(args, name, output):
+    extra_args = []
+    if args.size:
+        extra_args += ["--width", str(args.size), "--height", str(args.size)]
+    if args.threads:
+        extra_args += ["--threads", str(args.threads)]
+    if args.raster:
+        extra_args += ["--raster"]
+    runs = [run_once(args.renderer, os.path.join("scenes", name + ".scene"), output, extra_args)
+            for _ in range(args.runs)]
+    with open(output, "rb") as f:
+        checksum = hashlib.md5(f.read()).hexdigest()
+    quality = psnr(output, os.path.join("images", name + ".png"))
+    return {
+        "wall_seconds": min(wall for wall, _, _ in runs),
+        "render_seconds": min(stats["render_seconds"] for _, _, stats in runs),
+        "build_seconds": min(stats["build_seconds"] for _, _, stats in runs),
+        "rays_per_second": max(stats["rays_per_second"] for _, _, stats in runs),
+        "peak_rss_kb": max(rss for _, rss, _ in runs),
+        "md5": checksum,
+        # JSON has no infinity; an exact match is recorded as null with psnr_exact.
+        "psnr": quality if quality is not None and quality != float("inf") else None,
+        "psnr_exact": quality == float("inf"),
+    }
+
+
+def baseline(history, entry, name):
+    """ Median wall time and rays/s of the scene over the latest comparable entries. """
+    comparable = [old["scenes"][name] for old in history
+                  if old["host"] == entry["host"] and old["settings"] == entry["settings"]
+                  and name in old["scenes"]][-BASELINE_ENTRIES:]
+    if not comparable:
+        return None
+    return (float(np.median([s["wall_seconds"] for s in comparable])),
+            float(np.median([s["rays_per_second"] for s in comparable])))
+
+
+def git_commit():
+    try:
+        return subprocess.check_output(["git", "rev-parse", "HEAD"], universal_newlines=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--renderer", default="bin/render")
+    parser.add_argument("--history", default="benchmarks/history.json")
+    parser.add_argument("--runs", type=int, default=3, help="renders per scene, the best one counts")
+    parser.add_argument("--threshold", type=float, default=0.1,
+                        help="fractional slowdown against the baseline that fails the run")
+    # The committed images predate some shading changes, so a current render is not an exact match.
+    parser.add_argument("--min-psnr", type=float, default=30,
+                        help="lowest PSNR in dB against the reference image that passes")
+    parser.add_argument("--size", type=int, default=0,
+                        help="render at size x size instead of the scene's resolution (no PSNR then)")
+    parser.add_argument("--threads", type=int, default=0)
+    parser.add_argument("--raster", action="store_true", help="rasterise primary visibility")
+    parser.add_argument("--scenes", nargs="+", default=SCENES, choices=SCENES)
+    parser.add_argument("--no-record", action="store_true", help="compare without appending to the history")
+    args = parser.parse_args()
+
+    history = []
+    if os.path.exists(args.history):
+        with open(args.history) as f:
+            history = json.load(f)
+    entry = {
+        "time": datetime.datetime.now().isoformat(timespec="seconds"),
+        "host": socket.gethostname(),
+        "commit": git_commit(),
+        "settings": {"runs": args.runs, "size": args.size, "threads": args.threads, "raster": args.raster},
+        "scenes": {},
+    }
+
+    failures = []
+    with tempfile.TemporaryDirectory() as scratch:
+        for name in args.scenes:
+            result = measure(args, name, os.path.join(scratch, name + ".png"))
+            entry["scenes"][name] = result
+            base = baseline(history, entry, name)
+            quality = "exact" if result["psnr_exact"] else (
+                "-" if result["psnr"] is None else "%.1f dB" % result["psnr"])
+            line = "%-28s wall %7.3fs  render %7.3fs  %10.0f rays/s  rss %7.1f MiB  psnr %s" % (
+                name, result["wall_seconds"], result["render_seconds"], result["rays_per_second"],
+                result["peak_rss_kb"] / 1024, quality)
+            if base is not None:
+                wall_change = result["wall_seconds"] / base[0] - 1
+                line += "  (%+.1f%% wall vs baseline)" % (100 * wall_change)
+                if wall_change > args.threshold:
+                    failures.append("%s: wall time %.3fs is %.1f%% over the baseline %.3fs"
+                                    % (name, result["wall_seconds"], 100 * wall_change, base[0]))
+                if result["rays_per_second"] < base[1] * (1 - args.threshold):
+                    failures.append("%s: %.0f rays/s is under the baseline %.0f"
+                                    % (name, result["rays_per_second"], base[1]))
+            if result["psnr"] is not None and result["psnr"] < args.min_psnr:
+                failures.append("%s: PSNR %.1f dB against images/%s.png is under %.1f dB"
+                                % (name, result["psnr"], name, args.min_psnr))
+            print(line)
+            sys.stdout.flush()
+
+    if not args.no_record:
+        history.append(entry)
+        with open(args.history + ".tmp", "w") as f:
+            json.dump(history, f, indent=1)
+        os.replace(args.history + ".tmp", args.history)
+    for failure in failures:
+        print("REGRESSION " + failure, file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
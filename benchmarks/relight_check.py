@@ -0,0 +1,68 @@
+""" Checks that relight() keeps its captured ray trees across the edits it is
+meant to absorb, and that each relit image matches a fresh render. Light and
+scattering edits publish a new scene version, which must still match the
+G-buffer; a geometry edit must not.
+
+    python3 benchmarks/relight_check.py [--size 60]
+"""
+import argparse
+import os
+import sys
+
+import numpy as np
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "libpyrender"))
+import render as R  # noqa: E402
+from model_lib import read_stl  # noqa: E402
+
+
+def teapot_scene():
+    vertices, normals = read_stl("stl/UtahTeapot.stl")
+    vertices -= vertices.mean(0).mean(0)
+    scene = R.stl_forge(vertices + np.array([-5, 0, 3]), normals, scattering=.5, refraction_index=1.333,
+                        flip_y=True)
+    ground = np.array([[-100, -4, -100], [-100, -4, 100], [100, -4, 100], [100, -4, -100]])
+    R.add_triangle(scene, R.Triangle(ground[[0, 1, 2]], np.array([0, 1, 0]), scattering=1.0))
+    R.add_triangle(scene, R.Triangle(ground[[0, 3, 2]], np.array([0, 1, 0]), scattering=1.0))
+    R.add_light(scene, R.Light([0, 10, -10], 1000))
+    return scene
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--size", type=int, default=60)
+    args = parser.parse_args()
+
+    scene = teapot_scene()
+    teapot = R.material(scene, .5, 1.333)
+    gbuffer = R.GBuffer()
+    # Each edit, and whether the G-buffer should survive it.
+    steps = [
+        ("capture", lambda: None, False),
+        ("unchanged", lambda: None, True),
+        ("light moved", lambda: R.set_light(scene, 0, R.Light([5, 12, -8], 800)), True),
+        ("light added", lambda: R.add_light(scene, R.Light([-5, 8, -3], 300)), True),
+        ("scattering", lambda: R.set_material(scene, teapot, .2, 1.333), True),
+        ("refraction index", lambda: R.set_material(scene, teapot, .2, 1.5), False),
+        ("triangle added", lambda: R.add_triangle(scene, R.Triangle(np.eye(3), np.array([0, 0, 1]))), False),
+    ]
+    failures = []
+    for label, edit, expect_reuse in steps:
+        edit()
+        stats = R.RenderStats()
+        relit = R.relight(scene, R.Canvas(args.size, args.size), gbuffer, stats).copy()
+        fresh = R.render(scene, R.Canvas(args.size, args.size))
+        reused = R.read_stats(stats)["gbuffer_reused"]
+        same = np.array_equal(relit, fresh, equal_nan=True)
+        print("%-18s reused %-5s matches render %s" % (label, reused, same))
+        if reused != expect_reuse:
+            failures.append("%s: G-buffer %s" % (label, "was retraced" if expect_reuse else "was wrongly reused"))
+        if not same:
+            failures.append("%s: relit image differs from render()" % label)
+    for failure in failures:
+        print("REGRESSION " + failure, file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,5 +1,7 @@
+from contextlib import contextmanager
 from cffi import FFI
 import numpy as np
+import weakref
 ffi = FFI()
 ffi.cdef("""
 typedef struct PyVec3 {
@@ -23,22 +25,166 @@ typedef struct PyCanvas {
 } PyCanvas;
 
 typedef struct PyScene {
-  void* scene;
+  void* versions;
 } PyScene;
 
+typedef struct PyRayQuery {
+  void* query;
+  void* snapshot;
+} PyRayQuery;
+
+typedef struct PyStreamedGeometry {
+  void* geometry;
+} PyStreamedGeometry;
+
+typedef struct PyStreamStats {
+  long cluster_loads;
+  long cluster_evictions;
+  long deferred_rays;
+  long bytes_paged_in;
+  long resident_bytes;
+  long peak_resident_bytes;
+} PyStreamStats;
+
 typedef struct PyLight {
   PyVec3 loc;
   float intensity;
 } PyLight;
 
+typedef struct PyInstance {
+  int mesh;
+  float transform[12];
+  int override_material;
+  float scattering;
+  float refraction_index;
+} PyInstance;
+
+typedef struct PyRenderOptions {
+  int heatmap_mode;
+  PyCanvas *heatmap;
+  int n_threads;
+  int *cpus;
+  int n_cpus;
+  int pin_threads;
+  int numa;
+  int numa_replicate_octree;
+  const char *octree_cache_dir;
+  float lod_pixel_error;
+  float lod_secondary_scale;
+  float lod_shadow_scale;
+  int tile_pixels;
+  int octree_depth;
+  int raster_primary;
+} PyRenderOptions;
+
+typedef struct PyRenderStats {
+  long primary_rays;
+  long secondary_rays;
+  long shadow_rays;
+  long triangle_tests;
+  long triangle_hits;
+  long nodes_visited;
+  int max_depth;
+  int n_workers;
+  double build_seconds;
+  double raster_seconds;
+  double render_seconds;
+  long build_bytes;
+  int octree_cached;
+  int gbuffer_reused;
+  double *worker_busy_seconds;
+  double *worker_idle_seconds;
+  void* cpp_stats;
+} PyRenderStats;
+
+typedef struct PyGBuffer {
+  void* gbuffer;
+} PyGBuffer;
+
+typedef struct PyRenderJob {
+  void* job;
+  PyCanvas* canvas;
+  long version;
+} PyRenderJob;
+
 void add_triangle(PyTriangle *tri, PyScene *scene);
+int add_mesh(PyTriangle *tris, int n_triangles, int n_levels, int node_format, PyRenderOptions *options,
+             PyScene *scene);
+int add_instance(PyInstance *pyinstance, PyScene *scene);
 void add_light(PyLight *pylight, PyScene *scene);
+int set_light(PyLight *pylight, int light, PyScene *scene);
+int material_id(float refraction_index, float scattering, PyScene *scene);
+int set_material(int material, float refraction_index, float scattering, PyScene *scene);
 void __init_scene(PyScene *scene);
+void __free_scene(PyScene *scene);
+long scene_version(PyScene *scene);
 void __init_canvas(PyCanvas *canvas, int width, int height);
-void render(PyScene* scene, PyCanvas* canvas);
+void start_trace(int events_per_thread);
+int stop_trace(const char *path);
+void begin_trace_span(const char *name);
+void end_trace_span();
+void __init_render_stats(PyRenderStats *stats);
+void __free_render_stats(PyRenderStats *stats);
+void render(PyScene* scene, PyCanvas* canvas, PyRenderOptions* options, PyRenderStats* stats);
+void render_async(PyScene *scene, PyCanvas *canvas, PyRenderOptions *options, PyRenderJob *job);
+int render_job_state(PyRenderJob *job);
+float render_progress(PyRenderJob *job);
+int wait_render(PyRenderJob *job, double timeout_seconds, PyRenderStats *stats);
+void __free_render_job(PyRenderJob *job);
+int render_pool_threads(int n_threads);
+int autotune(PyScene *scene, PyCanvas *canvas, PyRenderOptions *options, int n_samples, unsigned seed,
+             const char *cache_dir);
+int render_to_file(PyScene *scene, const char *path, int format, int width, int height, int strip_rows,
+                   float max_exposure, PyRenderOptions *options, PyRenderStats *stats);
+void __init_gbuffer(PyGBuffer *gbuffer);
+void __free_gbuffer(PyGBuffer *gbuffer);
+int relight(PyScene *scene, PyCanvas *canvas, PyGBuffer *gbuffer, PyRenderOptions *options,
+            PyRenderStats *stats);
+void __init_ray_query(PyRayQuery *query, PyScene *scene, const char *octree_cache_dir,
+                      PyRenderOptions *options);
+void __free_ray_query(PyRayQuery *query);
+void intersect_rays(PyRayQuery *query, long n_rays, const float *origins, const float *directions,
+                    const float *t_max, float *distances, int *primitives, int *instances,
+                    float *barycentrics);
+void occluded_rays(PyRayQuery *query, long n_rays, const float *origins, const float *directions,
+                   const float *t_max, unsigned char *mask);
+int write_streamed_mesh(const char *stl_path, const char *path, int flip_y, PyRenderOptions *options);
+int __init_streamed_geometry(PyStreamedGeometry *geometry, const char *path, long cache_bytes,
+                             PyRenderOptions *options);
+void __free_streamed_geometry(PyStreamedGeometry *geometry);
+void intersect_streamed(PyStreamedGeometry *geometry, long n_rays, const float *origins,
+                        const float *directions, const float *t_max, float *distances, int *primitives,
+                        int *instances, float *barycentrics);
+void occluded_streamed(PyStreamedGeometry *geometry, long n_rays, const float *origins,
+                       const float *directions, const float *t_max, unsigned char *mask);
+void get_stream_stats(PyStreamedGeometry *geometry, PyStreamStats *stats);
 """)
 
 __c_renderer = ffi.dlopen("libpyrender/librender.so")
+# Arrays that C structs point into, kept alive for as long as the struct is.
+__keep_alive = weakref.WeakKeyDictionary()
+HEATMAP_MODES = {
+    "none": 0,
+    "triangle_tests": 1,
+    "nodes_visited": 2,
+    "rays": 3,
+    "nanoseconds": 4,
+}
+RENDER_JOB_STATES = {
+    "queued": 0,
+    "building": 1,
+    "rendering": 2,
+    "done": 3,
+}
+IMAGE_FORMATS = {
+    ".pfm": 0,
+    ".png": 1,
+}
+NODE_FORMATS = {
+    "auto": 0,
+    "octree": 1,
+    "compressed": 2,
+}
 # CAM_DIM = (1., .25)
 # C_DIST_EFF = .25
 # C_POS = np.array([0., 0., -25.])
@@ -49,14 +195,77 @@ def stl_forge(vertices, normals, scene=None, scattering=0.95, refraction_index=1
         scene = Scene()
     if flip_y:
         vertices[:, :, 1] *= -1
-    for vertices, normal in zip(vertices, normals):
-        add_triangle(
-            scene,
-            Triangle(vertices, normal, scattering, refraction_index)
-        )
+    with trace_span("scene ingestion"):
+        for vertices, normal in zip(vertices, normals):
+            add_triangle(
+                scene,
+                Triangle(vertices, normal, scattering, refraction_index)
+            )
     return scene
 
 
+def add_mesh(scene, vertices, normals, scattering=0.95, refraction_index=15, flip_y=False,
+             lod_levels=4, node_format="auto", options=None):
+    """ Uploads geometry once as a mesh that add_instance can place any number
+    of times. Returns the mesh id. Up to lod_levels - 1 simplified versions,
+    each about a quarter the size of the last, are built for rays that can
+    do with less detail (see RenderOptions). node_format (see NODE_FORMATS)
+    picks each level's acceleration structure: "compressed" is a 4-wide BVH
+    in 64-byte quantised nodes, far smaller than the octree for big meshes;
+    "auto" uses it for levels of 65536 triangles or more. The builds use the
+    threads and CPUs of options (a RenderOptions), all of them if None. """
+    vertices = np.array(vertices, dtype=np.float32)
+    if flip_y:
+        vertices[:, :, 1] *= -1
+    with trace_span("scene ingestion"):
+        tris = ffi.new("PyTriangle[]", len(vertices))
+        for i, (verts, normal) in enumerate(zip(vertices, normals)):
+            tris[i] = Triangle(verts, normal, scattering, refraction_index)[0]
+        return __c_renderer.add_mesh(tris, len(vertices), lod_levels, NODE_FORMATS[node_format],
+                                     ffi.NULL if options is None else options, scene)
+
+
+def add_instance(scene, mesh, transform=None, scattering=None, refraction_index=None):
+    """ Places a mesh in the scene. transform is a 3x4 (or 4x4) object-to-world
+    matrix, identity by default, and must be invertible. Giving scattering or
+    refraction_index overrides the mesh's material for this instance. """
+    if transform is None:
+        transform = np.eye(4)
+    transform = np.asarray(transform, dtype=np.float32)[:3, :4]
+    instance = ffi.new("PyInstance*")
+    instance.mesh = mesh
+    instance.transform = list(transform.flatten())
+    instance.override_material = scattering is not None or refraction_index is not None
+    instance.scattering = 0.95 if scattering is None else scattering
+    instance.refraction_index = 15 if refraction_index is None else refraction_index
+    status = __c_renderer.add_instance(instance, scene)
+    if status == -1:
+        raise IndexError("no mesh %d in the scene" % mesh)
+    if status == -2:
+        raise ValueError("instance transform is singular")
+
+
+def start_trace(events_per_thread=1 << 16):
+    """ Starts recording a timeline of render phases and tiles. Each thread
+    keeps its latest events_per_thread spans. """
+    __c_renderer.start_trace(events_per_thread)
+
+
+def stop_trace(path):
+    """ Stops recording and writes the timeline as Chrome trace / Perfetto JSON. """
+    if __c_renderer.stop_trace(path.encode()) != 0:
+        raise IOError("could not write trace to " + path)
+
+
+@contextmanager
+def trace_span(name):
+    __c_renderer.begin_trace_span(name.encode())
+    try:
+        yield
+    finally:
+        __c_renderer.end_trace_span()
+
+
 def Vec3(vec):
     vec3 = ffi.new("PyVec3*")
     vec3.x, vec3.y, vec3.z = vec
@@ -71,6 +280,10 @@ def Light(loc, intensity):
 
 
 def Triangle(vertices, normal, scattering=0.1, refraction_index=1.5):
+    """
+    scattering=1 makes a purely diffuse surface and refraction_index=float("inf")
+    a mirror; anything else is a dielectric.
+    """
     triangle = ffi.new("PyTriangle*")
     triangle.v0 = Vec3(vertices[0])[0]
     triangle.v1 = Vec3(vertices[1])[0]
@@ -87,7 +300,15 @@ def Scene():
     # scene.add_triangle = lambda x: add_triangle(scene, x)
     # scene.add_light = lambda x: add_light(scene, x)
     # scene.render = lambda x: render(scene, x)
-    return scene
+    return ffi.gc(scene, __c_renderer.__free_scene)
+
+
+def scene_version(scene):
+    """ Number of the scene version a render started now would trace. Every
+    render reads an immutable snapshot of the scene; edits since the last
+    snapshot publish a new version, and versions whose triangles did not change
+    share one octree. """
+    return __c_renderer.scene_version(scene)
 
 
 def Canvas(width, height):
@@ -96,6 +317,70 @@ def Canvas(width, height):
     return canvas
 
 
+def RenderOptions(heatmap=None, heatmap_mode="none", n_threads=0, cpus=None,
+                  pin_threads=False, numa=False, numa_replicate_octree=False,
+                  octree_cache_dir=None, lod_pixel_error=0.5, lod_secondary_scale=4,
+                  lod_shadow_scale=4, tile_pixels=0, octree_depth=0,
+                  raster_primary=False):
+    """ heatmap: a Canvas of the render's size that receives the per-pixel work
+    selected by heatmap_mode (see HEATMAP_MODES).
+    n_threads: worker count, 0 for all but one hardware thread.
+    cpus: CPU ids the workers may run on; pin_threads binds each worker to one.
+    numa: per-node workers, canvas regions and (optionally) octree copies.
+    octree_cache_dir: directory where built octrees are saved and mapped back
+    from on later renders of the same geometry.
+    lod_pixel_error: simplification error, in pixels, camera rays tolerate on
+    instanced meshes; bounces and shadow rays tolerate lod_secondary_scale and
+    lod_shadow_scale times more than the ray they came from. 0 disables.
+    tile_pixels, octree_depth: pixels per work item and depth of the scene
+    octree, 0 for the built-in defaults; see autotune(). Depths are clamped to
+    1..9.
+    raster_primary: rasterise camera rays' first hits on the scene geometry
+    instead of tracing them. render() and render_async() only. """
+    options = ffi.new("PyRenderOptions*")
+    options.heatmap_mode = HEATMAP_MODES[heatmap_mode]
+    options.heatmap = ffi.NULL if heatmap is None else heatmap
+    options.n_threads = n_threads
+    if cpus:
+        cpu_array = ffi.new("int[]", list(cpus))
+        __keep_alive.setdefault(options, []).append(cpu_array)
+        options.cpus = cpu_array
+        options.n_cpus = len(cpus)
+    options.pin_threads = pin_threads
+    options.numa = numa
+    options.numa_replicate_octree = numa_replicate_octree
+    if octree_cache_dir is not None:
+        cache_dir = ffi.new("char[]", octree_cache_dir.encode())
+        __keep_alive.setdefault(options, []).append(cache_dir)
+        options.octree_cache_dir = cache_dir
+    options.lod_pixel_error = lod_pixel_error
+    options.lod_secondary_scale = lod_secondary_scale
+    options.lod_shadow_scale = lod_shadow_scale
+    options.tile_pixels = tile_pixels
+    options.octree_depth = octree_depth
+    options.raster_primary = raster_primary
+    return options
+
+
+def autotune(scene, canvas, options=None, samples=4096, seed=0, cache_dir=None):
+    """ Times a seeded sample of about `samples` pixels under candidate octree
+    depths, tile sizes and worker counts and returns options (a new
+    RenderOptions if None) with the fastest filled in. With a cache_dir the
+    result is saved per scene and host and reused by later calls. """
+    if options is None:
+        options = RenderOptions()
+    with trace_span("autotune"):
+        __c_renderer.autotune(scene, canvas, options, samples, seed,
+                              ffi.NULL if cache_dir is None else cache_dir.encode())
+    return options
+
+
+def RenderStats():
+    stats = ffi.new("PyRenderStats*")
+    __c_renderer.__init_render_stats(stats)
+    return ffi.gc(stats, __c_renderer.__free_render_stats)
+
+
 def add_triangle(scene, triangle):
     __c_renderer.add_triangle(triangle, scene)
 
@@ -104,8 +389,234 @@ def add_light(scene, light):
     __c_renderer.add_light(light, scene)
 
 
-def render(scene, canvas):
-    __c_renderer.render(scene, canvas)
+def set_light(scene, index, light):
+    """ Replaces the index-th light added to the scene. """
+    if __c_renderer.set_light(light, index, scene) != 0:
+        raise IndexError("no light %d in the scene" % index)
+
+
+def material(scene, scattering=0.1, refraction_index=1.5):
+    """ Id of the material that triangles added with these parameters share. """
+    return __c_renderer.material_id(refraction_index, scattering, scene)
+
+
+def set_material(scene, material, scattering, refraction_index):
+    """ Changes a material, and so every triangle and instance using it. """
+    if __c_renderer.set_material(material, refraction_index, scattering, scene) != 0:
+        raise IndexError("no material %d in the scene" % material)
+
+
+def read_stats(stats):
+    """ Converts a PyRenderStats filled in by render() into a dict. """
+    def worker_times(ptr):
+        return np.frombuffer(ffi.buffer(ptr, stats.n_workers*8), dtype=np.float64).copy()
+    return {
+        "primary_rays": stats.primary_rays,
+        "secondary_rays": stats.secondary_rays,
+        "shadow_rays": stats.shadow_rays,
+        "triangle_tests": stats.triangle_tests,
+        "triangle_hits": stats.triangle_hits,
+        "nodes_visited": stats.nodes_visited,
+        "max_depth": stats.max_depth,
+        "build_seconds": stats.build_seconds,
+        "raster_seconds": stats.raster_seconds,
+        "build_bytes": stats.build_bytes,
+        "octree_cached": bool(stats.octree_cached),
+        "gbuffer_reused": bool(stats.gbuffer_reused),
+        "render_seconds": stats.render_seconds,
+        "worker_busy_seconds": worker_times(stats.worker_busy_seconds),
+        "worker_idle_seconds": worker_times(stats.worker_idle_seconds),
+    }
+
+
+def canvas_array(canvas):
     array = np.frombuffer(ffi.buffer(
         canvas.canvas, canvas.width*canvas.height*4), dtype=np.float32)
     return array.reshape(canvas.height, canvas.width)
+
+
+def render(scene, canvas, stats=None, options=None):
+    __c_renderer.render(scene, canvas,
+                        ffi.NULL if options is None else options,
+                        ffi.NULL if stats is None else stats)
+    with trace_span("output"):
+        return canvas_array(canvas)
+
+
+def render_to_file(scene, path, width, height, stats=None, options=None, strip_rows=64, max_exposure=None):
+    """ Renders straight to a .pfm or .png file, strip_rows rows at a time, so
+    memory stays bounded whatever the resolution. Without max_exposure the
+    image is exposed to its own peak, which takes a second pass over a
+    spooled copy of the raw strips at path + ".raw". """
+    extension = path[path.rfind("."):].lower()
+    if extension not in IMAGE_FORMATS:
+        raise ValueError("unsupported image format: " + path)
+    if __c_renderer.render_to_file(scene, path.encode(), IMAGE_FORMATS[extension], width, height, strip_rows,
+                                   0 if max_exposure is None else max_exposure,
+                                   ffi.NULL if options is None else options,
+                                   ffi.NULL if stats is None else stats) != 0:
+        raise IOError("could not write " + path)
+
+
+def GBuffer():
+    """ Ray trees kept between relight() calls, along with the scene's octree. """
+    gbuffer = ffi.new("PyGBuffer*")
+    __c_renderer.__init_gbuffer(gbuffer)
+    return ffi.gc(gbuffer, __c_renderer.__free_gbuffer)
+
+
+def relight(scene, canvas, gbuffer, stats=None, options=None):
+    """ Renders like render(), but keeps the camera and bounce hits in gbuffer
+    so that later calls on the same scene and canvas size only trace shadow
+    rays. Lights may be moved and scattering changed in between; changing
+    geometry, a refraction index or whether a material is fully diffuse
+    (scattering 1) makes the next call trace everything again. Heatmaps are
+    not supported. """
+    __c_renderer.relight(scene, canvas, gbuffer,
+                         ffi.NULL if options is None else options,
+                         ffi.NULL if stats is None else stats)
+    with trace_span("output"):
+        return canvas_array(canvas)
+
+
+def render_async(scene, canvas, options=None):
+    """ Queues a render on the library's worker pool and returns a job handle
+    at once. Queued renders share the pool: a later job's octree is built
+    while an earlier one is still tracing. The pool ignores the thread count
+    and placement options. The job traces the scene as it is now, so the scene
+    may be edited while it runs; job.version is the version it traces. The
+    canvas must not change until the job is done. """
+    job = ffi.new("PyRenderJob*")
+    __c_renderer.render_async(scene, canvas, ffi.NULL if options is None else options, job)
+    __keep_alive.setdefault(job, []).extend([scene, canvas, options])
+    return ffi.gc(job, __c_renderer.__free_render_job)
+
+
+def render_done(job):
+    return __c_renderer.render_job_state(job) == RENDER_JOB_STATES["done"]
+
+
+def render_state(job):
+    """ One of the keys of RENDER_JOB_STATES. """
+    state = __c_renderer.render_job_state(job)
+    return next(name for name, value in RENDER_JOB_STATES.items() if value == state)
+
+
+def render_progress(job):
+    """ Fraction of the job's tiles traced so far. """
+    return __c_renderer.render_progress(job)
+
+
+def wait_render(job, timeout=None, stats=None):
+    """ Blocks until the job is done, or for at most timeout seconds, and
+    returns the exposed canvas array, or None on timeout. The GIL is released
+    while waiting (cffi drops it around every library call), so other Python
+    threads keep running. stats, from RenderStats(), receives the summary. """
+    timeout = -1 if timeout is None else timeout
+    if not __c_renderer.wait_render(job, timeout, ffi.NULL if stats is None else stats):
+        return None
+    with trace_span("output"):
+        return canvas_array(job.canvas)
+
+
+def render_pool_threads(n_threads=0):
+    """ Sets the worker count of the pool behind render_async, if no render
+    has been queued yet, and returns the count in use. 0 means all but one
+    hardware thread. """
+    return __c_renderer.render_pool_threads(n_threads)
+
+
+def RayQuery(scene, octree_cache_dir=None, options=None):
+    """ Builds the scene's acceleration structures once for intersect_rays and
+    occluded_rays. The query keeps tracing the scene as it was when built,
+    whatever edits follow. The build and every batch use the threads and CPUs
+    of options (a RenderOptions), all of them if None. """
+    query = ffi.new("PyRayQuery*")
+    cache_dir = ffi.NULL if octree_cache_dir is None else octree_cache_dir.encode()
+    with trace_span("octree build"):
+        __c_renderer.__init_ray_query(query, scene, cache_dir, ffi.NULL if options is None else options)
+    __keep_alive.setdefault(query, []).append(scene)
+    return ffi.gc(query, __c_renderer.__free_ray_query)
+
+
+def write_streamed_mesh(stl_path, path, flip_y=False, options=None):
+    """ Converts a binary STL file into the clustered on-disk layout that
+    StreamedGeometry pages in, without reading the STL into memory. Axes are
+    swapped as in model_lib.read_stl. Only geometry is stored: streamed
+    meshes answer ray queries and are never shaded. The sort uses the threads
+    and CPUs of options (a RenderOptions), all of them if None. """
+    if __c_renderer.write_streamed_mesh(stl_path.encode(), path.encode(), flip_y,
+                                        ffi.NULL if options is None else options) != 0:
+        raise IOError("could not convert " + stl_path + " to " + path)
+
+
+def StreamedGeometry(path, cache_mb=1024, options=None):
+    """ Opens a file written by write_streamed_mesh for intersect_rays and
+    occluded_rays, keeping at most cache_mb of clusters in memory. primitive
+    then indexes the triangles of the source STL. Batches use the threads and
+    CPUs of options (a RenderOptions), all of them if None. """
+    geometry = ffi.new("PyStreamedGeometry*")
+    if __c_renderer.__init_streamed_geometry(geometry, path.encode(), int(cache_mb * (1 << 20)),
+                                             ffi.NULL if options is None else options) != 0:
+        raise IOError("not a streamed mesh: " + path)
+    return ffi.gc(geometry, __c_renderer.__free_streamed_geometry)
+
+
+def stream_stats(geometry):
+    """ Cluster cache counters of a StreamedGeometry since it was opened. """
+    stats = ffi.new("PyStreamStats*")
+    __c_renderer.get_stream_stats(geometry, stats)
+    return {field: getattr(stats, field) for field, _ in ffi.typeof("PyStreamStats").fields}
+
+
+def __is_streamed(query):
+    return ffi.typeof(query) is ffi.typeof("PyStreamedGeometry*")
+
+
+def __ray_arrays(origins, directions, t_max):
+    origins = np.ascontiguousarray(origins, dtype=np.float32).reshape(-1, 3)
+    directions = np.ascontiguousarray(directions, dtype=np.float32).reshape(-1, 3)
+    if len(origins) != len(directions):
+        raise ValueError("origins and directions must have the same number of rays")
+    if t_max is not None:
+        t_max = np.ascontiguousarray(np.broadcast_to(t_max, len(origins)), dtype=np.float32)
+    return origins, directions, t_max
+
+
+def __float_ptr(array):
+    return ffi.NULL if array is None else ffi.from_buffer("float[]", array)
+
+
+def intersect_rays(query, origins, directions, t_max=None):
+    """ Closest hits of N rays given as (N, 3) origin and direction arrays,
+    against a RayQuery or a StreamedGeometry, with optional per-ray (or
+    scalar) t_max. Distances are in units of the
+    direction's length and infinite on a miss. primitive indexes the scene's
+    triangles, or the mesh's when instance is not -1. barycentric holds the
+    hit's weights on the triangle's second and third vertices. """
+    origins, directions, t_max = __ray_arrays(origins, directions, t_max)
+    n = len(origins)
+    distance = np.empty(n, dtype=np.float32)
+    primitive = np.empty(n, dtype=np.int32)
+    instance = np.empty(n, dtype=np.int32)
+    barycentric = np.empty((n, 2), dtype=np.float32)
+    intersect = __c_renderer.intersect_streamed if __is_streamed(query) else __c_renderer.intersect_rays
+    intersect(query, n, __float_ptr(origins), __float_ptr(directions), __float_ptr(t_max),
+              __float_ptr(distance), ffi.from_buffer("int[]", primitive),
+              ffi.from_buffer("int[]", instance), __float_ptr(barycentric))
+    return {"distance": distance, "primitive": primitive, "instance": instance, "barycentric": barycentric}
+
+
+def occluded_rays(query, origins, directions, t_max=None, packed=False):
+    """ Whether each ray hits anything before its t_max. Returns a bool array,
+    or with packed=True the raw little-endian bitmask (np.unpackbits with
+    bitorder="little" expands it). """
+    origins, directions, t_max = __ray_arrays(origins, directions, t_max)
+    n = len(origins)
+    mask = np.empty((n + 7) // 8, dtype=np.uint8)
+    occluded = __c_renderer.occluded_streamed if __is_streamed(query) else __c_renderer.occluded_rays
+    occluded(query, n, __float_ptr(origins), __float_ptr(directions), __float_ptr(t_max),
+             ffi.from_buffer("unsigned char[]", mask))
+    if packed:
+        return mask
+    return np.unpackbits(mask, count=n, bitorder="little").astype(bool)
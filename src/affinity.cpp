@@ -0,0 +1,115 @@
+#include "affinity.h"
+#include "stdio.h"
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+using std::string;
+
+vector<int> allowed_cpus() {
+    vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    if (cpus.empty()) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Parses a kernel cpulist such as "0-3,8-11".
+static vector<int> read_cpulist(const char *path) {
+    vector<int> cpus;
+    FILE *in = fopen(path, "r");
+    if (in == nullptr) {
+        return cpus;
+    }
+    int first, last;
+    while (fscanf(in, "%d", &first) == 1) {
+        last = first;
+        int separator = fgetc(in);
+        if (separator == '-') {
+            if (fscanf(in, "%d", &last) != 1) {
+                break;
+            }
+            separator = fgetc(in);
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+    fclose(in);
+    return cpus;
+}
+
+vector<vector<int>> numa_nodes(const vector<int> &cpus) {
+    vector<vector<int>> nodes;
+    vector<int> assigned;
+    const char *node_dir = getenv("RENDER_NUMA_NODE_DIR");
+    string root = node_dir != nullptr ? node_dir : "/sys/devices/system/node";
+    for (int node = 0; node < 1024; node++) {
+        string path = root + "/node" + std::to_string(node) + "/cpulist";
+        if (access(path.c_str(), R_OK) != 0) {
+            break;
+        }
+        vector<int> node_cpus;
+        for (int cpu : read_cpulist(path.c_str())) {
+            if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+                node_cpus.push_back(cpu);
+                assigned.push_back(cpu);
+            }
+        }
+        if (!node_cpus.empty()) {
+            nodes.push_back(node_cpus);
+        }
+    }
+    // Anything the kernel did not place on a node shares the first one.
+    for (int cpu : cpus) {
+        if (std::find(assigned.begin(), assigned.end(), cpu) == assigned.end()) {
+            if (nodes.empty()) {
+                nodes.push_back(vector<int>());
+            }
+            nodes[0].push_back(cpu);
+        }
+    }
+    if (nodes.empty()) {
+        nodes.push_back(vector<int>());
+    }
+    return nodes;
+}
+
+bool pin_current_thread(const vector<int> &cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void first_touch(void *memory, size_t bytes) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile char *bytes_ptr = (volatile char *)memory;
+    for (size_t offset = 0; offset < bytes; offset += page_size) {
+        bytes_ptr[offset] = bytes_ptr[offset];
+    }
+}
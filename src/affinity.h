@@ -0,0 +1,23 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+#include <stddef.h>
+#include <vector>
+using std::vector;
+
+/**
+ * CPU and NUMA topology helpers (Linux). Topology comes from sched_getaffinity and
+ * /sys/devices/system/node; without that information everything is treated as a single node.
+ * RENDER_NUMA_NODE_DIR, when set, replaces that directory so tests can lay out a topology the
+ * machine does not have.
+ **/
+
+// CPUs this process may run on.
+vector<int> allowed_cpus();
+// Splits cpus by NUMA node, dropping empty nodes. Always returns at least one node.
+vector<vector<int>> numa_nodes(const vector<int> &cpus);
+// Restricts the calling thread to cpus. Returns false if the kernel refused.
+bool pin_current_thread(const vector<int> &cpus);
+// Writes one byte per page so the pages get allocated on the calling thread's node.
+void first_touch(void *memory, size_t bytes);
+
+#endif
@@ -0,0 +1,191 @@
+#include "async.h"
+#include <deque>
+#include <thread>
+using std::deque;
+using std::thread;
+
+/**
+ * The library's render workers. Jobs stay in the queue until all their tiles are claimed; each
+ * worker looks for the oldest job it can help with, building a queued job when no job is ready
+ * to trace, and sleeps when there is nothing at all.
+ **/
+class RenderPool {
+  public:
+    int n_workers;
+    mutex lock;
+    condition_variable work;
+    deque<RenderJob *> jobs;
+    RenderPool(int n_workers) : n_workers(n_workers) {
+        for (int w = 0; w < n_workers; w++) {
+            // Detached: the pool lives as long as the process.
+            thread(&RenderPool::run, this, w).detach();
+        }
+    }
+    void submit(RenderJob *job) {
+        job->worker_stats.resize(n_workers);
+        std::lock_guard<mutex> guard(lock);
+        jobs.push_back(job);
+        work.notify_one();
+    }
+
+  private:
+    void run(int worker) {
+        std::unique_lock<mutex> guard(lock);
+        while (true) {
+            RenderJob *job = nullptr;
+            for (RenderJob *candidate : jobs) {
+                if (candidate->state == RENDER_JOB_RENDERING) {
+                    job = candidate;
+                    break;
+                }
+            }
+            if (job == nullptr) {
+                for (RenderJob *candidate : jobs) {
+                    if (candidate->state == RENDER_JOB_QUEUED) {
+                        job = candidate;
+                        break;
+                    }
+                }
+            }
+            if (job == nullptr) {
+                work.wait(guard);
+                continue;
+            }
+            if (job->state == RENDER_JOB_QUEUED) {
+                job->state = RENDER_JOB_BUILDING;
+                guard.unlock();
+                job->build();
+                guard.lock();
+                job->state = RENDER_JOB_RENDERING;
+                job->render_start = std::chrono::steady_clock::now();
+                work.notify_all();
+                continue;
+            }
+            job->active_workers++;
+            guard.unlock();
+            while (true) {
+                int tile = job->next_tile++;
+                if (tile >= job->n_tiles) {
+                    break;
+                }
+                int start = tile * job->options.tile_pixels;
+                render_tile(job->canvas, job->scene, *job->octree, *job->instances, job->camera, job->options, start,
+                            start + job->options.tile_pixels, job->worker_stats[worker]);
+                job->tiles_done++;
+            }
+            guard.lock();
+            auto position = std::find(jobs.begin(), jobs.end(), job);
+            if (position != jobs.end()) {
+                jobs.erase(position);
+            }
+            if (--job->active_workers == 0) {
+                guard.unlock();
+                job->finish();
+                guard.lock();
+            }
+        }
+    }
+};
+
+static mutex pool_lock;
+static RenderPool *pool = nullptr;
+static int pool_threads = 0;
+
+int render_pool_size(int n_threads) {
+    std::lock_guard<mutex> guard(pool_lock);
+    if (pool == nullptr && n_threads > 0) {
+        pool_threads = n_threads;
+    }
+    return pool != nullptr ? pool->n_workers
+                           : (pool_threads > 0 ? pool_threads : max((int)thread::hardware_concurrency() - 1, 1));
+}
+
+void submit_render(RenderJob *job) {
+    RenderPool *started;
+    {
+        std::lock_guard<mutex> guard(pool_lock);
+        if (pool == nullptr) {
+            pool = new RenderPool(pool_threads > 0 ? pool_threads
+                                                   : max((int)thread::hardware_concurrency() - 1, 1));
+        }
+        started = pool;
+    }
+    started->submit(job);
+}
+
+RenderJob::RenderJob(Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options)
+    : canvas(canvas), scene(scene), camera(camera), options(options) {
+    n_tiles = (canvas.width * canvas.height + options.tile_pixels - 1) / options.tile_pixels;
+}
+
+RenderJob::RenderJob(Canvas &canvas, const shared_ptr<const SceneSnapshot> &snapshot, const Camera &camera,
+                     const RenderOptions &options)
+    : RenderJob(canvas, snapshot->scene, camera, options) {
+    this->snapshot = snapshot;
+}
+
+RenderJob::~RenderJob() {
+    if (state != RENDER_JOB_QUEUED || !worker_stats.empty()) {
+        wait(-1);
+    }
+}
+
+float RenderJob::progress() const { return n_tiles == 0 ? 1 : (float)tiles_done / n_tiles; }
+
+bool RenderJob::wait(double timeout_seconds) {
+    std::unique_lock<mutex> guard(done_mutex);
+    auto is_done = [this]() { return state == RENDER_JOB_DONE; };
+    if (timeout_seconds < 0) {
+        done.wait(guard, is_done);
+        return true;
+    }
+    return done.wait_for(guard, std::chrono::duration<double>(timeout_seconds), is_done);
+}
+
+void RenderJob::build() {
+    TraceSpan span("octree build");
+    auto build_start = std::chrono::steady_clock::now();
+    if (snapshot != nullptr) {
+        octree = snapshot->octree(options);
+        instances = snapshot->instance_tree();
+    } else {
+        octree = std::make_shared<const Octree>(scene, options.octree_cache_dir, options.octree_depth,
+                                                options.parallel_limits());
+        instances = std::make_shared<const InstanceTree>(scene);
+    }
+    if (options.raster_primary) {
+        auto raster_start = std::chrono::steady_clock::now();
+        visibility = new VisibilityBuffer(rasterize(scene, camera, canvas.width, canvas.height, 1));
+        options.visibility = visibility;
+        raster_seconds = seconds_since(raster_start);
+    }
+    build_seconds = seconds_since(build_start);
+}
+
+// Runs on the last worker out, once no other worker can touch the job's trees.
+void RenderJob::finish() {
+    double render_seconds = seconds_since(render_start);
+    {
+        TraceSpan span("expose");
+        camera.expose(canvas);
+    }
+    stats = RenderStats();
+    for (RenderStats &worker : worker_stats) {
+        worker.idle_seconds = max(render_seconds - worker.busy_seconds, 0.0);
+        stats.merge(worker);
+    }
+    stats.build_seconds = build_seconds;
+    stats.raster_seconds = raster_seconds;
+    stats.build_bytes = build_bytes(scene, *octree);
+    stats.octree_cached = octree->mapping != nullptr;
+    stats.render_seconds = render_seconds;
+    delete visibility;
+    octree = nullptr;
+    instances = nullptr;
+    visibility = nullptr;
+    snapshot = nullptr;
+    options.visibility = nullptr;
+    std::lock_guard<mutex> guard(done_mutex);
+    state = RENDER_JOB_DONE;
+    done.notify_all();
+}
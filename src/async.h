@@ -0,0 +1,80 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+#include "render.h"
+#include "octree.h"
+#include "instance.h"
+#include "raster.h"
+#include "snapshot.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+using std::atomic;
+using std::condition_variable;
+using std::mutex;
+using std::vector;
+
+const int RENDER_JOB_QUEUED = 0;
+const int RENDER_JOB_BUILDING = 1;
+const int RENDER_JOB_RENDERING = 2;
+const int RENDER_JOB_DONE = 3;
+
+/**
+ * A render handed to the shared render pool. Jobs start in submission order: the first free worker
+ * builds a job's octree and instance tree, then every free worker takes tiles from the oldest job
+ * that has some left, so one job's build overlaps the previous one's tracing. Whichever worker
+ * finishes the last tile exposes the canvas, fills stats and wakes waiters. The canvas must outlive
+ * the job. A job made from a scene needs the scene to outlive it unchanged; one made from a
+ * snapshot holds the snapshot until its last tile is done and uses the snapshot's trees, so the
+ * scene it came from may be edited meanwhile. Pool workers are neither pinned nor
+ * NUMA-placed, so options.n_threads, cpus, pin_threads and numa do not apply. With raster_primary
+ * the building worker also rasterises the job's visibility, on its own.
+ **/
+class RenderJob {
+  public:
+    Canvas &canvas;
+    const Scene &scene;
+    Camera camera;
+    RenderOptions options;
+    atomic<int> state{RENDER_JOB_QUEUED};
+    int n_tiles;
+    atomic<int> next_tile{0};
+    atomic<int> tiles_done{0};
+    // Summary, valid once the job is done.
+    RenderStats stats;
+    RenderJob(Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options);
+    RenderJob(Canvas &canvas, const shared_ptr<const SceneSnapshot> &snapshot, const Camera &camera,
+              const RenderOptions &options);
+    RenderJob(const RenderJob &other) = delete;
+    // Waits for the job, since pool workers may still be using it.
+    ~RenderJob();
+    // Fraction of tiles traced, 0 while the job waits or builds.
+    float progress() const;
+    // True once done; gives up after timeout_seconds, or never when it is negative.
+    bool wait(double timeout_seconds);
+
+  private:
+    friend class RenderPool;
+    shared_ptr<const SceneSnapshot> snapshot;
+    shared_ptr<const Octree> octree;
+    shared_ptr<const InstanceTree> instances;
+    VisibilityBuffer *visibility = nullptr;
+    // One per pool worker, merged once every tile is done.
+    vector<RenderStats> worker_stats;
+    int active_workers = 0;
+    double build_seconds = 0;
+    double raster_seconds = 0;
+    std::chrono::steady_clock::time_point render_start;
+    mutex done_mutex;
+    condition_variable done;
+    void build();
+    void finish();
+};
+
+// Queues a job on the pool, starting the pool on first use.
+void submit_render(RenderJob *job);
+// Sets the pool's worker count if it has not started yet (0 means all but one hardware thread) and
+// returns the count it runs with.
+int render_pool_size(int n_threads);
+
+#endif
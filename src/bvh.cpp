@@ -0,0 +1,288 @@
+#include "bvh.h"
+#include "parallel.h"
+#include <stdlib.h>
+#include <string.h>
+
+const unsigned BVH_LEAF_TRIANGLES = 4;
+const int BVH_STACK_SIZE = 256;
+
+struct BinaryNode {
+  public:
+    BoundingBox box;
+    int left = -1;
+    int right = -1;
+    // Leaves: their slice of the Morton-sorted triangle order.
+    unsigned first = 0;
+    unsigned count = 0;
+};
+
+struct BvhStackEntry {
+    uint32_t node;
+    float t_entry;
+};
+
+static float surface_area(const BoundingBox &box) {
+    Vec3 e = box.max_xyz - box.min_xyz;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// Spreads the low 10 bits of v out to every third bit.
+static uint32_t spread_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x30000ff;
+    v = (v | (v << 8)) & 0x300f00f;
+    v = (v | (v << 4)) & 0x30c30c3;
+    v = (v | (v << 2)) & 0x9249249;
+    return v;
+}
+
+uint32_t morton_code_30(const Vec3 &point, const BoundingBox &bounds) {
+    Vec3 extent = bounds.max_xyz - bounds.min_xyz;
+    Vec3 c = point - bounds.min_xyz;
+    uint32_t x = extent.x > 0 ? c.x / extent.x * 1023 : 0;
+    uint32_t y = extent.y > 0 ? c.y / extent.y * 1023 : 0;
+    uint32_t z = extent.z > 0 ? c.z / extent.z * 1023 : 0;
+    return (spread_bits(x) << 2) | (spread_bits(y) << 1) | spread_bits(z);
+}
+
+// 2^e built straight from the float exponent bits.
+static inline float exp2_int(int e) {
+    uint32_t bits = (uint32_t)(e + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static int build_binary(vector<BinaryNode> &out, const vector<uint64_t> &keys, const vector<BoundingBox> &boxes,
+                        unsigned first, unsigned count) {
+    int index = out.size();
+    out.push_back(BinaryNode());
+    BoundingBox box = boxes[(uint32_t)keys[first]];
+    for (unsigned k = first + 1; k < first + count; k++) {
+        box.extend(boxes[(uint32_t)keys[k]]);
+    }
+    out[index].box = box;
+    if (count <= BVH_LEAF_TRIANGLES) {
+        out[index].first = first;
+        out[index].count = count;
+        return index;
+    }
+    uint32_t first_code = keys[first] >> 32;
+    uint32_t last_code = keys[first + count - 1] >> 32;
+    unsigned split = first + count / 2;
+    if (first_code != last_code) {
+        int bit = 31 - __builtin_clz(first_code ^ last_code);
+        split = std::partition_point(keys.begin() + first, keys.begin() + first + count,
+                                     [&](uint64_t key) { return ((key >> (32 + bit)) & 1) == 0; }) -
+                keys.begin();
+    }
+    int left = build_binary(out, keys, boxes, first, split - first);
+    int right = build_binary(out, keys, boxes, split, first + count - split);
+    out[index].left = left;
+    out[index].right = right;
+    return index;
+}
+
+static void quantise(CompressedNode &node, const vector<BinaryNode> &binary, const vector<int> &children) {
+    BoundingBox parent = binary[children[0]].box;
+    for (int c : children) {
+        parent.extend(binary[c].box);
+    }
+    float parent_min[3] = {parent.min_xyz.x, parent.min_xyz.y, parent.min_xyz.z};
+    float parent_max[3] = {parent.max_xyz.x, parent.max_xyz.y, parent.max_xyz.z};
+    for (int axis = 0; axis < 3; axis++) {
+        int exponent = 0;
+        float extent = parent_max[axis] - parent_min[axis];
+        if (extent > 0) {
+            // frexp leaves extent / 255 < 2^exponent, so every child fits in 255 cells.
+            frexpf(extent / 255, &exponent);
+        }
+        exponent = std::min(std::max(exponent, -126), 127);
+        node.origin[axis] = parent_min[axis];
+        node.exponent[axis] = exponent;
+        float scale = exp2_int(exponent);
+        for (size_t k = 0; k < children.size(); k++) {
+            const BoundingBox &box = binary[children[k]].box;
+            float child_min = axis == 0 ? box.min_xyz.x : (axis == 1 ? box.min_xyz.y : box.min_xyz.z);
+            float child_max = axis == 0 ? box.max_xyz.x : (axis == 1 ? box.max_xyz.y : box.max_xyz.z);
+            int lo = std::min(std::max((int)floorf((child_min - parent_min[axis]) / scale), 0), 255);
+            int hi = std::min(std::max((int)ceilf((child_max - parent_min[axis]) / scale), 0), 255);
+            // Rounding must only ever grow the box.
+            while (lo > 0 && node.origin[axis] + lo * scale > child_min) {
+                lo--;
+            }
+            while (hi < 255 && node.origin[axis] + hi * scale < child_max) {
+                hi++;
+            }
+            node.lo[axis][k] = lo;
+            node.hi[axis][k] = hi;
+        }
+    }
+}
+
+static uint32_t emit(vector<CompressedNode> &nodes, const vector<BinaryNode> &binary, int index) {
+    uint32_t slot = nodes.size();
+    nodes.push_back(CompressedNode());
+    vector<int> children;
+    if (binary[index].left == -1) {
+        children.push_back(index);
+    } else {
+        children = {binary[index].left, binary[index].right};
+    }
+    while (children.size() < BVH_WIDTH) {
+        int widest = -1;
+        for (size_t k = 0; k < children.size(); k++) {
+            if (binary[children[k]].left != -1 &&
+                (widest == -1 || surface_area(binary[children[k]].box) > surface_area(binary[children[widest]].box))) {
+                widest = k;
+            }
+        }
+        if (widest == -1) {
+            break;
+        }
+        int opened = children[widest];
+        children[widest] = binary[opened].left;
+        children.push_back(binary[opened].right);
+    }
+    CompressedNode node;
+    memset((void *)&node, 0, sizeof(node));
+    node.n_children = children.size();
+    quantise(node, binary, children);
+    for (size_t k = 0; k < children.size(); k++) {
+        const BinaryNode &child = binary[children[k]];
+        if (child.left == -1) {
+            node.child[k] = child.first;
+            node.n_triangles[k] = child.count;
+        } else {
+            node.child[k] = emit(nodes, binary, children[k]);
+        }
+    }
+    nodes[slot] = node;
+    return slot;
+}
+
+CompressedBvh::CompressedBvh(const vector<Triangle> &geometry, const ParallelLimits &limits)
+    : triangles(geometry.data()) {
+    size_t n = geometry.size();
+    if (n == 0) {
+        return;
+    }
+    vector<BoundingBox> boxes(n);
+    parallel_for(limits, n, [&](size_t t) { boxes[t] = geometry[t].get_bounds(); });
+    BoundingBox centroids;
+    centroids.min_xyz = (boxes[0].min_xyz + boxes[0].max_xyz) / 2;
+    centroids.max_xyz = centroids.min_xyz;
+    for (const BoundingBox &box : boxes) {
+        BoundingBox centroid;
+        centroid.min_xyz = (box.min_xyz + box.max_xyz) / 2;
+        centroid.max_xyz = centroid.min_xyz;
+        centroids.extend(centroid);
+    }
+    vector<uint64_t> keys(n);
+    parallel_for(limits, n, [&](size_t t) {
+        uint64_t code = morton_code_30((boxes[t].min_xyz + boxes[t].max_xyz) / 2, centroids);
+        keys[t] = (code << 32) | t;
+    });
+    parallel_sort(limits, keys);
+    triangle_indices.resize(n);
+    for (size_t k = 0; k < n; k++) {
+        triangle_indices[k] = (uint32_t)keys[k];
+    }
+    vector<BinaryNode> binary;
+    binary.reserve(2 * n / BVH_LEAF_TRIANGLES + 1);
+    build_binary(binary, keys, boxes, 0, n);
+    vector<CompressedNode> built;
+    emit(built, binary, 0);
+    n_nodes = built.size();
+    nodes = (CompressedNode *)aligned_alloc(64, n_nodes * sizeof(CompressedNode));
+    memcpy((void *)nodes, built.data(), n_nodes * sizeof(CompressedNode));
+}
+
+CompressedBvh::~CompressedBvh() { free(nodes); }
+
+size_t CompressedBvh::memory_bytes() const {
+    return n_nodes * sizeof(CompressedNode) + triangle_indices.size() * sizeof(unsigned);
+}
+
+/**
+ * Shared by closest-hit and any-hit queries: children are decoded and slab-tested together, leaf
+ * children are intersected right away and inner ones pushed farthest first, so the nearest pops
+ * next. Entries that start beyond the closest hit so far are dropped when popped.
+ **/
+template <bool ANY_HIT>
+static RaycastResult traverse_bvh(const CompressedBvh &bvh, const Vec3 &origin, const Vec3 &ray, float t_max,
+                                  RenderStats &stats) {
+    RaycastResult best_raycast(false);
+    if (bvh.n_nodes == 0) {
+        return best_raycast;
+    }
+    float o[3] = {origin.x, origin.y, origin.z};
+    float inv[3] = {1.f / ray.x, 1.f / ray.y, 1.f / ray.z};
+    BvhStackEntry stack[BVH_STACK_SIZE];
+    int depth = 0;
+    stack[depth++] = {0, 0};
+    while (depth > 0) {
+        BvhStackEntry entry = stack[--depth];
+        if (entry.t_entry > t_max) {
+            continue;
+        }
+        const CompressedNode &node = bvh.nodes[entry.node];
+        STAT_ADD(stats, nodes_visited, 1);
+        float t_near[3][BVH_WIDTH], t_far[3][BVH_WIDTH];
+        for (int axis = 0; axis < 3; axis++) {
+            float scale = exp2_int(node.exponent[axis]);
+            for (int k = 0; k < BVH_WIDTH; k++) {
+                float t0 = (node.origin[axis] + node.lo[axis][k] * scale - o[axis]) * inv[axis];
+                float t1 = (node.origin[axis] + node.hi[axis][k] * scale - o[axis]) * inv[axis];
+                t_near[axis][k] = min(t0, t1);
+                t_far[axis][k] = max(t0, t1);
+            }
+        }
+        BvhStackEntry inner[BVH_WIDTH];
+        int n_inner = 0;
+        for (int k = 0; k < node.n_children; k++) {
+            float t_enter = max(max(max(t_near[0][k], t_near[1][k]), t_near[2][k]), 0.f);
+            float t_exit = min(min(min(t_far[0][k], t_far[1][k]), t_far[2][k]), t_max);
+            if (t_enter > t_exit) {
+                continue;
+            }
+            if (node.n_triangles[k] == 0) {
+                inner[n_inner++] = {node.child[k], t_enter};
+                continue;
+            }
+            STAT_ADD(stats, triangle_tests, (long)node.n_triangles[k]);
+            for (unsigned ref = node.child[k]; ref < node.child[k] + node.n_triangles[k]; ref++) {
+                RaycastResult res = raycast(origin, ray, bvh.triangles[bvh.triangle_indices[ref]]);
+                STAT_ADD(stats, triangle_hits, res.hit);
+                if (res.hit && res.distance <= t_max) {
+                    if (ANY_HIT) {
+                        return res;
+                    }
+                    best_raycast = res;
+                    best_raycast.primitive = bvh.triangle_indices[ref];
+                    t_max = res.distance;
+                }
+            }
+        }
+        // Insertion sort, farthest first: there are at most four.
+        for (int k = 1; k < n_inner; k++) {
+            for (int j = k; j > 0 && inner[j - 1].t_entry < inner[j].t_entry; j--) {
+                swap(inner[j - 1], inner[j]);
+            }
+        }
+        for (int k = 0; k < n_inner && depth < BVH_STACK_SIZE; k++) {
+            stack[depth++] = inner[k];
+        }
+    }
+    return best_raycast;
+}
+
+RaycastResult intersect_bvh(const CompressedBvh &bvh, const Vec3 &origin, const Vec3 &ray, float t_max,
+                            RenderStats &stats) {
+    return traverse_bvh<false>(bvh, origin, ray, t_max, stats);
+}
+
+bool any_intersect_bvh(const CompressedBvh &bvh, const Vec3 &origin, const Vec3 &ray, float t_max,
+                       RenderStats &stats) {
+    return traverse_bvh<true>(bvh, origin, ray, t_max, stats).hit;
+}
@@ -0,0 +1,60 @@
+#ifndef BVH_H
+#define BVH_H
+#include "render.h"
+#include <stdint.h>
+#include <vector>
+using std::vector;
+
+const int BVH_WIDTH = 4;
+
+/**
+ * One cache line holding up to four children. Child bounds are stored as 8-bit grid coordinates
+ * relative to origin, with a power-of-two cell size per axis, rounded outwards so the decoded box
+ * always contains the child.
+ **/
+struct alignas(64) CompressedNode {
+  public:
+    float origin[3];
+    // Cell size along each axis is 2^exponent.
+    int8_t exponent[3];
+    uint8_t n_children;
+    // Axis-major, so one axis of all four children decodes together.
+    uint8_t lo[3][BVH_WIDTH];
+    uint8_t hi[3][BVH_WIDTH];
+    // Inner children: index of the child node. Leaf children: first of their references in
+    // CompressedBvh::triangle_indices.
+    uint32_t child[BVH_WIDTH];
+    // Triangle count of leaf children, 0 for inner children.
+    uint8_t n_triangles[BVH_WIDTH];
+    uint32_t padding;
+};
+static_assert(sizeof(CompressedNode) == 64, "CompressedNode must fill exactly one cache line");
+
+/**
+ * A 4-wide BVH in compressed nodes, for meshes too large for their octree to stay in cache. It is
+ * built from triangles sorted by the Morton code of their centroids: ranges split where the
+ * leading code bit changes, and the binary tree is collapsed into 4-wide nodes by repeatedly
+ * opening the child with the largest surface area. Traversal decodes the quantised bounds on the
+ * fly and visits children nearest first.
+ **/
+class CompressedBvh {
+  public:
+    CompressedNode *nodes = nullptr;
+    size_t n_nodes = 0;
+    vector<unsigned> triangle_indices;
+    const Triangle *triangles = nullptr;
+    CompressedBvh(const vector<Triangle> &geometry, const ParallelLimits &limits = ParallelLimits());
+    CompressedBvh(const CompressedBvh &other) = delete;
+    ~CompressedBvh();
+    size_t memory_bytes() const;
+};
+
+// 30-bit Morton code of a point, quantised to 1024 cells per axis of bounds.
+uint32_t morton_code_30(const Vec3 &point, const BoundingBox &bounds);
+
+RaycastResult intersect_bvh(const CompressedBvh &bvh, const Vec3 &origin, const Vec3 &ray, float t_max,
+                            RenderStats &stats);
+bool any_intersect_bvh(const CompressedBvh &bvh, const Vec3 &origin, const Vec3 &ray, float t_max,
+                       RenderStats &stats);
+
+#endif
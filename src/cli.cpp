@@ -0,0 +1,118 @@
+#include "render.h"
+#include "scene_file.h"
+#include "strips.h"
+#include <stdlib.h>
+#include <sys/resource.h>
+
+const char *USAGE =
+    "usage: render <scene file> <output .png or .pfm> [options]\n"
+    "  --width <n>, --height <n>   override the scene file's resolution\n"
+    "  --threads <n>               worker count, 0 for all but one hardware thread\n"
+    "  --tile <n>                  pixels per work item\n"
+    "  --depth <n>                 scene octree depth, 1 to 9\n"
+    "  --octree-cache <dir>        save built octrees to and map them back from dir\n"
+    "  --raster                    rasterise primary visibility\n"
+    "  --repeat <n>                render n times, writing the last\n"
+    "  --stats                     print each render's counters as a line of JSON\n";
+
+static int usage_error(const string &message) {
+    fprintf(stderr, "%s\n%s", message.c_str(), USAGE);
+    return 2;
+}
+
+static bool ends_with(const string &text, const string &suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void print_stats(int run, int width, int height, const RenderStats &stats) {
+    long rays = stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("{\"run\": %d, \"width\": %d, \"height\": %d, \"primary_rays\": %ld, \"secondary_rays\": %ld, "
+           "\"shadow_rays\": %ld, \"triangle_tests\": %ld, \"nodes_visited\": %ld, \"build_seconds\": %f, "
+           "\"raster_seconds\": %f, \"render_seconds\": %f, \"rays_per_second\": %f, \"peak_rss_kb\": %ld}\n",
+           run, width, height, stats.primary_rays, stats.secondary_rays, stats.shadow_rays, stats.triangle_tests,
+           stats.nodes_visited, stats.build_seconds, stats.raster_seconds, stats.render_seconds,
+           stats.render_seconds > 0 ? rays / stats.render_seconds : 0, usage.ru_maxrss);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    vector<string> positional;
+    RenderOptions options;
+    int width = 0, height = 0, repeat = 1;
+    bool print = false;
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        bool has_value = a + 1 < argc;
+        if (arg == "--raster") {
+            options.raster_primary = true;
+        } else if (arg == "--stats") {
+            print = true;
+        } else if (arg == "--octree-cache" && has_value) {
+            options.octree_cache_dir = argv[++a];
+        } else if (arg.rfind("--", 0) == 0 && has_value) {
+            char *end;
+            int value = strtol(argv[++a], &end, 10);
+            if (*end != '\0' || value < 0) {
+                return usage_error("bad value for " + arg);
+            }
+            if (arg == "--width") {
+                width = value;
+            } else if (arg == "--height") {
+                height = value;
+            } else if (arg == "--threads") {
+                options.n_threads = value;
+            } else if (arg == "--tile" && value > 0) {
+                options.tile_pixels = value;
+            } else if (arg == "--depth" && value == clamp_octree_depth(value)) {
+                options.octree_depth = value;
+            } else if (arg == "--repeat" && value > 0) {
+                repeat = value;
+            } else {
+                return usage_error("bad option " + arg);
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            return usage_error("bad option " + arg);
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) {
+        return usage_error("expected a scene file and an output path");
+    }
+    const string &output = positional[1];
+    int format;
+    if (ends_with(output, ".png")) {
+        format = IMAGE_FORMAT_PNG;
+    } else if (ends_with(output, ".pfm")) {
+        format = IMAGE_FORMAT_PFM;
+    } else {
+        return usage_error("output must end in .png or .pfm");
+    }
+
+    SceneDescription description;
+    description.build_limits = options.parallel_limits();
+    string error;
+    if (!read_scene_file(positional[0], description, error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+    width = width > 0 ? width : description.width;
+    height = height > 0 ? height : description.height;
+    Canvas canvas(height, width);
+    for (int run = 0; run < repeat; run++) {
+        memset(canvas.buffer, 0, canvas.bytes());
+        RenderStats stats;
+        render(canvas, description.scene, description.camera, options, &stats);
+        if (print) {
+            print_stats(run, width, height, stats);
+        }
+    }
+    StripWriter writer(output, format, width, height);
+    if (!writer.write(canvas.buffer, height) || !writer.close()) {
+        fprintf(stderr, "could not write %s\n", output.c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,225 @@
+#include "instance.h"
+#include "bvh.h"
+#include "simplify.h"
+
+const int INSTANCE_LEAF_SIZE = 2;
+const size_t MIN_LOD_TRIANGLES = 64;
+// Below this the octree's nodes stay in cache anyway and its cell-stepping wins.
+const size_t COMPRESSED_MIN_TRIANGLES = 1 << 16;
+
+Mesh::Mesh(const vector<Triangle> &geometry, int n_levels, int node_format, const ParallelLimits &limits) {
+    if (!geometry.empty()) {
+        bounds = geometry[0].get_bounds();
+    }
+    for (const Triangle &tri : geometry) {
+        bounds.extend(tri.get_bounds());
+    }
+    vector<size_t> targets;
+    for (size_t target = geometry.size() / 4; targets.size() + 1 < n_levels && target >= MIN_LOD_TRIANGLES;
+         target /= 4) {
+        targets.push_back(target);
+    }
+    vector<float> errors;
+    vector<vector<Triangle>> coarse;
+    if (!targets.empty()) {
+        coarse = simplify_levels(geometry, targets, errors, limits);
+    }
+    // Each tree points into its level's triangles, so the levels must not move once those exist.
+    levels.resize(1 + coarse.size());
+    levels[0].geometry = geometry;
+    for (size_t l = 0; l < coarse.size(); l++) {
+        levels[l + 1].geometry = std::move(coarse[l]);
+        levels[l + 1].error = errors[l];
+    }
+    for (MeshLevel &level : levels) {
+        bool compressed = node_format == NODE_FORMAT_COMPRESSED ||
+                          (node_format == NODE_FORMAT_AUTO && level.geometry.size() >= COMPRESSED_MIN_TRIANGLES);
+        if (compressed) {
+            level.bvh = new CompressedBvh(level.geometry, limits);
+        } else {
+            level.octree = new Octree(level.geometry, limits);
+        }
+    }
+}
+
+Mesh::~Mesh() {
+    for (MeshLevel &level : levels) {
+        delete level.octree;
+        delete level.bvh;
+    }
+}
+
+// The coarsest level whose error stays within max_error.
+int Mesh::level_for(float max_error) const {
+    for (int l = levels.size() - 1; l > 0; l--) {
+        if (levels[l].error <= max_error) {
+            return l;
+        }
+    }
+    return 0;
+}
+
+size_t Mesh::memory_bytes() const {
+    size_t bytes = 0;
+    for (const MeshLevel &level : levels) {
+        bytes += level.geometry.size() * sizeof(Triangle);
+        bytes += level.bvh != nullptr ? level.bvh->memory_bytes() : level.octree->memory_bytes();
+    }
+    return bytes;
+}
+
+Instance::Instance(int mesh, const Affine &object_to_world)
+    : mesh(mesh), object_to_world(object_to_world), world_to_object(object_to_world.inverse()) {
+    scale = max(max(object_to_world.direction(Vec3(1, 0, 0)).magnitude(),
+                    object_to_world.direction(Vec3(0, 1, 0)).magnitude()),
+                object_to_world.direction(Vec3(0, 0, 1)).magnitude());
+}
+
+InstanceTree::InstanceTree(const Scene &scene) {
+    for (int i = 0; i < scene.instances.size(); i++) {
+        const Instance &instance = scene.instances[i];
+        array<Vec3, 8> corners = scene.meshes[instance.mesh]->bounds.get_corners();
+        BoundingBox box;
+        box.min_xyz = instance.object_to_world.point(corners[0]);
+        box.max_xyz = box.min_xyz;
+        for (const Vec3 &corner : corners) {
+            BoundingBox point;
+            point.min_xyz = instance.object_to_world.point(corner);
+            point.max_xyz = point.min_xyz;
+            box.extend(point);
+        }
+        instance_bounds.push_back(box);
+        order.push_back(i);
+    }
+    if (!order.empty()) {
+        build(0, order.size());
+    }
+}
+
+int InstanceTree::build(int first, int count) {
+    int index = nodes.size();
+    nodes.push_back(InstanceNode());
+    BoundingBox bounds = instance_bounds[order[first]];
+    for (int i = first; i < first + count; i++) {
+        bounds.extend(instance_bounds[order[i]]);
+    }
+    nodes[index].bounds = bounds;
+    if (count <= INSTANCE_LEAF_SIZE) {
+        nodes[index].first = first;
+        nodes[index].count = count;
+        return index;
+    }
+    Vec3 extent = bounds.max_xyz - bounds.min_xyz;
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    auto centre = [&](int instance) {
+        Vec3 c = (instance_bounds[instance].min_xyz + instance_bounds[instance].max_xyz) / 2;
+        return axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+    };
+    int half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                     [&](int a, int b) { return centre(a) < centre(b); });
+    int left = build(first, half);
+    int right = build(first + half, count - half);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    return index;
+}
+
+// Calls visit(instance, entry) for every instance whose bounds the ray reaches before t_max, entry
+// being the distance at which it does. visit returns the new t_max, or a negative value to stop.
+template <typename F>
+static void traverse(const InstanceTree &tree, const Vec3 &origin, const Vec3 &ray, float t_max, F visit) {
+    Vec3 inv_ray = 1.f / ray;
+    int stack[64];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const InstanceNode &node = tree.nodes[stack[--depth]];
+        if (!node.bounds.hit_by(origin, inv_ray, t_max)) {
+            continue;
+        }
+        if (node.left == -1) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                float entry;
+                if (!tree.instance_bounds[tree.order[i]].hit_by(origin, inv_ray, t_max, &entry)) {
+                    continue;
+                }
+                t_max = visit(tree.order[i], entry);
+                if (t_max < 0) {
+                    return;
+                }
+            }
+        } else if (depth + 2 <= 64) {
+            stack[depth++] = node.right;
+            stack[depth++] = node.left;
+        }
+    }
+}
+
+// The level of an instance's mesh for a ray that reaches it at distance entry.
+static int instance_level(const Scene &scene, int index, float entry, const LodSelection &lod) {
+    if (index == lod.instance) {
+        return lod.level;
+    }
+    const Instance &instance = scene.instances[index];
+    return scene.meshes[instance.mesh]->level_for(lod.tolerance * entry / instance.scale);
+}
+
+RaycastResult intersect_instances(const Scene &scene, const InstanceTree &tree, const Vec3 &origin, const Vec3 &ray,
+                                  float t_max, const LodSelection &lod, RenderStats &stats) {
+    RaycastResult best_raycast(false);
+    if (tree.empty()) {
+        return best_raycast;
+    }
+    const Instance *best_instance = nullptr;
+    traverse(tree, origin, ray, t_max, [&](int index, float entry) {
+        const Instance &instance = scene.instances[index];
+        // The object-space direction is not renormalised, so hit distances stay comparable.
+        Vec3 object_origin = instance.world_to_object.point(origin);
+        Vec3 object_ray = instance.world_to_object.direction(ray);
+        int level = instance_level(scene, index, entry, lod);
+        const MeshLevel &mesh_level = scene.meshes[instance.mesh]->levels[level];
+        RaycastResult res = mesh_level.bvh != nullptr
+                                ? intersect_bvh(*mesh_level.bvh, object_origin, object_ray, t_max, stats)
+                                : intersect_octree(*mesh_level.octree, object_origin, object_ray, t_max, stats);
+        if (res.hit && res.distance < t_max) {
+            best_raycast = res;
+            best_raycast.instance = index;
+            best_raycast.level = level;
+            best_instance = &instance;
+            t_max = res.distance;
+        }
+        return t_max;
+    });
+    if (best_instance != nullptr) {
+        const Triangle &tri = best_raycast.triangle;
+        const Affine &to_world = best_instance->object_to_world;
+        int material = best_instance->material >= 0 ? best_instance->material : tri.material;
+        // The normal is recomputed from the transformed vertices, so it stays perpendicular under any
+        // invertible transform, non-uniform scaling included.
+        best_raycast.triangle = Triangle(to_world.point(tri.v0), to_world.point(tri.v1), to_world.point(tri.v2),
+                                         tri.normal, material);
+        best_raycast.intersect = origin + ray * best_raycast.distance;
+    }
+    return best_raycast;
+}
+
+bool any_intersect_instances(const Scene &scene, const InstanceTree &tree, const Vec3 &origin, const Vec3 &ray,
+                             float t_max, const LodSelection &lod, RenderStats &stats) {
+    if (tree.empty()) {
+        return false;
+    }
+    bool hit = false;
+    traverse(tree, origin, ray, t_max, [&](int index, float entry) {
+        const Instance &instance = scene.instances[index];
+        Vec3 object_origin = instance.world_to_object.point(origin);
+        Vec3 object_ray = instance.world_to_object.direction(ray);
+        int level = instance_level(scene, index, entry, lod);
+        const MeshLevel &mesh_level = scene.meshes[instance.mesh]->levels[level];
+        hit = mesh_level.bvh != nullptr
+                  ? any_intersect_bvh(*mesh_level.bvh, object_origin, object_ray, t_max, stats)
+                  : any_intersect_octree(*mesh_level.octree, object_origin, object_ray, t_max, stats);
+        return hit ? -1.f : t_max;
+    });
+    return hit;
+}
@@ -0,0 +1,40 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+#include "render.h"
+#include "octree.h"
+#include <vector>
+using std::vector;
+
+struct InstanceNode {
+  public:
+    BoundingBox bounds;
+    // Inner nodes: child indices. Leaves have left == -1 and own a slice of InstanceTree::order.
+    int left = -1;
+    int right = -1;
+    int first = 0;
+    int count = 0;
+};
+
+/**
+ * Top-level BVH over the world-space bounds of a scene's instances, split at the median of the
+ * longest axis. Rays reaching an instance are moved into its object space and traced through the
+ * mesh's own octree, so memory and build time follow the unique meshes, not the instance count.
+ **/
+class InstanceTree {
+  public:
+    vector<InstanceNode> nodes;
+    vector<int> order;
+    vector<BoundingBox> instance_bounds;
+    InstanceTree(const Scene &scene);
+    bool empty() const { return nodes.empty(); }
+
+  private:
+    int build(int first, int count);
+};
+
+RaycastResult intersect_instances(const Scene &scene, const InstanceTree &tree, const Vec3 &origin, const Vec3 &ray,
+                                  float t_max, const LodSelection &lod, RenderStats &stats);
+bool any_intersect_instances(const Scene &scene, const InstanceTree &tree, const Vec3 &origin, const Vec3 &ray,
+                             float t_max, const LodSelection &lod, RenderStats &stats);
+
+#endif
@@ -93,13 +93,61 @@ Vec3 const operator/(float s, const Vec3 &v) { return Vec3(s / v.x, s / v.y, s /
 
 /*********************** Matrix operations *************************************/
 
-float Mat3::det() {
+float Mat3::det() const {
     float det = data[0][0] * (data[1][1] * data[2][2] - data[1][2] * data[2][1]);
     det -= data[0][1] * (data[1][0] * data[2][2] - data[1][2] * data[2][0]);
-    det -= data[0][2] * (data[1][0] * data[2][1] - data[1][1] * data[2][0]);
+    det += data[0][2] * (data[1][0] * data[2][1] - data[1][1] * data[2][0]);
     return det;
 }
 
+// Relative to the column lengths, which bound the determinant, so uniformly small matrices still count.
+bool Mat3::invertible() const {
+    float bound = 1;
+    for (int j = 0; j < 3; j++) {
+        bound *= sqrt(data[0][j] * data[0][j] + data[1][j] * data[1][j] + data[2][j] * data[2][j]);
+    }
+    float d = det();
+    return std::isfinite(d) && fabs(d) > EPS * bound;
+}
+
+// Adjugate over determinant; singular matrices come back as NaNs, like solve().
+Mat3 Mat3::inverse() {
+    float d = det();
+    Mat3 inv = *this;
+    if (!invertible()) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                inv.data[i][j] = NAN;
+            }
+        }
+        return inv;
+    }
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3;
+            int c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            inv.data[i][j] = (data[r0][c0] * data[r1][c1] - data[r0][c1] * data[r1][c0]) / d;
+        }
+    }
+    return inv;
+}
+
+Mat3 Mat3::transpose() const {
+    return Mat3(Vec3(data[0][0], data[0][1], data[0][2]), Vec3(data[1][0], data[1][1], data[1][2]),
+                Vec3(data[2][0], data[2][1], data[2][2]));
+}
+
+Vec3 Mat3::operator*(const Vec3 &v) const {
+    return Vec3(data[0][0] * v.x + data[0][1] * v.y + data[0][2] * v.z,
+                data[1][0] * v.x + data[1][1] * v.y + data[1][2] * v.z,
+                data[2][0] * v.x + data[2][1] * v.y + data[2][2] * v.z);
+}
+
+Affine Affine::inverse() const {
+    Mat3 inv = Mat3(linear).inverse();
+    return Affine(inv, -(inv * translation));
+}
+
 Vec3 Mat3::solve(const Vec3 &b) {
     double determinant = det();
     if ((-EPS < determinant && determinant < EPS) || data[0][0] == 0) {
@@ -57,7 +57,27 @@ struct Mat3 {
         data[2][2] = c2.z;
     }
     Vec3 solve(const Vec3 &rhs);
-    float det();
+    float det() const;
+    // False for matrices whose determinant is negligible next to the product of their column lengths.
+    bool invertible() const;
+    Mat3 inverse();
+    Mat3 transpose() const;
+    Vec3 operator*(const Vec3 &v) const;
+};
+
+/**
+ * Affine transform p -> linear * p + translation.
+ **/
+struct Affine {
+  public:
+    Mat3 linear;
+    Vec3 translation;
+    Affine() : linear(Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 1)){};
+    Affine(const Mat3 &linear, const Vec3 &translation) : linear(linear), translation(translation){};
+    Vec3 point(const Vec3 &p) const { return linear * p + translation; }
+    Vec3 direction(const Vec3 &v) const { return linear * v; }
+    bool invertible() const { return linear.invertible(); }
+    Affine inverse() const;
 };
 
 
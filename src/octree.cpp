@@ -1,4 +1,67 @@
+#include "render.h"
 #include "octree.h"
+#include "parallel.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char OCTREE_FILE_MAGIC[8] = "TPOCTRE";
+const uint32_t OCTREE_FILE_VERSION = 2;
+const size_t HASH_CHUNK_TRIANGLES = 1 << 16;
+const size_t MAX_SPLIT_CELLS = 64;
+const size_t SPLIT_REFERENCE_BUDGET = 2;
+
+/**
+ * Header of a cached octree. The node array follows at nodes_offset and the packed triangle
+ * indices right after it, both in the in-memory layout so they can be used straight from a mapping.
+ **/
+struct OctreeFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    uint64_t geometry_hash;
+    uint64_t n_triangles;
+    uint64_t n_nodes;
+    uint64_t n_triangle_refs;
+    uint32_t max_depth;
+    uint32_t nodes_offset;
+};
+
+// malloc that fails like new does, rather than handing back NULL.
+static void *checked_malloc(size_t bytes) {
+    void *memory = malloc(bytes);
+    if (memory == nullptr && bytes > 0) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+// Index of the first node at a given depth in the level-order node array.
+static size_t level_offset(int depth) { return (((size_t)1 << (3 * depth)) - 1) / 7; }
+
+// Gathers every third bit of code, undoing the interleave in morton_code().
+static unsigned compact_bits(uint64_t code) {
+    code &= 0x1249249249249249;
+    code = (code ^ (code >> 2)) & 0x10c30c30c30c30c3;
+    code = (code ^ (code >> 4)) & 0x100f00f00f00f00f;
+    code = (code ^ (code >> 8)) & 0x1f0000ff0000ff;
+    code = (code ^ (code >> 16)) & 0x1f00000000ffff;
+    code = (code ^ (code >> 32)) & 0x1fffff;
+    return code;
+}
+
+// Interleaves cell coordinates into a child path, x/y/z in the same bit order get_child() uses.
+static uint64_t morton_code(const unsigned coords[3], int depth) {
+    uint64_t code = 0;
+    for (int level = 0; level < depth; level++) {
+        for (int axis = 0; axis < 3; axis++) {
+            code |= (uint64_t)((coords[axis] >> level) & 1) << (3 * level + 2 - axis);
+        }
+    }
+    return code;
+}
 
 OctreeNode *OctreeNode::get_child(const Vec3 &point) {
     if (is_leaf) {
@@ -7,25 +70,8 @@ OctreeNode *OctreeNode::get_child(const Vec3 &point) {
     unsigned bitcode = 0;
     bitcode |= (point.x >= yz_plane) << 2;
     bitcode |= (point.y >= xz_plane) << 1;
-    bitcode |= (point.z >= yz_plane) << 0;
-    return children[bitcode];
-}
-
-void OctreeNode::expand_children(int max_depth) {
-    if (depth >= max_depth) {
-        return;
-    }
-    is_leaf = false;
-    for (unsigned bitcode = 0; bitcode < 8; bitcode++) {
-        int xp = 2 * (bitcode >> 2) - 1;
-        int yp = 2 * ((bitcode >> 1) & 1) - 1;
-        int zp = 2 * (bitcode & 1) - 1;
-        float yz_offset = xp * radial / 2;
-        float xz_offset = yp * radial / 2;
-        float xy_offset = zp * radial / 2;
-        children[bitcode] = new OctreeNode(yz_plane + yz_offset, xz_plane + xz_offset, xy_plane * xy_offset, this);
-        children[bitcode]->expand_children(max_depth);
-    }
+    bitcode |= (point.z >= xy_plane) << 0;
+    return this + child_offset + bitcode;
 }
 
 float OctreeNode::planes_intersection(const Vec3 &origin, const Vec3 &ray) {
@@ -72,22 +118,32 @@ float OctreeNode::planes_intersection(const Vec3 &origin, const Vec3 &ray) {
         t_z_min = (z_max - origin.z) / ray.z;
     }
 
-    if ((t_min > t_z_max) || (t_min > t_z_max))
+    if ((t_min > t_z_max) || (t_z_min > t_max))
         return -1;
     if (t_z_min > t_min)
         t_min = t_z_min;
     if (t_z_max < t_max)
         t_max = t_z_max;
 
-    return max((t_max + t_min) / 2.f, 0.f);
+    if (t_max < 0)
+        return -1;
+    // Enter just inside the box, so traversal starts in the first cell the ray touches.
+    return max(t_min, 0.f) + (t_max - max(t_min, 0.f)) * 1e-4f;
 }
 
-OctreeNode::~OctreeNode() {
-    if (!is_leaf) {
-        for (int i = 0; i < 8; i++) {
-            delete children[i];
-        }
+// Distance along ray from a point inside this node to where the ray leaves it.
+float OctreeNode::exit_distance(const Vec3 &point, const Vec3 &ray) const {
+    float t_exit = std::numeric_limits<float>::infinity();
+    if (ray.x != 0) {
+        t_exit = min(t_exit, (yz_plane + (ray.x > 0 ? radial : -radial) - point.x) / ray.x);
+    }
+    if (ray.y != 0) {
+        t_exit = min(t_exit, (xz_plane + (ray.y > 0 ? radial : -radial) - point.y) / ray.y);
     }
+    if (ray.z != 0) {
+        t_exit = min(t_exit, (xy_plane + (ray.z > 0 ? radial : -radial) - point.z) / ray.z);
+    }
+    return max(t_exit, 0.f);
 }
 
 OctreeNode *Octree::get_lowest_common_ancestor(OctreeNode *a, OctreeNode *b) const {
@@ -99,36 +155,431 @@ OctreeNode *Octree::get_lowest_common_ancestor(OctreeNode *a, OctreeNode *b) con
     }
     while (a != b) {
         if (a->depth == b->depth) {
-            a = a->parent;
-            b = b->parent;
+            a = a->get_parent();
+            b = b->get_parent();
         } else if (a->depth > b->depth) {
-            a = a->parent;
+            a = a->get_parent();
         } else {
-            b = b->parent;
+            b = b->get_parent();
         }
     }
     return a;
 }
 
-Octree::Octree(const Scene &scene) {
-    root = new OctreeNode(0.1, 0.1, 0.1, 7); // TODO: compute this from the scene.
-    root->expand_children(8);
-    printf("OCTN SZ: %zu\n", sizeof(OctreeNode) * 8 * 8 * 8 * 8 * 8 * 8);
-    for (int i = 0; i < scene.geometry.size(); i++) {
-        OctreeNode *root = nullptr;
-        Triangle const *tri = &(scene.geometry[i]);
-        BoundingBox box = tri->get_bounds();
-        for (Vec3 &vec : box.get_corners()) {
-            OctreeNode *node = get_node(vec);
-            root = get_lowest_common_ancestor(root, node);
+// Center and half-size of a cube just enclosing the geometry.
+static float bounding_cube(const vector<Triangle> &geometry, Vec3 &center) {
+    BoundingBox bounds;
+    if (!geometry.empty()) {
+        bounds = geometry[0].get_bounds();
+    }
+    for (const Triangle &tri : geometry) {
+        bounds.extend(tri.get_bounds());
+    }
+    Vec3 extent = bounds.max_xyz - bounds.min_xyz;
+    center = (bounds.min_xyz + bounds.max_xyz) / 2;
+    return max(max(extent.x, extent.y), extent.z) / 2 * 1.001f + EPS;
+}
+
+Octree::Octree(const Scene &scene, const string &cache_dir, int depth, const ParallelLimits &limits)
+    : max_depth(clamp_octree_depth(depth)), triangles(scene.geometry.data()) {
+    string path;
+    uint64_t hash = 0;
+    if (!cache_dir.empty()) {
+        hash = geometry_hash(scene.geometry, limits);
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.octree", (unsigned long long)hash);
+        path = cache_dir + name;
+        if (load(path, hash, scene.geometry.size())) {
+            return;
         }
-        if (root->triangles == nullptr) {
-            root->triangles = new vector<const Triangle *>();
+    }
+    if (scene.geometry.empty()) {
+        max_depth = 0;
+    }
+    Vec3 center;
+    float radial = bounding_cube(scene.geometry, center);
+    build_nodes(center, radial, limits);
+    insert_triangles(scene.geometry, limits);
+    if (!path.empty() && !save(path, hash, scene.geometry.size())) {
+        fprintf(stderr, "could not write octree cache %s\n", path.c_str());
+    }
+}
+
+// Fitted to the geometry's bounding cube, for meshes traced in their own object space. The depth
+// grows with the triangle count, aiming for a few triangles per occupied leaf of a surface.
+Octree::Octree(const vector<Triangle> &geometry, const ParallelLimits &limits) : triangles(geometry.data()) {
+    max_depth = 1;
+    while (max_depth < 8 && ((size_t)1 << (2 * max_depth)) < geometry.size() / 4) {
+        max_depth++;
+    }
+    Vec3 center;
+    float radial = bounding_cube(geometry, center);
+    build_nodes(center, radial, limits);
+    insert_triangles(geometry, limits);
+}
+
+// Copies always live on the heap, even when the original is mapped.
+Octree::Octree(const Octree &other)
+    : max_depth(other.max_depth), n_nodes(other.n_nodes), n_triangle_refs(other.n_triangle_refs),
+      triangles(other.triangles), planes(other.planes) {
+    nodes = (OctreeNode *)checked_malloc(n_nodes * sizeof(OctreeNode));
+    memcpy((void *)nodes, other.nodes, n_nodes * sizeof(OctreeNode));
+    triangle_indices = (unsigned *)checked_malloc(n_triangle_refs * sizeof(unsigned));
+    memcpy(triangle_indices, other.triangle_indices, n_triangle_refs * sizeof(unsigned));
+    root = nodes;
+}
+
+Octree::~Octree() {
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_bytes);
+    } else {
+        free(nodes);
+        free(triangle_indices);
+    }
+}
+
+/**
+ * FNV-1a over the vertex coordinates, hashed in fixed-size chunks in parallel and then combined in
+ * order, so the result does not depend on the thread count.
+ **/
+uint64_t geometry_hash(const vector<Triangle> &geometry, const ParallelLimits &limits) {
+    const uint64_t FNV_OFFSET = 14695981039346656037ull;
+    const uint64_t FNV_PRIME = 1099511628211ull;
+    size_t n_chunks = (geometry.size() + HASH_CHUNK_TRIANGLES - 1) / HASH_CHUNK_TRIANGLES;
+    vector<uint64_t> chunk_hashes(n_chunks);
+    parallel_for(
+        limits, n_chunks,
+        [&](size_t chunk) {
+            uint64_t hash = FNV_OFFSET;
+            size_t end = min(geometry.size(), (chunk + 1) * HASH_CHUNK_TRIANGLES);
+            for (size_t t = chunk * HASH_CHUNK_TRIANGLES; t < end; t++) {
+                const Triangle &tri = geometry[t];
+                float coords[9] = {tri.v0.x, tri.v0.y, tri.v0.z, tri.v1.x, tri.v1.y,
+                                   tri.v1.z, tri.v2.x, tri.v2.y, tri.v2.z};
+                const unsigned char *bytes = (const unsigned char *)coords;
+                for (size_t b = 0; b < sizeof(coords); b++) {
+                    hash = (hash ^ bytes[b]) * FNV_PRIME;
+                }
+            }
+            chunk_hashes[chunk] = hash;
+        },
+        1);
+    uint64_t hash = FNV_OFFSET ^ geometry.size();
+    for (uint64_t chunk_hash : chunk_hashes) {
+        hash = (hash ^ chunk_hash) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// mkstemp names are unique across threads and processes alike, so two builds of the same geometry,
+// say by two queued renders, never write through the same temporary file.
+FILE *create_temp_file(const string &path, string &tmp_path) {
+    vector<char> name(path.begin(), path.end());
+    const char suffix[] = ".tmp.XXXXXX";
+    name.insert(name.end(), suffix, suffix + sizeof(suffix));
+    int fd = mkstemp(name.data());
+    if (fd < 0) {
+        return nullptr;
+    }
+    // mkstemp creates the file private to its owner; caches are readable by all, like other output.
+    fchmod(fd, 0644);
+    tmp_path = name.data();
+    FILE *out = fdopen(fd, "wb");
+    if (out == nullptr) {
+        close(fd);
+        unlink(tmp_path.c_str());
+    }
+    return out;
+}
+
+// Written to a temporary file and renamed into place, so concurrent renders never see a partial file.
+bool Octree::save(const string &path, uint64_t hash, size_t n_triangles) const {
+    OctreeFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OCTREE_FILE_MAGIC, sizeof(header.magic));
+    header.version = OCTREE_FILE_VERSION;
+    header.node_size = sizeof(OctreeNode);
+    header.geometry_hash = hash;
+    header.n_triangles = n_triangles;
+    header.n_nodes = n_nodes;
+    header.n_triangle_refs = n_triangle_refs;
+    header.max_depth = max_depth;
+    header.nodes_offset = 64;
+    string tmp_path;
+    FILE *out = create_temp_file(path, tmp_path);
+    if (out == nullptr) {
+        return false;
+    }
+    char padding[64] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(padding, header.nodes_offset - sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(nodes, sizeof(OctreeNode), n_nodes, out) == n_nodes;
+    ok = ok && fwrite(triangle_indices, sizeof(unsigned), n_triangle_refs, out) == n_triangle_refs;
+    ok = (fclose(out) == 0) && ok;
+    ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        unlink(tmp_path.c_str());
+    }
+    return ok;
+}
+
+// Maps a cached octree read-only. Any mismatch in the header or size means it gets rebuilt.
+bool Octree::load(const string &path, uint64_t hash, size_t n_triangles) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(OctreeFileHeader)) {
+        close(fd);
+        return false;
+    }
+    void *memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    const OctreeFileHeader *header = (const OctreeFileHeader *)memory;
+    size_t expected_bytes = header->nodes_offset + header->n_nodes * sizeof(OctreeNode) +
+                            header->n_triangle_refs * sizeof(unsigned);
+    if (memcmp(header->magic, OCTREE_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != OCTREE_FILE_VERSION || header->node_size != sizeof(OctreeNode) ||
+        (n_triangles > 0 && header->max_depth != (uint32_t)max_depth) ||
+        header->geometry_hash != hash || header->n_triangles != n_triangles ||
+        (size_t)info.st_size != expected_bytes || header->n_nodes == 0) {
+        munmap(memory, info.st_size);
+        return false;
+    }
+    mapping = memory;
+    mapping_bytes = info.st_size;
+    max_depth = header->max_depth;
+    n_nodes = header->n_nodes;
+    n_triangle_refs = header->n_triangle_refs;
+    nodes = (OctreeNode *)((char *)memory + header->nodes_offset);
+    triangle_indices = (unsigned *)((char *)nodes + n_nodes * sizeof(OctreeNode));
+    root = nodes;
+    return true;
+}
+
+// Lays out the complete tree. Nodes are independent of each other, so each level is filled in parallel.
+void Octree::build_nodes(const Vec3 &center, float radial, const ParallelLimits &limits) {
+    unsigned n_cells = 1u << max_depth;
+    float cell_size = 2 * radial / n_cells;
+    float mins[3] = {center.x - radial, center.y - radial, center.z - radial};
+    for (int axis = 0; axis < 3; axis++) {
+        planes[axis].resize(n_cells - 1);
+        for (unsigned k = 1; k < n_cells; k++) {
+            planes[axis][k - 1] = mins[axis] + k * cell_size;
+        }
+    }
+    n_nodes = level_offset(max_depth + 1);
+    nodes = (OctreeNode *)checked_malloc(n_nodes * sizeof(OctreeNode));
+    root = nodes;
+    for (int depth = 0; depth <= max_depth; depth++) {
+        size_t offset = level_offset(depth);
+        int shift = max_depth - depth;
+        parallel_for(limits, (size_t)1 << (3 * depth), [&](size_t code) {
+            size_t i = offset + code;
+            unsigned coords[3] = {compact_bits(code >> 2), compact_bits(code >> 1), compact_bits(code)};
+            // Inner nodes split on the shared leaf-grid planes so descents agree exactly with cell().
+            float split[3];
+            for (int axis = 0; axis < 3; axis++) {
+                if (shift > 0) {
+                    split[axis] = planes[axis][((2 * coords[axis] + 1) << (shift - 1)) - 1];
+                } else {
+                    split[axis] = mins[axis] + (coords[axis] + 0.5f) * cell_size;
+                }
+            }
+            OctreeNode *node = new (&nodes[i]) OctreeNode(split[0], split[1], split[2], radial / (1 << depth));
+            node->depth = depth;
+            node->is_leaf = shift == 0;
+            node->child_offset = node->is_leaf ? 0 : 7 * i + 1;
+            node->parent_offset = i == 0 ? 0 : i - (i - 1) / 8;
+        });
+    }
+}
+
+// Leaf-grid cell of a coordinate, clamped to the tree the same way a get_child() descent is.
+unsigned Octree::cell(int axis, float value) const {
+    return std::upper_bound(planes[axis].begin(), planes[axis].end(), value) - planes[axis].begin();
+}
+
+// Separating-axis test of a triangle against an axis-aligned box (Akenine-Moller).
+static bool triangle_overlaps_box(const Triangle &tri, const Vec3 &box_min, const Vec3 &box_max) {
+    Vec3 center = (box_min + box_max) / 2;
+    Vec3 half = (box_max - box_min) / 2;
+    Vec3 v[3] = {tri.v0 - center, tri.v1 - center, tri.v2 - center};
+    Vec3 edges[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+    Vec3 box_axes[3] = {Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 1)};
+    auto separated = [&](const Vec3 &axis) {
+        float p0 = v[0] ^ axis, p1 = v[1] ^ axis, p2 = v[2] ^ axis;
+        float r = half.x * fabs(axis.x) + half.y * fabs(axis.y) + half.z * fabs(axis.z);
+        return min(min(p0, p1), p2) > r || max(max(p0, p1), p2) < -r;
+    };
+    if (separated(edges[0] % edges[1])) {
+        return false;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (separated(box_axes[i])) {
+            return false;
+        }
+        for (int j = 0; j < 3; j++) {
+            if (separated(box_axes[i] % edges[j])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Calls f(node) for every node at split_depth whose cell the triangle overlaps. The outermost cells
+ * reach out to the triangle's bounds, matching the clamping in cell().
+ **/
+template <typename F>
+void Octree::for_split_cells(const Triangle &tri, const unsigned lo[3], const unsigned hi[3], int split_depth,
+                             F f) const {
+    int shift = max_depth - split_depth;
+    unsigned n_cells = 1u << split_depth;
+    BoundingBox bounds = tri.get_bounds();
+    float tri_min[3] = {bounds.min_xyz.x, bounds.min_xyz.y, bounds.min_xyz.z};
+    float tri_max[3] = {bounds.max_xyz.x, bounds.max_xyz.y, bounds.max_xyz.z};
+    unsigned first[3], last[3];
+    for (int axis = 0; axis < 3; axis++) {
+        first[axis] = lo[axis] >> shift;
+        last[axis] = hi[axis] >> shift;
+    }
+    auto edge = [&](int axis, unsigned c, bool upper) {
+        if (upper) {
+            return c + 1 == n_cells ? tri_max[axis] : planes[axis][((c + 1) << shift) - 1];
+        }
+        return c == 0 ? tri_min[axis] : planes[axis][(c << shift) - 1];
+    };
+    unsigned c[3];
+    for (c[0] = first[0]; c[0] <= last[0]; c[0]++) {
+        for (c[1] = first[1]; c[1] <= last[1]; c[1]++) {
+            for (c[2] = first[2]; c[2] <= last[2]; c[2]++) {
+                // A little slack keeps triangles lying exactly on a cell face in both neighbours.
+                float slack = (edge(0, c[0], true) - edge(0, c[0], false)) * 1e-4f + EPS;
+                Vec3 box_min(edge(0, c[0], false) - slack, edge(1, c[1], false) - slack, edge(2, c[2], false) - slack);
+                Vec3 box_max(edge(0, c[0], true) + slack, edge(1, c[1], true) + slack, edge(2, c[2], true) + slack);
+                if (triangle_overlaps_box(tri, box_min, box_max)) {
+                    f(level_offset(split_depth) + morton_code(c, split_depth));
+                }
+            }
+        }
+    }
+}
+
+/**
+ * The lowest node containing a triangle's bounding box is the common prefix of the Morton codes of
+ * its min and max corners. A triangle stuck high up that way, because it is large or merely
+ * crosses a split plane, is instead referenced from every cell it overlaps at the deepest level
+ * where its bounds cover at most MAX_SPLIT_CELLS cells, so rays only meet it near where it
+ * actually is. Splits go to the highest-placed triangles first until they would add more than
+ * SPLIT_REFERENCE_BUDGET references per triangle. Each reference gets a (node, triangle) key in
+ * parallel; one parallel sort then groups the keys into per-node runs.
+ **/
+void Octree::insert_triangles(const vector<Triangle> &geometry, const ParallelLimits &limits) {
+    size_t n = geometry.size();
+    vector<uint64_t> home_node(n);
+    vector<int> split_depth(n, -1);
+    vector<unsigned> n_refs(n, 1);
+    vector<array<unsigned, 6>> cell_ranges(n);
+    parallel_for(limits, n, [&](size_t t) {
+        BoundingBox box = geometry[t].get_bounds();
+        unsigned *lo = cell_ranges[t].data(), *hi = lo + 3;
+        lo[0] = cell(0, box.min_xyz.x);
+        lo[1] = cell(1, box.min_xyz.y);
+        lo[2] = cell(2, box.min_xyz.z);
+        hi[0] = cell(0, box.max_xyz.x);
+        hi[1] = cell(1, box.max_xyz.y);
+        hi[2] = cell(2, box.max_xyz.z);
+        unsigned differing = (lo[0] ^ hi[0]) | (lo[1] ^ hi[1]) | (lo[2] ^ hi[2]);
+        int shift = 0;
+        while ((differing >> shift) != 0) {
+            shift++;
+        }
+        int depth = max_depth - shift;
+        unsigned coords[3] = {lo[0] >> shift, lo[1] >> shift, lo[2] >> shift};
+        home_node[t] = level_offset(depth) + morton_code(coords, depth);
+        for (int split = max_depth; split > depth; split--) {
+            int split_shift = max_depth - split;
+            size_t n_cells = 1;
+            for (int axis = 0; axis < 3; axis++) {
+                n_cells *= (hi[axis] >> split_shift) - (lo[axis] >> split_shift) + 1;
+            }
+            if (n_cells <= MAX_SPLIT_CELLS) {
+                unsigned count = 0;
+                for_split_cells(geometry[t], lo, hi, split, [&](uint64_t) { count++; });
+                if (count > 0) {
+                    split_depth[t] = split;
+                    n_refs[t] = count;
+                }
+                break;
+            }
+        }
+    });
+
+    vector<size_t> split;
+    size_t extra_refs = 0;
+    for (size_t t = 0; t < n; t++) {
+        if (split_depth[t] >= 0) {
+            split.push_back(t);
+            extra_refs += n_refs[t] - 1;
+        }
+    }
+    size_t budget = SPLIT_REFERENCE_BUDGET * n;
+    if (extra_refs > budget) {
+        std::stable_sort(split.begin(), split.end(), [&](size_t a, size_t b) { return home_node[a] < home_node[b]; });
+        extra_refs = 0;
+        for (size_t t : split) {
+            if (extra_refs + n_refs[t] - 1 <= budget) {
+                extra_refs += n_refs[t] - 1;
+            } else {
+                split_depth[t] = -1;
+                n_refs[t] = 1;
+            }
         }
-        root->triangles->push_back(tri);
     }
+
+    vector<size_t> first_key(n + 1, 0);
+    for (size_t t = 0; t < n; t++) {
+        first_key[t + 1] = first_key[t] + n_refs[t];
+    }
+    vector<uint64_t> keys(first_key[n]);
+    parallel_for(limits, n, [&](size_t t) {
+        if (split_depth[t] < 0) {
+            keys[first_key[t]] = (home_node[t] << 32) | t;
+            return;
+        }
+        size_t k = first_key[t];
+        const unsigned *lo = cell_ranges[t].data();
+        for_split_cells(geometry[t], lo, lo + 3, split_depth[t], [&](uint64_t node) { keys[k++] = (node << 32) | t; });
+    });
+    parallel_sort(limits, keys);
+    n_triangle_refs = keys.size();
+    triangle_indices = (unsigned *)checked_malloc(n_triangle_refs * sizeof(unsigned));
+    parallel_for(limits, keys.size(), [&](size_t k) {
+        triangle_indices[k] = (unsigned)keys[k];
+        uint64_t node = keys[k] >> 32;
+        if (k == 0 || (keys[k - 1] >> 32) != node) {
+            nodes[node].first_triangle = k;
+        }
+    });
+    parallel_for(limits, keys.size(), [&](size_t k) {
+        uint64_t node = keys[k] >> 32;
+        if (k + 1 == keys.size() || (keys[k + 1] >> 32) != node) {
+            nodes[node].n_triangles = k + 1 - nodes[node].first_triangle;
+        }
+    });
 }
-Octree::~Octree() { delete root; }
+
+size_t Octree::memory_bytes() const {
+    return n_nodes * sizeof(OctreeNode) + n_triangle_refs * sizeof(unsigned) +
+           3 * planes[0].size() * sizeof(float);
+}
+
 OctreeNode *Octree::get_node(const Vec3 &vec) const {
     OctreeNode *node = root;
     while (!node->is_leaf) {
@@ -151,13 +602,14 @@ OctreeLookup Octree::get_new_triangles(const Vec3 &point) const {
     }
     OctreeNode *node = root;
     while (!node->is_leaf) {
-        if (node->triangles != nullptr) {
-            lookup.path.push_back(node->triangles);
+        if (node->n_triangles != 0) {
+            lookup.path.push_back(node);
         }
         node = node->get_child(point);
+        lookup.nodes_visited++;
     }
-    if (node->triangles != nullptr) {
-        lookup.path.push_back(node->triangles);
+    if (node->n_triangles != 0) {
+        lookup.path.push_back(node);
     }
     lookup.node = node;
     lookup.is_valid = true;
@@ -176,28 +628,60 @@ OctreeLookup Octree::get_new_triangles(const Vec3 &point, OctreeNode *previous_n
         return lookup;
     }
     OctreeNode *node = lca->get_child(point);
+    lookup.nodes_visited++;
     while (!node->is_leaf) {
-        if (node->triangles != nullptr) {
-            lookup.path.push_back(node->triangles);
+        if (node->n_triangles != 0) {
+            lookup.path.push_back(node);
         }
         node = node->get_child(point);
+        lookup.nodes_visited++;
     }
-    if (node->triangles != nullptr) {
-        lookup.path.push_back(node->triangles);
+    if (node->n_triangles != 0) {
+        lookup.path.push_back(node);
     }
     lookup.node = node;
     lookup.is_valid = true;
     return lookup;
 }
 
-vector<Vec3> BoundingBox::get_corners() {
-    vector<Vec3> rv(8);
+void BoundingBox::extend(const BoundingBox &other) {
+    min_xyz = Vec3(min(min_xyz.x, other.min_xyz.x), min(min_xyz.y, other.min_xyz.y), min(min_xyz.z, other.min_xyz.z));
+    max_xyz = Vec3(max(max_xyz.x, other.max_xyz.x), max(max_xyz.y, other.max_xyz.y), max(max_xyz.z, other.max_xyz.z));
+}
+
+// Slab test against [0, t_max] along the ray; inv_ray is 1 / ray. t_entry receives where the ray
+// enters the box, 0 when it starts inside.
+bool BoundingBox::hit_by(const Vec3 &origin, const Vec3 &inv_ray, float t_max, float *t_entry) const {
+    float t_min = 0;
+    float axis_min[3] = {min_xyz.x, min_xyz.y, min_xyz.z};
+    float axis_max[3] = {max_xyz.x, max_xyz.y, max_xyz.z};
+    float o[3] = {origin.x, origin.y, origin.z};
+    float inv[3] = {inv_ray.x, inv_ray.y, inv_ray.z};
+    for (int axis = 0; axis < 3; axis++) {
+        float t0 = (axis_min[axis] - o[axis]) * inv[axis];
+        float t1 = (axis_max[axis] - o[axis]) * inv[axis];
+        if (t0 > t1) {
+            swap(t0, t1);
+        }
+        t_min = max(t_min, t0);
+        t_max = min(t_max, t1);
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    if (t_entry != nullptr) {
+        *t_entry = t_min;
+    }
+    return true;
+}
+
+array<Vec3, 8> BoundingBox::get_corners() {
+    array<Vec3, 8> rv;
     for (unsigned bitpattern = 0; bitpattern < 8; bitpattern++) {
-        Vec3 vec;
+        Vec3 &vec = rv[bitpattern];
         vec.x = bitpattern & 1 ? max_xyz.x : min_xyz.x;
         vec.y = (bitpattern >> 1) & 1 ? max_xyz.y : min_xyz.y;
         vec.z = (bitpattern >> 2) & 1 ? max_xyz.z : min_xyz.z;
-        rv.push_back(vec);
     }
     return rv;
-}
\ No newline at end of file
+}
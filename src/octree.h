@@ -1,7 +1,13 @@
 #ifndef OCTREE_H
 #define OCTREE_H
+#include "parallel.h"
 #include "render.h"
+#include <array>
+#include <stdint.h>
+#include <string>
 #include <vector>
+using std::array;
+using std::string;
 using std::vector;
 
 class OctreeNode;
@@ -10,54 +16,103 @@ struct BoundingBox;
 struct Triangle;
 struct Scene;
 
+const int DEFAULT_OCTREE_DEPTH = 8;
+// Node ids and child offsets are 32-bit, which depth 11 overflows, and depth 10 already takes tens
+// of GB of nodes.
+const int MAX_OCTREE_DEPTH = 9;
+
+// The nearest depth a scene octree can be built at. Every way of choosing a depth goes through this.
+inline int clamp_octree_depth(int depth) { return depth < 1 ? 1 : depth > MAX_OCTREE_DEPTH ? MAX_OCTREE_DEPTH : depth; }
+
+/**
+ * A complete octree stored as one level-order node array (children of node i are 8i + 1 .. 8i + 8)
+ * with every triangle referenced from the lowest node containing its bounding box, or split into
+ * references from the deeper cells it overlaps. Those references are packed per node into
+ * triangle_indices, so a triangle may appear more than once.
+ * Given a cache directory, the built arrays are saved to <cache_dir>/<geometry hash>.octree and
+ * later constructions of the same geometry map that file read-only instead of building.
+ **/
 class Octree {
   public:
     OctreeNode *root;
+    int max_depth = DEFAULT_OCTREE_DEPTH;
+    size_t n_nodes = 0;
+    OctreeNode *nodes = nullptr;
+    unsigned *triangle_indices = nullptr;
+    size_t n_triangle_refs = 0;
+    const Triangle *triangles = nullptr;
+    // Set when nodes and triangle_indices live in a mapped cache file instead of on the heap.
+    void *mapping = nullptr;
+    size_t mapping_bytes = 0;
+    // Split planes of the leaf grid per axis, shared by every node splitting on that axis.
+    array<vector<float>, 3> planes;
+    size_t memory_bytes() const;
+    const Triangle *get_triangle(unsigned ref) const;
     vector<Triangle *> &get_all_triangles(const Vec3 &point) const;
     OctreeNode *get_lowest_common_ancestor(OctreeNode *node1, OctreeNode *node2) const;
     OctreeLookup get_new_triangles(const Vec3 &point) const;
     OctreeLookup get_new_triangles(const Vec3 &point, OctreeNode *previous_node) const;
     OctreeNode *get_node(const Vec3 &point) const;
-    Octree(const Scene &scene);
+    Octree(const Scene &scene, const string &cache_dir = "", int depth = DEFAULT_OCTREE_DEPTH,
+           const ParallelLimits &limits = ParallelLimits());
+    Octree(const vector<Triangle> &geometry, const ParallelLimits &limits = ParallelLimits());
     Octree(const Octree &other);
     bool in_bounds(const Vec3 &point) const;
     ~Octree();
+
+    bool save(const string &path, uint64_t geometry_hash, size_t n_triangles) const;
+    bool load(const string &path, uint64_t geometry_hash, size_t n_triangles);
+
+  private:
+    void build_nodes(const Vec3 &center, float radial, const ParallelLimits &limits);
+    void insert_triangles(const vector<Triangle> &geometry, const ParallelLimits &limits);
+    unsigned cell(int axis, float value) const;
+    template <typename F>
+    void for_split_cells(const Triangle &tri, const unsigned lo[3], const unsigned hi[3], int split_depth, F f) const;
 };
 
+/**
+ * Nodes hold relative offsets instead of pointers, so the array can be copied or mapped anywhere.
+ **/
 class OctreeNode {
   public:
     bool is_leaf : 1 = true;
     int depth : 31 = 0;
-    OctreeNode *children[8];
     float yz_plane;
     float xz_plane;
     float xy_plane;
     float radial;
-    OctreeNode *parent = nullptr;
+    // Children live at this + child_offset + bitcode, the parent at this - parent_offset.
+    unsigned child_offset = 0;
+    unsigned parent_offset = 0;
+    // This node's slice of Octree::triangle_indices.
+    unsigned first_triangle = 0;
+    unsigned n_triangles = 0;
     OctreeNode *get_child(const Vec3 &point);
+    OctreeNode *get_parent() { return parent_offset == 0 ? nullptr : this - parent_offset; }
     OctreeNode(float yz, float xz, float xy, float radial) : yz_plane(yz), xz_plane(xz), xy_plane(xy), radial(radial){};
-    OctreeNode(float yz, float xz, float xy, OctreeNode *parent)
-        : yz_plane(yz), xz_plane(xz), xy_plane(xy), parent(parent) {
-        radial = parent->radial / 2;
-        depth = parent->depth + 1;
-    };
-    ~OctreeNode();
-    void expand_children(int max_depth);
     float planes_intersection(const Vec3 &origin, const Vec3 &ray);
-    vector<const Triangle *> *triangles = nullptr;
+    float exit_distance(const Vec3 &point, const Vec3 &ray) const;
 };
 
 struct OctreeLookup {
     bool is_valid = false;
     OctreeNode *node = nullptr;
-    vector<vector<const Triangle *> *> path;
+    int nodes_visited = 0;
+    vector<const OctreeNode *> path;
 };
 
+uint64_t geometry_hash(const vector<Triangle> &geometry, const ParallelLimits &limits);
+// Creates a uniquely named file beside path for writing, to be renamed onto it once complete.
+FILE *create_temp_file(const string &path, string &tmp_path);
+
 struct BoundingBox {
   public:
     Vec3 min_xyz;
     Vec3 max_xyz;
-    vector<Vec3> get_corners();
+    array<Vec3, 8> get_corners();
+    void extend(const BoundingBox &other);
+    bool hit_by(const Vec3 &origin, const Vec3 &inv_ray, float t_max, float *t_entry = nullptr) const;
 };
 
-#endif
\ No newline at end of file
+#endif
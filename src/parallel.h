@@ -0,0 +1,118 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include "affinity.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * The threads the helpers below may start: n_threads of them, or with 0 one per CPU in cpus or,
+ * without those, per hardware thread. Each is restricted to cpus unless that is empty. Builds and
+ * queries take these from the options they run under, so they stay on the CPUs the render was given.
+ **/
+struct ParallelLimits {
+    int n_threads = 0;
+    std::vector<int> cpus;
+    size_t workers() const {
+        if (n_threads > 0) {
+            return n_threads;
+        }
+        return cpus.empty() ? std::max(std::thread::hardware_concurrency(), 1u) : cpus.size();
+    }
+};
+
+/**
+ * Splits [0, n) into one contiguous chunk per allowed thread and runs f(begin, end) on each.
+ * Small ranges run inline on the calling thread.
+ **/
+template <typename F> void parallel_for_chunks(const ParallelLimits &limits, size_t n, F f, size_t min_chunk = 4096) {
+    size_t n_workers = std::min(limits.workers(), std::max(n / min_chunk, (size_t)1));
+    if (n_workers <= 1) {
+        f((size_t)0, n);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < n_workers; w++) {
+        threads.push_back(std::thread([&limits, &f, begin = n * w / n_workers, end = n * (w + 1) / n_workers]() {
+            pin_current_thread(limits.cpus);
+            f(begin, end);
+        }));
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
+template <typename F> void parallel_for(const ParallelLimits &limits, size_t n, F f, size_t min_chunk = 4096) {
+    parallel_for_chunks(
+        limits, n,
+        [&f](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                f(i);
+            }
+        },
+        min_chunk);
+}
+
+/**
+ * Hands out [begin, end) blocks of block_size from a shared counter to one thread per allowed
+ * thread, for work whose cost varies too much across the range for fixed chunks.
+ **/
+template <typename F> void parallel_for_blocks(const ParallelLimits &limits, size_t n, size_t block_size, F f) {
+    size_t n_blocks = (n + block_size - 1) / block_size;
+    size_t n_workers = std::min(limits.workers(), n_blocks);
+    std::atomic<size_t> next_block(0);
+    auto work = [&]() {
+        for (size_t block = next_block++; block < n_blocks; block = next_block++) {
+            f(block * block_size, std::min((block + 1) * block_size, n));
+        }
+    };
+    if (n_workers <= 1) {
+        work();
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < n_workers; w++) {
+        threads.push_back(std::thread([&limits, &work]() {
+            pin_current_thread(limits.cpus);
+            work();
+        }));
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
+// Sorts chunks in parallel, then merges neighbouring runs pairwise, also in parallel.
+template <typename T> void parallel_sort(const ParallelLimits &limits, std::vector<T> &values) {
+    size_t n = values.size();
+    size_t n_runs = std::min(limits.workers(), std::max(n / 4096, (size_t)1));
+    std::vector<size_t> bounds;
+    for (size_t r = 0; r <= n_runs; r++) {
+        bounds.push_back(n * r / n_runs);
+    }
+    parallel_for(
+        limits, n_runs, [&](size_t r) { std::sort(values.begin() + bounds[r], values.begin() + bounds[r + 1]); }, 1);
+    while (bounds.size() > 2) {
+        std::vector<size_t> merged;
+        for (size_t r = 0; r + 2 < bounds.size(); r += 2) {
+            merged.push_back(bounds[r]);
+        }
+        size_t n_pairs = (bounds.size() - 1) / 2;
+        parallel_for(
+            limits, n_pairs,
+            [&](size_t p) {
+                std::inplace_merge(values.begin() + bounds[2 * p], values.begin() + bounds[2 * p + 1],
+                                   values.begin() + bounds[2 * p + 2]);
+            },
+            1);
+        if ((bounds.size() - 1) % 2 == 1) {
+            merged.push_back(bounds[bounds.size() - 2]);
+        }
+        merged.push_back(n);
+        bounds = merged;
+    }
+}
+
+#endif
@@ -1,22 +1,112 @@
 #include "python_interface.h"
 #include "linalg.h"
 
+static RenderOptions convert_options(const PyRenderOptions *options, const PyCanvas *canvas);
+
 extern "C" void add_triangle(PyTriangle *tri, PyScene *scene) {
     Vec3 v0(tri->v0.x, tri->v0.y, tri->v0.z);
     Vec3 v1(tri->v1.x, tri->v1.y, tri->v1.z);
     Vec3 v2(tri->v2.x, tri->v2.y, tri->v2.z);
     Vec3 normal(tri->normal.x, tri->normal.y, tri->normal.z);  
-    scene->scene->geometry.push_back(Triangle(v0, v1, v2, normal, tri->refraction_index, tri->scattering));
+    scene->versions->edit([&](Scene &edited) {
+        int material = edited.material_id(tri->refraction_index, tri->scattering);
+        edited.geometry.edit().push_back(Triangle(v0, v1, v2, normal, material));
+    });
+}
+
+extern "C" int add_mesh(PyTriangle *tris, int n_triangles, int n_levels, int node_format, PyRenderOptions *options,
+                        PyScene *scene) {
+    vector<Triangle> geometry;
+    geometry.reserve(n_triangles);
+    vector<int> materials(n_triangles);
+    scene->versions->edit([&](Scene &edited) {
+        for (int i = 0; i < n_triangles; i++) {
+            materials[i] = edited.material_id(tris[i].refraction_index, tris[i].scattering);
+        }
+    });
+    for (int i = 0; i < n_triangles; i++) {
+        const PyTriangle &tri = tris[i];
+        geometry.push_back(Triangle(Vec3(tri.v0.x, tri.v0.y, tri.v0.z), Vec3(tri.v1.x, tri.v1.y, tri.v1.z),
+                                    Vec3(tri.v2.x, tri.v2.y, tri.v2.z),
+                                    Vec3(tri.normal.x, tri.normal.y, tri.normal.z), materials[i]));
+    }
+    // Built outside the edit, so renders can snapshot the scene meanwhile.
+    ParallelLimits limits = convert_options(options, nullptr).parallel_limits();
+    auto mesh = std::make_shared<Mesh>(geometry, n_levels, node_format, limits);
+    int id;
+    scene->versions->edit([&](Scene &edited) {
+        edited.meshes.push_back(mesh);
+        id = edited.meshes.size() - 1;
+    });
+    return id;
+}
+
+extern "C" int add_instance(PyInstance *pyinstance, PyScene *scene) {
+    const float *t = pyinstance->transform;
+    Mat3 linear(Vec3(t[0], t[4], t[8]), Vec3(t[1], t[5], t[9]), Vec3(t[2], t[6], t[10]));
+    Affine object_to_world(linear, Vec3(t[3], t[7], t[11]));
+    if (!object_to_world.invertible()) {
+        return -2;
+    }
+    Instance instance(pyinstance->mesh, object_to_world);
+    int status = -1;
+    scene->versions->edit([&](Scene &edited) {
+        if (instance.mesh < 0 || instance.mesh >= edited.meshes.size()) {
+            return;
+        }
+        if (pyinstance->override_material) {
+            instance.material = edited.material_id(pyinstance->refraction_index, pyinstance->scattering);
+        }
+        edited.instances.push_back(instance);
+        status = 0;
+    });
+    return status;
 }
 
 extern "C" void add_light(PyLight *pylight, PyScene *scene) {
     Light light;
     light.loc = Vec3(pylight->loc.x, pylight->loc.y, pylight->loc.z);
     light.intensity = pylight->intensity;
-    scene->scene->lights.push_back(light);
+    scene->versions->edit([&](Scene &edited) { edited.lights.push_back(light); });
 }
 
-extern "C" void __init_scene(PyScene *scene) { scene->scene = new Scene(); }
+extern "C" int set_light(PyLight *pylight, int light, PyScene *scene) {
+    int status = -1;
+    scene->versions->edit([&](Scene &edited) {
+        if (light >= 0 && light < edited.lights.size()) {
+            edited.lights[light].loc = Vec3(pylight->loc.x, pylight->loc.y, pylight->loc.z);
+            edited.lights[light].intensity = pylight->intensity;
+            status = 0;
+        }
+    });
+    return status;
+}
+
+extern "C" int material_id(float refraction_index, float scattering, PyScene *scene) {
+    int id;
+    scene->versions->edit([&](Scene &edited) { id = edited.material_id(refraction_index, scattering); });
+    return id;
+}
+
+extern "C" int set_material(int material, float refraction_index, float scattering, PyScene *scene) {
+    int status = -1;
+    scene->versions->edit([&](Scene &edited) {
+        if (material >= 0 && material < edited.materials.size()) {
+            edited.materials[material] = Material(refraction_index, scattering);
+            status = 0;
+        }
+    });
+    return status;
+}
+
+extern "C" void __init_scene(PyScene *scene) { scene->versions = new SceneVersions(); }
+
+extern "C" void __free_scene(PyScene *scene) {
+    delete scene->versions;
+    scene->versions = nullptr;
+}
+
+extern "C" long scene_version(PyScene *scene) { return scene->versions->snapshot()->version; }
 
 extern "C" void __init_canvas(PyCanvas *canvas, int width, int height) {
     canvas->cpp_canvas = new Canvas(height, width);
@@ -25,6 +115,234 @@ extern "C" void __init_canvas(PyCanvas *canvas, int width, int height) {
     canvas->height = height;
 }
 
-extern "C" void render(PyScene* scene, PyCanvas* canvas) {
-    render(*canvas->cpp_canvas, *scene->scene, Camera());
+extern "C" void start_trace(int events_per_thread) { trace_start(events_per_thread); }
+
+extern "C" int stop_trace(const char *path) {
+    trace_stop();
+    return trace_write(path) ? 0 : -1;
+}
+
+extern "C" void begin_trace_span(const char *name) { trace_begin(name); }
+
+extern "C" void end_trace_span() { trace_end(); }
+
+extern "C" void __init_render_stats(PyRenderStats *stats) {
+    memset(stats, 0, sizeof(PyRenderStats));
+    stats->cpp_stats = new RenderStats();
+}
+
+extern "C" void __free_render_stats(PyRenderStats *stats) {
+    delete stats->cpp_stats;
+    stats->cpp_stats = nullptr;
+    stats->worker_busy_seconds = nullptr;
+    stats->worker_idle_seconds = nullptr;
+    stats->n_workers = 0;
+}
+
+static RenderOptions convert_options(const PyRenderOptions *options, const PyCanvas *canvas) {
+    RenderOptions cpp_options;
+    if (options != nullptr && options->heatmap != nullptr) {
+        if (canvas != nullptr && options->heatmap->width == canvas->width && options->heatmap->height == canvas->height) {
+            cpp_options.heatmap_mode = options->heatmap_mode;
+            cpp_options.heatmap = options->heatmap->cpp_canvas;
+        } else {
+            fprintf(stderr, "heatmap canvas must match the render canvas size, skipping heatmap\n");
+        }
+    }
+    if (options != nullptr) {
+        cpp_options.n_threads = options->n_threads;
+        cpp_options.cpus.assign(options->cpus, options->cpus + (options->cpus == nullptr ? 0 : options->n_cpus));
+        cpp_options.pin_threads = options->pin_threads;
+        cpp_options.numa = options->numa;
+        cpp_options.numa_replicate_octree = options->numa_replicate_octree;
+        if (options->octree_cache_dir != nullptr) {
+            cpp_options.octree_cache_dir = options->octree_cache_dir;
+        }
+        cpp_options.lod_pixel_error = options->lod_pixel_error;
+        cpp_options.lod_secondary_scale = options->lod_secondary_scale;
+        cpp_options.lod_shadow_scale = options->lod_shadow_scale;
+        if (options->tile_pixels > 0) {
+            cpp_options.tile_pixels = options->tile_pixels;
+        }
+        if (options->octree_depth > 0) {
+            cpp_options.octree_depth = clamp_octree_depth(options->octree_depth);
+        }
+        cpp_options.raster_primary = options->raster_primary;
+    }
+    return cpp_options;
+}
+
+// Mirrors stats->cpp_stats into the plain fields; the worker arrays point into it.
+static void copy_stats(PyRenderStats *stats) {
+    RenderStats *cpp_stats = stats->cpp_stats;
+    stats->primary_rays = cpp_stats->primary_rays;
+    stats->secondary_rays = cpp_stats->secondary_rays;
+    stats->shadow_rays = cpp_stats->shadow_rays;
+    stats->triangle_tests = cpp_stats->triangle_tests;
+    stats->triangle_hits = cpp_stats->triangle_hits;
+    stats->nodes_visited = cpp_stats->nodes_visited;
+    stats->max_depth = cpp_stats->max_depth;
+    stats->n_workers = cpp_stats->worker_busy_seconds.size();
+    stats->build_seconds = cpp_stats->build_seconds;
+    stats->raster_seconds = cpp_stats->raster_seconds;
+    stats->render_seconds = cpp_stats->render_seconds;
+    stats->build_bytes = cpp_stats->build_bytes;
+    stats->octree_cached = cpp_stats->octree_cached;
+    stats->gbuffer_reused = cpp_stats->gbuffer_reused;
+    stats->worker_busy_seconds = cpp_stats->worker_busy_seconds.data();
+    stats->worker_idle_seconds = cpp_stats->worker_idle_seconds.data();
+}
+
+extern "C" void render(PyScene* scene, PyCanvas* canvas, PyRenderOptions* options, PyRenderStats* stats) {
+    RenderOptions cpp_options = convert_options(options, canvas);
+    RenderStats *cpp_stats = stats == nullptr ? nullptr : stats->cpp_stats;
+    render(*canvas->cpp_canvas, *scene->versions->snapshot(), Camera(), cpp_options, cpp_stats);
+    if (stats != nullptr) {
+        copy_stats(stats);
+    }
+}
+
+extern "C" void render_async(PyScene *scene, PyCanvas *canvas, PyRenderOptions *options, PyRenderJob *job) {
+    shared_ptr<const SceneSnapshot> snapshot = scene->versions->snapshot();
+    job->job = new RenderJob(*canvas->cpp_canvas, snapshot, Camera(), convert_options(options, canvas));
+    job->canvas = canvas;
+    job->version = snapshot->version;
+    submit_render(job->job);
+}
+
+extern "C" int render_job_state(PyRenderJob *job) { return job->job->state; }
+
+extern "C" float render_progress(PyRenderJob *job) { return job->job->progress(); }
+
+extern "C" int wait_render(PyRenderJob *job, double timeout_seconds, PyRenderStats *stats) {
+    if (!job->job->wait(timeout_seconds)) {
+        return 0;
+    }
+    if (stats != nullptr) {
+        *stats->cpp_stats = job->job->stats;
+        copy_stats(stats);
+    }
+    return 1;
+}
+
+extern "C" void __free_render_job(PyRenderJob *job) {
+    delete job->job;
+    job->job = nullptr;
+}
+
+extern "C" int render_pool_threads(int n_threads) { return render_pool_size(n_threads); }
+
+// max_exposure > 0 exposes manually, strip by strip; otherwise the peak of the whole image is used.
+extern "C" int render_to_file(PyScene *scene, const char *path, int format, int width, int height, int strip_rows,
+                              float max_exposure, PyRenderOptions *options, PyRenderStats *stats) {
+    Camera camera;
+    if (max_exposure > 0) {
+        camera.exposure_mode = MANUAL_LINEAR_EXPOSURE;
+        camera.max_exposure_energy = max_exposure;
+    }
+    RenderStats *cpp_stats = stats == nullptr ? nullptr : stats->cpp_stats;
+    shared_ptr<const SceneSnapshot> snapshot = scene->versions->snapshot();
+    bool ok = render_strips(snapshot->scene, camera, width, height, convert_options(options, nullptr), path, format,
+                            strip_rows, cpp_stats);
+    if (stats != nullptr) {
+        copy_stats(stats);
+    }
+    return ok ? 0 : -1;
+}
+
+// Fills in the tuned fields of options, which must not be null. Returns 1 when they came from a saved calibration.
+extern "C" int autotune(PyScene *scene, PyCanvas *canvas, PyRenderOptions *options, int n_samples, unsigned seed,
+                        const char *cache_dir) {
+    TuneResult result = autotune(scene->versions->snapshot()->scene, Camera(), canvas->width, canvas->height,
+                                 convert_options(options, canvas), n_samples, seed,
+                                 cache_dir == nullptr ? "" : cache_dir);
+    options->tile_pixels = result.tile_pixels;
+    options->octree_depth = result.octree_depth;
+    options->n_threads = result.n_threads;
+    return result.loaded;
+}
+
+extern "C" void __init_gbuffer(PyGBuffer *gbuffer) { gbuffer->gbuffer = new GBuffer(); }
+
+extern "C" void __free_gbuffer(PyGBuffer *gbuffer) {
+    delete gbuffer->gbuffer;
+    gbuffer->gbuffer = nullptr;
+}
+
+extern "C" int relight(PyScene *scene, PyCanvas *canvas, PyGBuffer *gbuffer, PyRenderOptions *options,
+                       PyRenderStats *stats) {
+    RenderOptions cpp_options = convert_options(options, canvas);
+    RenderStats *cpp_stats = stats == nullptr ? nullptr : stats->cpp_stats;
+    shared_ptr<const SceneSnapshot> snapshot = scene->versions->snapshot();
+    bool reused = relight(*canvas->cpp_canvas, snapshot->scene, Camera(), cpp_options, *gbuffer->gbuffer, cpp_stats);
+    if (stats != nullptr) {
+        copy_stats(stats);
+    }
+    return reused;
+}
+
+extern "C" void __init_ray_query(PyRayQuery *query, PyScene *scene, const char *octree_cache_dir,
+                                 PyRenderOptions *options) {
+    query->snapshot = new shared_ptr<const SceneSnapshot>(scene->versions->snapshot());
+    query->query = new RayQuery((*query->snapshot)->scene, octree_cache_dir == nullptr ? "" : octree_cache_dir,
+                                convert_options(options, nullptr).parallel_limits());
+}
+
+extern "C" void __free_ray_query(PyRayQuery *query) {
+    delete query->query;
+    delete query->snapshot;
+    query->query = nullptr;
+    query->snapshot = nullptr;
+}
+
+extern "C" void intersect_rays(PyRayQuery *query, long n_rays, const float *origins, const float *directions,
+                               const float *t_max, float *distances, int *primitives, int *instances,
+                               float *barycentrics) {
+    query->query->intersect(n_rays, origins, directions, t_max, distances, primitives, instances, barycentrics);
+}
+
+extern "C" void occluded_rays(PyRayQuery *query, long n_rays, const float *origins, const float *directions,
+                              const float *t_max, unsigned char *mask) {
+    query->query->occluded(n_rays, origins, directions, t_max, mask);
+}
+
+extern "C" int write_streamed_mesh(const char *stl_path, const char *path, int flip_y, PyRenderOptions *options) {
+    return write_cluster_file(stl_path, path, flip_y, convert_options(options, nullptr).parallel_limits()) ? 0 : -1;
+}
+
+extern "C" int __init_streamed_geometry(PyStreamedGeometry *geometry, const char *path, long cache_bytes,
+                                        PyRenderOptions *options) {
+    geometry->geometry = new StreamedGeometry(path, cache_bytes, convert_options(options, nullptr).parallel_limits());
+    if (geometry->geometry->mapping == nullptr) {
+        delete geometry->geometry;
+        geometry->geometry = nullptr;
+        return -1;
+    }
+    return 0;
+}
+
+extern "C" void __free_streamed_geometry(PyStreamedGeometry *geometry) {
+    delete geometry->geometry;
+    geometry->geometry = nullptr;
+}
+
+extern "C" void intersect_streamed(PyStreamedGeometry *geometry, long n_rays, const float *origins,
+                                   const float *directions, const float *t_max, float *distances, int *primitives,
+                                   int *instances, float *barycentrics) {
+    geometry->geometry->intersect(n_rays, origins, directions, t_max, distances, primitives, instances, barycentrics);
+}
+
+extern "C" void occluded_streamed(PyStreamedGeometry *geometry, long n_rays, const float *origins,
+                                  const float *directions, const float *t_max, unsigned char *mask) {
+    geometry->geometry->occluded(n_rays, origins, directions, t_max, mask);
+}
+
+extern "C" void get_stream_stats(PyStreamedGeometry *geometry, PyStreamStats *stats) {
+    const StreamStats &cpp_stats = geometry->geometry->stats;
+    stats->cluster_loads = cpp_stats.cluster_loads;
+    stats->cluster_evictions = cpp_stats.cluster_evictions;
+    stats->deferred_rays = cpp_stats.deferred_rays;
+    stats->bytes_paged_in = cpp_stats.bytes_paged_in;
+    stats->resident_bytes = cpp_stats.resident_bytes;
+    stats->peak_resident_bytes = cpp_stats.peak_resident_bytes;
 }
@@ -2,6 +2,13 @@
 #define PYTHON_INTERF_H
 #include "render.h"
 #include "linalg.h"
+#include "query.h"
+#include "stream.h"
+#include "async.h"
+#include "relight.h"
+#include "tune.h"
+#include "strips.h"
+#include "snapshot.h"
 
 typedef struct PyVec3 {
   float x, y, z;
@@ -24,18 +31,139 @@ typedef struct PyCanvas {
 } PyCanvas;
 
 typedef struct PyScene {
-  Scene* scene;
+  SceneVersions* versions;
 } PyScene;
 
+// A query holds the scene version it was built from.
+typedef struct PyRayQuery {
+  RayQuery* query;
+  shared_ptr<const SceneSnapshot>* snapshot;
+} PyRayQuery;
+
+typedef struct PyStreamedGeometry {
+  StreamedGeometry* geometry;
+} PyStreamedGeometry;
+
+typedef struct PyStreamStats {
+  long cluster_loads;
+  long cluster_evictions;
+  long deferred_rays;
+  long bytes_paged_in;
+  long resident_bytes;
+  long peak_resident_bytes;
+} PyStreamStats;
+
 typedef struct PyLight {
   PyVec3 loc;
   float intensity;
 } PyLight;
 
+// transform is the row-major 3x4 object-to-world matrix.
+typedef struct PyInstance {
+  int mesh;
+  float transform[12];
+  int override_material;
+  float scattering;
+  float refraction_index;
+} PyInstance;
+
+typedef struct PyRenderOptions {
+  int heatmap_mode;
+  PyCanvas *heatmap;
+  int n_threads;
+  int *cpus;
+  int n_cpus;
+  int pin_threads;
+  int numa;
+  int numa_replicate_octree;
+  const char *octree_cache_dir;
+  float lod_pixel_error;
+  float lod_secondary_scale;
+  float lod_shadow_scale;
+  int tile_pixels;
+  int octree_depth;
+  int raster_primary;
+} PyRenderOptions;
+
+typedef struct PyRenderStats {
+  long primary_rays;
+  long secondary_rays;
+  long shadow_rays;
+  long triangle_tests;
+  long triangle_hits;
+  long nodes_visited;
+  int max_depth;
+  int n_workers;
+  double build_seconds;
+  double raster_seconds;
+  double render_seconds;
+  long build_bytes;
+  int octree_cached;
+  int gbuffer_reused;
+  double *worker_busy_seconds;
+  double *worker_idle_seconds;
+  RenderStats* cpp_stats;
+} PyRenderStats;
+
+typedef struct PyGBuffer {
+  GBuffer* gbuffer;
+} PyGBuffer;
+
+typedef struct PyRenderJob {
+  RenderJob* job;
+  PyCanvas* canvas;
+  long version;
+} PyRenderJob;
+
 extern "C" void add_triangle(PyTriangle *tri, PyScene *scene);
+extern "C" int add_mesh(PyTriangle *tris, int n_triangles, int n_levels, int node_format, PyRenderOptions *options,
+                        PyScene *scene);
+// 0 on success, -1 for an unknown mesh, -2 for a singular transform.
+extern "C" int add_instance(PyInstance *pyinstance, PyScene *scene);
 extern "C" void add_light(PyLight *pylight, PyScene *scene);
+extern "C" int set_light(PyLight *pylight, int light, PyScene *scene);
+extern "C" int material_id(float refraction_index, float scattering, PyScene *scene);
+extern "C" int set_material(int material, float refraction_index, float scattering, PyScene *scene);
 extern "C" void __init_scene(PyScene *scene);
 extern "C" void __init_canvas(PyCanvas *canvas, int width, int height);
-extern "C" void render(PyScene* scene, PyCanvas* canvas);
+extern "C" void start_trace(int events_per_thread);
+extern "C" int stop_trace(const char *path);
+extern "C" void begin_trace_span(const char *name);
+extern "C" void end_trace_span();
+extern "C" void __init_render_stats(PyRenderStats *stats);
+extern "C" void __free_render_stats(PyRenderStats *stats);
+extern "C" void render(PyScene* scene, PyCanvas* canvas, PyRenderOptions* options, PyRenderStats* stats);
+extern "C" void render_async(PyScene *scene, PyCanvas *canvas, PyRenderOptions *options, PyRenderJob *job);
+extern "C" int render_job_state(PyRenderJob *job);
+extern "C" float render_progress(PyRenderJob *job);
+extern "C" int wait_render(PyRenderJob *job, double timeout_seconds, PyRenderStats *stats);
+extern "C" void __free_render_job(PyRenderJob *job);
+extern "C" int render_pool_threads(int n_threads);
+extern "C" int autotune(PyScene *scene, PyCanvas *canvas, PyRenderOptions *options, int n_samples, unsigned seed,
+                        const char *cache_dir);
+extern "C" int render_to_file(PyScene *scene, const char *path, int format, int width, int height, int strip_rows,
+                              float max_exposure, PyRenderOptions *options, PyRenderStats *stats);
+extern "C" void __init_gbuffer(PyGBuffer *gbuffer);
+extern "C" void __free_gbuffer(PyGBuffer *gbuffer);
+extern "C" int relight(PyScene *scene, PyCanvas *canvas, PyGBuffer *gbuffer, PyRenderOptions *options,
+                       PyRenderStats *stats);
+extern "C" void __init_ray_query(PyRayQuery *query, PyScene *scene, const char *octree_cache_dir,
+                                 PyRenderOptions *options);
+extern "C" void __free_ray_query(PyRayQuery *query);
+extern "C" void intersect_rays(PyRayQuery *query, long n_rays, const float *origins, const float *directions,
+                               const float *t_max, float *distances, int *primitives, int *instances,
+                               float *barycentrics);
+extern "C" void occluded_rays(PyRayQuery *query, long n_rays, const float *origins, const float *directions,
+                              const float *t_max, unsigned char *mask);
+extern "C" int write_streamed_mesh(const char *stl_path, const char *path, int flip_y, PyRenderOptions *options);
+extern "C" int __init_streamed_geometry(PyStreamedGeometry *geometry, const char *path, long cache_bytes,
+                                        PyRenderOptions *options);
+extern "C" void __free_streamed_geometry(PyStreamedGeometry *geometry);
+extern "C" void intersect_streamed(PyStreamedGeometry *geometry, long n_rays, const float *origins,
+                                   const float *directions, const float *t_max, float *distances, int *primitives,
+                                   int *instances, float *barycentrics);
+extern "C" void occluded_streamed(PyStreamedGeometry *geometry, long n_rays, const float *origins,
+                                  const float *directions, const float *t_max, unsigned char *mask);
+extern "C" void get_stream_stats(PyStreamedGeometry *geometry, PyStreamStats *stats);
 
 #endif
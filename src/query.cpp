@@ -0,0 +1,75 @@
+#include "query.h"
+#include "parallel.h"
+
+// A multiple of 8, so that threads never share a byte of the occlusion mask.
+const size_t QUERY_BLOCK_RAYS = 1024;
+const float inf = std::numeric_limits<float>::infinity();
+
+// Rays are traced along their unit direction; one without a finite, non-zero length never hits.
+static bool usable_length(float length) { return length > 0 && length < inf; }
+
+RayQuery::RayQuery(const Scene &scene, const string &octree_cache_dir, const ParallelLimits &thread_limits)
+    : scene(scene), thread_limits(thread_limits),
+      octree(scene, octree_cache_dir, DEFAULT_OCTREE_DEPTH, thread_limits), instances(scene) {}
+
+void RayQuery::intersect(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                         float *distances, int *primitives, int *instance_ids, float *barycentrics) const {
+    TraceSpan span("intersect rays", n_rays);
+    parallel_for_blocks(thread_limits, n_rays, QUERY_BLOCK_RAYS, [&](size_t begin, size_t end) {
+        RenderStats stats;
+        for (size_t r = begin; r < end; r++) {
+            Vec3 origin(origins[3 * r], origins[3 * r + 1], origins[3 * r + 2]);
+            Vec3 ray(directions[3 * r], directions[3 * r + 1], directions[3 * r + 2]);
+            float length = ray.magnitude();
+            RaycastResult hit(false);
+            if (usable_length(length)) {
+                // Traced along the unit direction, with distances scaled back to the caller's ray parameter.
+                ray = ray / length;
+                float limit = t_max == nullptr ? inf : t_max[r] * length;
+                hit = intersect_octree(octree, origin, ray, limit, stats);
+                RaycastResult instance_hit = intersect_instances(scene, instances, origin, ray,
+                                                                 hit.hit ? hit.distance : limit, LodSelection(), stats);
+                if (instance_hit.hit) {
+                    hit = instance_hit;
+                }
+            }
+            if (distances != nullptr) {
+                distances[r] = hit.hit ? hit.distance / length : inf;
+            }
+            if (primitives != nullptr) {
+                primitives[r] = hit.hit ? hit.primitive : -1;
+            }
+            if (instance_ids != nullptr) {
+                instance_ids[r] = hit.hit ? hit.instance : -1;
+            }
+            if (barycentrics != nullptr) {
+                barycentrics[2 * r] = hit.hit ? hit.u : 0;
+                barycentrics[2 * r + 1] = hit.hit ? hit.v : 0;
+            }
+        }
+    });
+}
+
+void RayQuery::occluded(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                        uint8_t *mask) const {
+    TraceSpan span("occluded rays", n_rays);
+    parallel_for_blocks(thread_limits, n_rays, QUERY_BLOCK_RAYS, [&](size_t begin, size_t end) {
+        RenderStats stats;
+        for (size_t r = begin; r < end; r++) {
+            Vec3 origin(origins[3 * r], origins[3 * r + 1], origins[3 * r + 2]);
+            Vec3 ray(directions[3 * r], directions[3 * r + 1], directions[3 * r + 2]);
+            float length = ray.magnitude();
+            bool hit = false;
+            if (usable_length(length)) {
+                ray = ray / length;
+                float limit = t_max == nullptr ? inf : t_max[r] * length;
+                hit = any_intersect_octree(octree, origin, ray, limit, stats) ||
+                      any_intersect_instances(scene, instances, origin, ray, limit, LodSelection(), stats);
+            }
+            if (r % 8 == 0) {
+                mask[r / 8] = 0;
+            }
+            mask[r / 8] |= hit << (r % 8);
+        }
+    });
+}
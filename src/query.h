@@ -0,0 +1,36 @@
+#ifndef QUERY_H
+#define QUERY_H
+#include "render.h"
+#include "octree.h"
+#include "instance.h"
+#include <stdint.h>
+#include <string>
+using std::string;
+
+/**
+ * Batched ray queries for visibility and line-of-sight work outside render(). The octree and
+ * instance tree are built once, on construction, and shared by every batch, so the scene must not
+ * change while a query is alive. Rays are read as packed xyz triples; directions need not be unit
+ * length and distances are in units of the ray parameter. Rays are traced along their unit
+ * direction, so the length only scales t_max and the distances; a zero or non-finite direction
+ * never hits. A null t_max means unbounded rays. Instanced meshes are always traced at full detail.
+ * The octree build and every batch run on the threads thread_limits allows.
+ **/
+class RayQuery {
+  public:
+    const Scene &scene;
+    ParallelLimits thread_limits;
+    Octree octree;
+    InstanceTree instances;
+    RayQuery(const Scene &scene, const string &octree_cache_dir = "",
+             const ParallelLimits &thread_limits = ParallelLimits());
+    // Closest hits. Misses get an infinite distance and primitive and instance -1; barycentrics
+    // hold the hit's weights on v1 and v2. Any output may be null.
+    void intersect(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                   float *distances, int *primitives, int *instance_ids, float *barycentrics) const;
+    // Sets bit i % 8 of byte i / 8 of mask when ray i hits anything before its t_max.
+    void occluded(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                  uint8_t *mask) const;
+};
+
+#endif
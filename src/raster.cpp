@@ -0,0 +1,195 @@
+#include "raster.h"
+#include <atomic>
+using std::atomic;
+
+// Camera-space depth triangles are clipped at; anything nearer is behind the pinhole for a ray.
+const float NEAR_PLANE = 1e-4f;
+
+/**
+ * A projected triangle, or one half of a triangle cut by the near plane. Screen coordinates are in
+ * pixels with samples on the integers; depth is interpolated as 1 / z, which is linear on screen.
+ **/
+struct RasterTriangle {
+  public:
+    double x[3], y[3];
+    float inv_z[3];
+    int triangle;
+};
+
+// Everything a chunk of triangles sets up, with per-tile lists of indices into triangles.
+struct RasterChunk {
+  public:
+    vector<RasterTriangle> triangles;
+    vector<vector<unsigned>> bins;
+};
+
+static int worker_count(int n_threads) {
+    return n_threads > 0 ? n_threads : max((int)thread::hardware_concurrency() - 1, 1);
+}
+
+VisibilityBuffer rasterize(const Scene &scene, const Camera &camera, int width, int height, int n_threads) {
+    TraceSpan raster_span("rasterize");
+    VisibilityBuffer visibility;
+    visibility.width = width;
+    visibility.height = height;
+    visibility.triangles.assign((size_t)width * height, -1);
+    visibility.depths.assign((size_t)width * height, std::numeric_limits<float>::infinity());
+    visibility.on_edge.assign((size_t)width * height, 0);
+    if (width <= 0 || height <= 0) {
+        return visibility;
+    }
+
+    // The camera's rotation is orthonormal, so camera space is the dot product with its rotated axes.
+    Vec3 right = Vec3(1, 0, 0).rotate(camera.rotation);
+    Vec3 up = Vec3(0, 1, 0).rotate(camera.rotation);
+    Vec3 forward = Vec3(0, 0, 1).rotate(camera.rotation);
+    int fold_i = height / 2.0;
+    int fold_j = width / 2.0;
+    double x_scale = camera.focal_plane_distance * width / camera.focal_plane_width;
+    double y_scale = camera.focal_plane_distance * height / camera.focal_plane_height;
+    int tiles_x = (width + RASTER_TILE - 1) / RASTER_TILE;
+    int tiles_y = (height + RASTER_TILE - 1) / RASTER_TILE;
+
+    int n_workers = worker_count(n_threads);
+    vector<RasterChunk> chunks(n_workers);
+    auto setup = [&](int chunk_id) {
+        RasterChunk &chunk = chunks[chunk_id];
+        chunk.bins.resize((size_t)tiles_x * tiles_y);
+        size_t begin = scene.geometry.size() * chunk_id / n_workers;
+        size_t end = scene.geometry.size() * (chunk_id + 1) / n_workers;
+        for (size_t t = begin; t < end; t++) {
+            const Triangle &tri = scene.geometry[t];
+            Vec3 corners[3] = {tri.v0 - camera.loc, tri.v1 - camera.loc, tri.v2 - camera.loc};
+            Vec3 camera_space[3];
+            for (int k = 0; k < 3; k++) {
+                camera_space[k] = Vec3(corners[k] ^ right, corners[k] ^ up, corners[k] ^ forward);
+            }
+            // Sutherland-Hodgman against the near plane leaves at most four corners.
+            Vec3 polygon[4];
+            int n_corners = 0;
+            for (int k = 0; k < 3; k++) {
+                const Vec3 &a = camera_space[k];
+                const Vec3 &b = camera_space[(k + 1) % 3];
+                bool a_in = a.z >= NEAR_PLANE, b_in = b.z >= NEAR_PLANE;
+                if (a_in) {
+                    polygon[n_corners++] = a;
+                }
+                if (a_in != b_in) {
+                    float s = (NEAR_PLANE - a.z) / (b.z - a.z);
+                    polygon[n_corners++] = Vec3(a.x + s * (b.x - a.x), a.y + s * (b.y - a.y), NEAR_PLANE);
+                }
+            }
+            for (int fan = 1; fan + 1 < n_corners; fan++) {
+                RasterTriangle raster;
+                raster.triangle = t;
+                const Vec3 *fan_corners[3] = {&polygon[0], &polygon[fan], &polygon[fan + 1]};
+                const double inf = std::numeric_limits<double>::infinity();
+                double min_x = inf, max_x = -inf, min_y = inf, max_y = -inf;
+                for (int k = 0; k < 3; k++) {
+                    const Vec3 &p = *fan_corners[k];
+                    raster.x[k] = p.x / p.z * x_scale + fold_j;
+                    raster.y[k] = fold_i - p.y / p.z * y_scale;
+                    raster.inv_z[k] = 1 / p.z;
+                    min_x = std::min(min_x, raster.x[k]);
+                    max_x = std::max(max_x, raster.x[k]);
+                    min_y = std::min(min_y, raster.y[k]);
+                    max_y = std::max(max_y, raster.y[k]);
+                }
+                // Pixel samples the bounding box, widened by the edge margin, can reach, clamped to the image.
+                min_x -= RASTER_EDGE_MARGIN;
+                max_x += RASTER_EDGE_MARGIN;
+                min_y -= RASTER_EDGE_MARGIN;
+                max_y += RASTER_EDGE_MARGIN;
+                int j0 = std::max(0.0, std::ceil(min_x)), j1 = std::min(width - 1.0, std::floor(max_x));
+                int i0 = std::max(0.0, std::ceil(min_y)), i1 = std::min(height - 1.0, std::floor(max_y));
+                if (j0 > j1 || i0 > i1) {
+                    continue;
+                }
+                unsigned index = chunk.triangles.size();
+                chunk.triangles.push_back(raster);
+                for (int ty = i0 / RASTER_TILE; ty <= i1 / RASTER_TILE; ty++) {
+                    for (int tx = j0 / RASTER_TILE; tx <= j1 / RASTER_TILE; tx++) {
+                        chunk.bins[(size_t)ty * tiles_x + tx].push_back(index);
+                    }
+                }
+            }
+        }
+    };
+
+    auto fill = [&](int tile) {
+        int i_begin = tile / tiles_x * RASTER_TILE, j_begin = tile % tiles_x * RASTER_TILE;
+        int i_end = min(i_begin + RASTER_TILE, height), j_end = min(j_begin + RASTER_TILE, width);
+        for (const RasterChunk &chunk : chunks) {
+            for (unsigned index : chunk.bins[tile]) {
+                const RasterTriangle &raster = chunk.triangles[index];
+                const double *x = raster.x, *y = raster.y;
+                double area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+                if (area == 0) {
+                    continue;
+                }
+                double min_x = std::min({x[0], x[1], x[2]}) - RASTER_EDGE_MARGIN;
+                double max_x = std::max({x[0], x[1], x[2]}) + RASTER_EDGE_MARGIN;
+                double min_y = std::min({y[0], y[1], y[2]}) - RASTER_EDGE_MARGIN;
+                double max_y = std::max({y[0], y[1], y[2]}) + RASTER_EDGE_MARGIN;
+                // An edge function is the edge's length times the sample's distance from it.
+                double margin[3] = {RASTER_EDGE_MARGIN * std::hypot(x[2] - x[1], y[2] - y[1]),
+                                    RASTER_EDGE_MARGIN * std::hypot(x[0] - x[2], y[0] - y[2]),
+                                    RASTER_EDGE_MARGIN * std::hypot(x[1] - x[0], y[1] - y[0])};
+                int j0 = std::max((double)j_begin, std::ceil(min_x)), j1 = std::min(j_end - 1.0, std::floor(max_x));
+                int i0 = std::max((double)i_begin, std::ceil(min_y)), i1 = std::min(i_end - 1.0, std::floor(max_y));
+                for (int i = i0; i <= i1; i++) {
+                    for (int j = j0; j <= j1; j++) {
+                        // Edge functions, each the doubled area opposite one corner.
+                        double w0 = (x[2] - x[1]) * (i - y[1]) - (y[2] - y[1]) * (j - x[1]);
+                        double w1 = (x[0] - x[2]) * (i - y[2]) - (y[0] - y[2]) * (j - x[2]);
+                        double w2 = (x[1] - x[0]) * (i - y[0]) - (y[1] - y[0]) * (j - x[0]);
+                        if (area < 0) {
+                            w0 = -w0;
+                            w1 = -w1;
+                            w2 = -w2;
+                        }
+                        if (w0 < -margin[0] || w1 < -margin[1] || w2 < -margin[2]) {
+                            continue;
+                        }
+                        size_t pixel = (size_t)i * width + j;
+                        if (w0 < margin[0] || w1 < margin[1] || w2 < margin[2]) {
+                            visibility.on_edge[pixel] = 1;
+                        }
+                        if (w0 < 0 || w1 < 0 || w2 < 0) {
+                            continue;
+                        }
+                        float inv_z = (w0 * raster.inv_z[0] + w1 * raster.inv_z[1] + w2 * raster.inv_z[2]) /
+                                      std::abs(area);
+                        float depth = 1 / inv_z;
+                        if (depth < visibility.depths[pixel]) {
+                            visibility.depths[pixel] = depth;
+                            visibility.triangles[pixel] = raster.triangle;
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (int w = 0; w < n_workers; w++) {
+        threads.push_back(thread(setup, w));
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+    threads.clear();
+    atomic<int> next_tile(0);
+    int n_tiles = tiles_x * tiles_y;
+    for (int w = 0; w < n_workers; w++) {
+        threads.push_back(thread([&]() {
+            for (int tile = next_tile++; tile < n_tiles; tile = next_tile++) {
+                fill(tile);
+            }
+        }));
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+    return visibility;
+}
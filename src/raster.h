@@ -0,0 +1,38 @@
+#ifndef RASTER_H
+#define RASTER_H
+#include "render.h"
+#include <vector>
+using std::vector;
+
+// Side of the square pixel tiles the rasteriser bins triangles into.
+const int RASTER_TILE = 32;
+// Distance in pixels from a triangle's edge within which a sample counts as on the edge, well over
+// the disagreement between the rasteriser's double edge functions and the float ray test.
+const double RASTER_EDGE_MARGIN = 0.01;
+
+/**
+ * What a camera sees first at each pixel, from rasterising the scene's own geometry: the index in
+ * scene.geometry of the nearest triangle, -1 where none covers the pixel, and its camera-space
+ * depth there. on_edge is set where the sample lies within RASTER_EDGE_MARGIN of any triangle's
+ * edge, inside or out, so that a ray could see a different triangle than the rasteriser did; those
+ * pixels must be traced. Instanced meshes are not rasterised.
+ **/
+struct VisibilityBuffer {
+  public:
+    int width = 0, height = 0;
+    vector<int> triangles;
+    vector<float> depths;
+    vector<unsigned char> on_edge;
+};
+
+/**
+ * Rasterises scene.geometry as seen through camera onto a width by height image, sampling each
+ * pixel where get_initial_ray() aims its ray. Triangles are projected and clipped against a near
+ * plane in parallel chunks, each chunk binning its triangles into RASTER_TILE tiles; the tiles are
+ * then filled in parallel, walking the bins in triangle order so that depth ties go to the lowest
+ * index. Coverage is inclusive on edges, and both faces of a triangle are drawn, as a ray would
+ * hit either. Uses n_threads workers, 0 for all but one hardware thread.
+ **/
+VisibilityBuffer rasterize(const Scene &scene, const Camera &camera, int width, int height, int n_threads);
+
+#endif
@@ -0,0 +1,231 @@
+#include "relight.h"
+#include <atomic>
+using std::atomic;
+
+GBuffer::~GBuffer() { clear(); }
+
+void GBuffer::clear() {
+    delete octree;
+    delete instances;
+    octree = nullptr;
+    instances = nullptr;
+    geometry = SharedGeometry();
+    tiles.clear();
+    n_points = 0;
+}
+
+static bool same_camera(const Camera &a, const Camera &b) {
+    return a.loc.x == b.loc.x && a.loc.y == b.loc.y && a.loc.z == b.loc.z && a.rotation.x == b.rotation.x &&
+           a.rotation.y == b.rotation.y && a.rotation.z == b.rotation.z &&
+           a.focal_plane_distance == b.focal_plane_distance && a.focal_plane_width == b.focal_plane_width &&
+           a.focal_plane_height == b.focal_plane_height && a.max_reflections == b.max_reflections;
+}
+
+bool GBuffer::matches(const Canvas &canvas, const Scene &scene, const Camera &camera,
+                      const RenderOptions &options) const {
+    if (!scene.geometry.shares(geometry) || canvas.width != width || canvas.height != height ||
+        !same_camera(camera, this->camera) || options.lod_pixel_error != this->options.lod_pixel_error ||
+        options.lod_secondary_scale != this->options.lod_secondary_scale ||
+        options.lod_shadow_scale != this->options.lod_shadow_scale || scene.meshes.size() != meshes.size() ||
+        scene.instances.size() != scene_instances.size() || scene.materials.size() < materials.size()) {
+        return false;
+    }
+    for (size_t m = 0; m < meshes.size(); m++) {
+        if (scene.meshes[m] != meshes[m]) {
+            return false;
+        }
+    }
+    for (size_t k = 0; k < scene_instances.size(); k++) {
+        const Instance &instance = scene.instances[k];
+        const Instance &captured = scene_instances[k];
+        if (instance.mesh != captured.mesh || instance.material != captured.material ||
+            memcmp(&instance.object_to_world, &captured.object_to_world, sizeof(Affine)) != 0) {
+            return false;
+        }
+    }
+    for (size_t m = 0; m < materials.size(); m++) {
+        if (scene.materials[m].kind != materials[m].kind ||
+            scene.materials[m].refraction_index != materials[m].refraction_index) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t GBuffer::memory_bytes() const { return tiles.size() * sizeof(GBufferTile) + n_points * sizeof(ShadingPoint); }
+
+/**
+ * Follows a ray the way render_ray does, recording its hits instead of shading them. Bounces are
+ * followed whatever their weight, since a later scattering change may make them count.
+ **/
+static void capture_ray(const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                        const RenderOptions &options, const Ray &ray, int parent, float intensity, bool refracted,
+                        int reflection_count, int max_reflections, vector<ShadingPoint> &points,
+                        RenderStats &stats) {
+    if (reflection_count >= max_reflections) {
+        return;
+    }
+    if (reflection_count == 0) {
+        STAT_ADD(stats, primary_rays, 1);
+    } else {
+        STAT_ADD(stats, secondary_rays, 1);
+    }
+    STAT_MAX(stats, max_depth, reflection_count);
+    RaycastResult hit = intersect(scene, octo, instances, ray.origin, ray.ray, ray.lod, stats);
+    if (!hit.hit) {
+        return;
+    }
+    ShadingPoint point;
+    point.intersect = hit.intersect;
+    point.shadow_lod = LodSelection(ray.lod.tolerance * options.lod_shadow_scale, hit.instance, hit.level);
+    point.material = hit.triangle.material;
+    point.parent = parent;
+    point.intensity = intensity;
+    point.refracted = refracted;
+    int index = points.size();
+    points.push_back(point);
+    const Material &material = scene.materials[point.material];
+    if (material.kind == MATERIAL_DIFFUSE) {
+        return;
+    }
+    LodSelection bounce_lod(ray.lod.tolerance * options.lod_secondary_scale, hit.instance, hit.level);
+    float reflection_intensity = material.kind == MATERIAL_MIRROR ? 1 : fresnel(ray, hit, material.refraction_index);
+    Ray reflection_ray = reflect(ray, hit);
+    reflection_ray.lod = bounce_lod;
+    capture_ray(scene, octo, instances, options, reflection_ray, index, reflection_intensity, false,
+                reflection_count + 1, max_reflections, points, stats);
+    if (material.kind == MATERIAL_DIELECTRIC && reflection_intensity + EPS < 1.0) {
+        Ray refraction_ray = refract(ray, hit, material.refraction_index);
+        refraction_ray.lod = bounce_lod;
+        capture_ray(scene, octo, instances, options, refraction_ray, index, 1 - reflection_intensity, true,
+                    reflection_count + 1, max_reflections, points, stats);
+    }
+}
+
+static void capture_tile(const Canvas &canvas, const Scene &scene, const Octree &octo,
+                         const InstanceTree &instances, const Camera &camera, const RenderOptions &options,
+                         int start_ray_id, GBufferTile &tile, RenderStats &stats) {
+    float pixel_angle = camera.focal_plane_width / canvas.width / camera.focal_plane_distance;
+    int max_px = min(start_ray_id + PIXEL_BLOCK_SIZE, canvas.width * canvas.height);
+    for (int ray_id = start_ray_id; ray_id < max_px; ray_id++) {
+        Ray ray = get_initial_ray(canvas, camera, ray_id);
+        ray.lod.tolerance = options.lod_pixel_error * pixel_angle;
+        capture_ray(scene, octo, instances, options, ray, -1, 1, false, 0, camera.max_reflections, tile.points,
+                    stats);
+        tile.pixel_end[ray_id - start_ray_id] = tile.points.size();
+    }
+}
+
+/**
+ * Shades a tile's points with the scene's current lights and materials. Weights follow render_ray's
+ * multipliers, in the same operation order, and a point under the cutoff is skipped along with
+ * everything below it.
+ **/
+static void shade_tile(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                       const GBufferTile &tile, int start_ray_id, RenderStats &stats) {
+    vector<float> weights(tile.points.size());
+    int max_px = min(start_ray_id + PIXEL_BLOCK_SIZE, canvas.width * canvas.height);
+    unsigned p = 0;
+    for (int ray_id = start_ray_id; ray_id < max_px; ray_id++) {
+        int i = ray_id / canvas.width;
+        int j = ray_id % canvas.width;
+        canvas[i][j] = 0;
+        for (; p < tile.pixel_end[ray_id - start_ray_id]; p++) {
+            const ShadingPoint &point = tile.points[p];
+            float weight = 1;
+            if (point.parent >= 0) {
+                float fresnel_intensity = 1 - scene.materials[tile.points[point.parent].material].scattering;
+                float parent_weight = weights[point.parent];
+                weight = point.refracted ? parent_weight * point.intensity * fresnel_intensity
+                                         : parent_weight * fresnel_intensity * point.intensity;
+            }
+            if (weight < EPS) {
+                weights[p] = 0;
+                continue;
+            }
+            weights[p] = weight;
+            canvas[i][j] += local_illuminate(point.intersect, scene, octo, instances, point.shadow_lod, stats) *
+                            scene.materials[point.material].scattering;
+        }
+    }
+}
+
+// Hands out tiles from a shared counter to n_workers threads, each with its own stats.
+template <typename F> static void run_tiles(int n_tiles, vector<RenderStats> &worker_stats, F f) {
+    atomic<int> next_tile(0);
+    vector<thread> threads;
+    for (size_t w = 0; w < worker_stats.size(); w++) {
+        threads.push_back(thread([&, w]() {
+            auto start = std::chrono::steady_clock::now();
+            for (int tile = next_tile++; tile < n_tiles; tile = next_tile++) {
+                f(tile, worker_stats[w]);
+            }
+            worker_stats[w].busy_seconds += seconds_since(start);
+        }));
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+}
+
+bool relight(Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options,
+             GBuffer &gbuffer, RenderStats *stats) {
+    TraceSpan relight_span("relight");
+    int n_workers = options.n_threads > 0 ? options.n_threads : max((int)thread::hardware_concurrency() - 1, 1);
+    vector<RenderStats> worker_stats(n_workers);
+    int n_tiles = (canvas.width * canvas.height + PIXEL_BLOCK_SIZE - 1) / PIXEL_BLOCK_SIZE;
+    bool reused = gbuffer.matches(canvas, scene, camera, options);
+    double build_seconds = 0;
+    auto render_start = std::chrono::steady_clock::now();
+    if (!reused) {
+        gbuffer.clear();
+        auto build_start = std::chrono::steady_clock::now();
+        trace_begin("octree build");
+        gbuffer.octree = new Octree(scene, options.octree_cache_dir, options.octree_depth, options.parallel_limits());
+        gbuffer.instances = new InstanceTree(scene);
+        trace_end();
+        build_seconds = seconds_since(build_start);
+        gbuffer.geometry = scene.geometry;
+        gbuffer.meshes = scene.meshes;
+        gbuffer.scene_instances = scene.instances;
+        gbuffer.materials = scene.materials;
+        gbuffer.camera = camera;
+        gbuffer.options = options;
+        gbuffer.width = canvas.width;
+        gbuffer.height = canvas.height;
+        gbuffer.tiles.resize(n_tiles);
+        render_start = std::chrono::steady_clock::now();
+        TraceSpan capture_span("capture");
+        run_tiles(n_tiles, worker_stats, [&](int tile, RenderStats &tile_stats) {
+            capture_tile(canvas, scene, *gbuffer.octree, *gbuffer.instances, camera, options, tile * PIXEL_BLOCK_SIZE,
+                         gbuffer.tiles[tile], tile_stats);
+        });
+        for (const GBufferTile &tile : gbuffer.tiles) {
+            gbuffer.n_points += tile.points.size();
+        }
+    }
+    {
+        TraceSpan shade_span("shade");
+        run_tiles(n_tiles, worker_stats, [&](int tile, RenderStats &tile_stats) {
+            shade_tile(canvas, scene, *gbuffer.octree, *gbuffer.instances, gbuffer.tiles[tile],
+                       tile * PIXEL_BLOCK_SIZE, tile_stats);
+        });
+    }
+    double render_seconds = seconds_since(render_start);
+    trace_begin("expose");
+    camera.expose(canvas);
+    trace_end();
+    if (stats != nullptr) {
+        *stats = RenderStats();
+        for (RenderStats &worker : worker_stats) {
+            worker.idle_seconds = max(render_seconds - worker.busy_seconds, 0.0);
+            stats->merge(worker);
+        }
+        stats->build_seconds = build_seconds;
+        stats->build_bytes = build_bytes(scene, *gbuffer.octree) + gbuffer.memory_bytes();
+        stats->octree_cached = gbuffer.octree->mapping != nullptr;
+        stats->render_seconds = render_seconds;
+        stats->gbuffer_reused = reused;
+    }
+    return reused;
+}
@@ -0,0 +1,82 @@
+#ifndef RELIGHT_H
+#define RELIGHT_H
+#include "render.h"
+#include "octree.h"
+#include "instance.h"
+#include <stdint.h>
+#include <vector>
+using std::vector;
+
+/**
+ * A hit of a camera ray or one of its bounces, as far as shading it needs: where it is, what it is
+ * made of and how much of its parent's bounce light reaches the camera through it.
+ **/
+struct ShadingPoint {
+  public:
+    Vec3 intersect;
+    // Shadow rays from the point select levels of detail with this.
+    LodSelection shadow_lod;
+    int material = 0;
+    // Index in the tile of the point whose bounce found this one, -1 for a camera ray's hit.
+    int parent = -1;
+    // The parent's Fresnel reflection or refraction intensity along this bounce.
+    float intensity = 1;
+    bool refracted = false;
+};
+
+// The shading points of PIXEL_BLOCK_SIZE pixels, each pixel's in the order render_ray shades them.
+struct GBufferTile {
+  public:
+    vector<ShadingPoint> points;
+    // One past each pixel's last point.
+    unsigned pixel_end[PIXEL_BLOCK_SIZE];
+};
+
+/**
+ * The ray trees of a render, kept so that later renders of the same view only redo the shadow
+ * rays and shading. Alongside them it keeps the scene's octree and instance tree and enough of the
+ * scene, camera and options to tell whether a render would trace the same trees again. It holds a
+ * share of the scene's triangles, so any scene copy or snapshot still sharing them matches without
+ * rehashing, and an edit to the geometry unshares them and forces a new capture. The trees
+ * depend on materials only through their kind and refraction index, so lights may move and
+ * scattering change freely as long as no material turns diffuse or stops being diffuse. Bounces
+ * are captured regardless of their weight, which is only applied when shading, so a scattering
+ * change that lifts a bounce over the cutoff is shaded exactly as a full render would.
+ **/
+class GBuffer {
+  public:
+    vector<GBufferTile> tiles;
+    size_t n_points = 0;
+    GBuffer(){};
+    GBuffer(const GBuffer &other) = delete;
+    ~GBuffer();
+    // True when rendering the scene through camera onto canvas would trace the rays held here.
+    bool matches(const Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options) const;
+    // Bytes held by the ray trees, without the octree.
+    size_t memory_bytes() const;
+
+  private:
+    friend bool relight(Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options,
+                        GBuffer &gbuffer, RenderStats *stats);
+    Octree *octree = nullptr;
+    InstanceTree *instances = nullptr;
+    SharedGeometry geometry;
+    vector<shared_ptr<Mesh>> meshes;
+    vector<Instance> scene_instances;
+    vector<Material> materials;
+    Camera camera;
+    RenderOptions options;
+    int width = 0;
+    int height = 0;
+    void clear();
+};
+
+/**
+ * Renders like render(), reusing gbuffer's ray trees when it matches the render and only tracing
+ * shadow rays from them; otherwise traces the scene and refills gbuffer. Returns whether the trees
+ * were reused. Heatmaps are not written, and the workers are neither pinned nor NUMA-placed.
+ **/
+bool relight(Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options,
+             GBuffer &gbuffer, RenderStats *stats = nullptr);
+
+#endif
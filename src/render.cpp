@@ -1,17 +1,55 @@
 #include "render.h"
 #include "octree.h"
+#include "affinity.h"
+#include "instance.h"
+#include "raster.h"
 
 const float inf = std::numeric_limits<float>::infinity();
 const float PI = 3.1415926;
-const int BLOCK_SIZE = 64;
-const int PIXEL_BLOCK_SIZE = 2 * BLOCK_SIZE / sizeof(float);
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void RenderStats::merge(const RenderStats &other) {
+    primary_rays += other.primary_rays;
+    secondary_rays += other.secondary_rays;
+    shadow_rays += other.shadow_rays;
+    triangle_tests += other.triangle_tests;
+    triangle_hits += other.triangle_hits;
+    nodes_visited += other.nodes_visited;
+    max_depth = max(max_depth, other.max_depth);
+    busy_seconds += other.busy_seconds;
+    idle_seconds += other.idle_seconds;
+    worker_busy_seconds.push_back(other.busy_seconds);
+    worker_idle_seconds.push_back(other.idle_seconds);
+}
 
 Triangle const operator-(const Triangle &tri, const Vec3 &vec) {
-    return Triangle(tri.v0 - vec, tri.v1 - vec, tri.v2 - vec, tri.normal);
+    return Triangle(tri.v0 - vec, tri.v1 - vec, tri.v2 - vec, tri.normal, tri.material);
 }
 
 Triangle const operator+(const Triangle &tri, const Vec3 &vec) {
-    return Triangle(tri.v0 + vec, tri.v1 + vec, tri.v2 + vec, tri.normal);
+    return Triangle(tri.v0 + vec, tri.v1 + vec, tri.v2 + vec, tri.normal, tri.material);
+}
+
+Material::Material(float refraction_index, float scattering)
+    : refraction_index(refraction_index), scattering(scattering) {
+    if (scattering + EPS >= 1) {
+        kind = MATERIAL_DIFFUSE;
+    } else if (std::isinf(refraction_index)) {
+        kind = MATERIAL_MIRROR;
+    }
+}
+
+int Scene::material_id(float refraction_index, float scattering) {
+    for (int m = 0; m < materials.size(); m++) {
+        if (materials[m].refraction_index == refraction_index && materials[m].scattering == scattering) {
+            return m;
+        }
+    }
+    materials.push_back(Material(refraction_index, scattering));
+    return materials.size() - 1;
 }
 
 BoundingBox Triangle::get_bounds() const {
@@ -31,7 +69,7 @@ void Camera::expose(Canvas &canvas) const {
     case AUTO_LINEAR_EXPOSURE: {
         max_exposure = -inf;
         for (int i = 0; i < canvas.height; i++) {
-            for (int j = 0; j < canvas.height; j++) {
+            for (int j = 0; j < canvas.width; j++) {
                 max_exposure = max(max_exposure, canvas[i][j]);
             }
         }
@@ -41,7 +79,7 @@ void Camera::expose(Canvas &canvas) const {
         break;
     }
     for (int i = 0; i < canvas.height; i++) {
-        for (int j = 0; j < canvas.height; j++) {
+        for (int j = 0; j < canvas.width; j++) {
             canvas[i][j] = canvas[i][j] / max_exposure;
             if (canvas[i][j] > 1) {
                 canvas[i][j] = 1;
@@ -82,77 +120,132 @@ RaycastResult raycast(const Vec3 &origin, const Vec3 &ray, const Triangle &tri)
         return RaycastResult(false);
     }
 
-    return RaycastResult(intersect + tri.v0, t, tri);
+    RaycastResult res(intersect + tri.v0, t, tri);
+    res.u = a;
+    res.v = b;
+    return res;
+}
+
+// Moves point step along ray and returns the step taken. A step too short to change point at its magnitude is
+// doubled until it does, so that walks along short rays always leave the cell they are in.
+static float advance(Vec3 &point, const Vec3 &ray, float step) {
+    Vec3 next = point + (ray * step);
+    while (next.x == point.x && next.y == point.y && next.z == point.z && step < inf) {
+        step = step > 0 ? step * 2 : std::numeric_limits<float>::min();
+        next = point + (ray * step);
+    }
+    point = next;
+    return step;
 }
 
-RaycastResult intersect(const Scene &scene, const Octree &octo, const Vec3 &origin, const Vec3 &ray) {
+// Closest hit among the octree's triangles that lies within t_max.
+RaycastResult intersect_octree(const Octree &octo, const Vec3 &origin, const Vec3 &ray, float t_max,
+                               RenderStats &stats) {
     RaycastResult best_raycast(false);
     Vec3 point = origin;
+    float t_point = 0;
+    // A thousandth of a cell's radius, in units of the ray parameter.
+    float overshoot = 1e-3f / ray.magnitude();
     if (!octo.in_bounds(point)) {
         float t = octo.root->planes_intersection(origin, ray);
-        if (t <= 0) {
+        if (t <= 0 || t >= t_max) {
             return best_raycast;
         }
         point = point + (ray * t);
+        t_point = t;
     }
     OctreeLookup lookup = octo.get_new_triangles(point);
-    while (octo.in_bounds(point) && lookup.is_valid) {
-        for (auto block : lookup.path) {
-            for (const Triangle *tri : *block) {
-                RaycastResult res = raycast(origin, ray, *tri);
-                if (res.hit && (res.distance < best_raycast.distance || !best_raycast.hit)) {
+    while (octo.in_bounds(point) && lookup.is_valid && t_point <= t_max) {
+        STAT_ADD(stats, nodes_visited, lookup.nodes_visited);
+        for (const OctreeNode *block : lookup.path) {
+            STAT_ADD(stats, triangle_tests, (long)block->n_triangles);
+            for (unsigned ref = block->first_triangle; ref < block->first_triangle + block->n_triangles; ref++) {
+                RaycastResult res = raycast(origin, ray, *octo.get_triangle(ref));
+                STAT_ADD(stats, triangle_hits, res.hit);
+                if (res.hit && res.distance < t_max && (res.distance < best_raycast.distance || !best_raycast.hit)) {
                     best_raycast = res;
+                    best_raycast.primitive = octo.triangle_indices[ref];
                 }
             }
         }
-        if (best_raycast.hit) {
+        // Triangles from the larger cells on the path can be hit beyond this cell, where a closer
+        // triangle may still be waiting in a later cell.
+        if (best_raycast.hit && best_raycast.distance <= t_point + lookup.node->exit_distance(point, ray)) {
             return best_raycast;
         }
 
         OctreeNode *last_node = lookup.node;
         while (lookup.node == last_node) {
-            point = point + (ray * lookup.node->radial * 2);
+            // Step just past the far side of the current cell, so no neighbouring cell is skipped.
+            t_point += advance(point, ray, lookup.node->exit_distance(point, ray) + lookup.node->radial * overshoot);
             lookup = octo.get_new_triangles(point, lookup.node);
         }
     }
     return best_raycast;
 }
 
-bool any_intersect(const Scene &scene, const Octree &octo, const Vec3 &origin, const Vec3 &ray, float t_max) {
-    // fudge the origin a little bit to prevent same-hit intersection
-    Vec3 new_origin = origin + (0.01 * ray);
-    Vec3 point = new_origin;
+// Whether any of the octree's triangles is hit within t_max.
+bool any_intersect_octree(const Octree &octo, const Vec3 &origin, const Vec3 &ray, float t_max, RenderStats &stats) {
+    Vec3 point = origin;
+    float t_point = 0;
+    float overshoot = 1e-3f / ray.magnitude();
     if (!octo.in_bounds(point)) {
         float t = octo.root->planes_intersection(origin, ray);
         if (t <= 0 || t >= t_max) {
             return false;
         }
         point = point + (ray * t);
+        t_point = t;
     }
     OctreeLookup lookup = octo.get_new_triangles(point);
-    while (octo.in_bounds(point) && lookup.is_valid) {
-        for (auto block : lookup.path) {
-            for (const Triangle *tri : *block) {
-                RaycastResult res = raycast(new_origin, ray, *tri);
+    while (octo.in_bounds(point) && lookup.is_valid && t_point <= t_max) {
+        STAT_ADD(stats, nodes_visited, lookup.nodes_visited);
+        for (const OctreeNode *block : lookup.path) {
+            for (unsigned ref = block->first_triangle; ref < block->first_triangle + block->n_triangles; ref++) {
+                RaycastResult res = raycast(origin, ray, *octo.get_triangle(ref));
+                STAT_ADD(stats, triangle_tests, 1);
+                STAT_ADD(stats, triangle_hits, res.hit);
                 if (res.hit && res.distance <= t_max) {
                     return true;
                 }
             }
         }
-        point = point + ray;
-        lookup = octo.get_new_triangles(point, lookup.node);
+        OctreeNode *last_node = lookup.node;
+        while (lookup.node == last_node) {
+            // Step just past the far side of the current cell, so no neighbouring cell is skipped.
+            t_point += advance(point, ray, lookup.node->exit_distance(point, ray) + lookup.node->radial * overshoot);
+            lookup = octo.get_new_triangles(point, lookup.node);
+        }
     }
     return false;
 }
 
-float local_illuminate(const RaycastResult &hit, const Scene &scene, const Octree &octo) {
+RaycastResult intersect(const Scene &scene, const Octree &octo, const InstanceTree &instances, const Vec3 &origin,
+                        const Vec3 &ray, const LodSelection &lod, RenderStats &stats) {
+    RaycastResult best_raycast = intersect_octree(octo, origin, ray, inf, stats);
+    RaycastResult instance_raycast = intersect_instances(scene, instances, origin, ray,
+                                                         best_raycast.hit ? best_raycast.distance : inf, lod, stats);
+    return instance_raycast.hit ? instance_raycast : best_raycast;
+}
+
+bool any_intersect(const Scene &scene, const Octree &octo, const InstanceTree &instances, const Vec3 &origin,
+                   const Vec3 &ray, float t_max, const LodSelection &lod, RenderStats &stats) {
+    // fudge the origin a little bit to prevent same-hit intersection
+    Vec3 new_origin = origin + (0.01 * ray);
+    return any_intersect_octree(octo, new_origin, ray, t_max, stats) ||
+           any_intersect_instances(scene, instances, new_origin, ray, t_max, lod, stats);
+}
+
+float local_illuminate(const Vec3 &point, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                       const LodSelection &lod, RenderStats &stats) {
     // distance falloff only
     float total_illumination = 0;
     for (const Light &light : scene.lights) {
-        Vec3 shadow_ray = (light.loc - hit.intersect);
+        Vec3 shadow_ray = (light.loc - point);
         float dist = shadow_ray.magnitude();
         shadow_ray = shadow_ray.normalize();
-        if (!any_intersect(scene, octo, hit.intersect, shadow_ray, dist)) {
+        STAT_ADD(stats, shadow_rays, 1);
+        if (!any_intersect(scene, octo, instances, point, shadow_ray, dist, lod, stats)) {
             float intensity = light.intensity / (4 * PI * dist * dist);
             total_illumination += intensity;
         }
@@ -160,10 +253,10 @@ float local_illuminate(const RaycastResult &hit, const Scene &scene, const Octre
     return total_illumination;
 }
 
-float fresnel(const Ray &incident, const RaycastResult &intersect) {
+float fresnel(const Ray &incident, const RaycastResult &intersect, float refraction_index) {
     float cosi = incident.ray ^ intersect.triangle.normal;
     float etai = 1;
-    float etat = intersect.triangle.refraction_index;
+    float etat = refraction_index;
     if (cosi > 0) {
         swap(etai, etat);
     }
@@ -180,12 +273,12 @@ float fresnel(const Ray &incident, const RaycastResult &intersect) {
     }
 }
 
-Ray refract(const Ray &incident, const RaycastResult &intersect) {
+Ray refract(const Ray &incident, const RaycastResult &intersect, float refraction_index) {
     Ray refract_ray;
-    refract_ray.refraction_index = intersect.triangle.refraction_index;
+    refract_ray.refraction_index = refraction_index;
     refract_ray.origin = intersect.intersect;
     float c = intersect.triangle.normal ^ incident.ray;
-    float r = incident.refraction_index / intersect.triangle.refraction_index;
+    float r = incident.refraction_index / refraction_index;
     Vec3 refraction = (r * incident.ray) + (r * c - sqrt(1 - r * r * (1 - c * c))) * intersect.triangle.normal;
     refract_ray.ray = refraction;
     if ((refract_ray.ray ^ incident.ray) <= 0) {
@@ -202,29 +295,140 @@ Ray reflect(const Ray &incident, const RaycastResult &intersect) {
     return reflect_ray;
 }
 
-void render_ray(Canvas &canvas, const Scene &scene, const Octree &octo, const Ray &ray, int i, int j, float multiplier,
-                int reflection_count, int max_reflections) {
-    if (reflection_count >= max_reflections || multiplier < EPS) {
+// Reflection limit of trace_ray instantiations that take it from their max_reflections argument.
+const int RUNTIME_REFLECTIONS = -1;
+
+template <int MAX_REFLECTIONS>
+static void trace_ray(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                      const RenderOptions &options, const Ray &ray, int i, int j, float multiplier,
+                      int reflection_count, int max_reflections, RenderStats &stats);
+
+/**
+ * Lights a hit and spawns its bounces, specialised per material kind: diffuse hits stop after the
+ * shadow rays, mirrors skip the Fresnel terms and never refract.
+ **/
+template <int KIND, int MAX_REFLECTIONS>
+static void shade(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                  const RenderOptions &options, const Ray &ray, const RaycastResult &hit, const Material &material,
+                  int i, int j, float multiplier, int reflection_count, int max_reflections, RenderStats &stats) {
+    LodSelection shadow_lod(ray.lod.tolerance * options.lod_shadow_scale, hit.instance, hit.level);
+    canvas[i][j] += local_illuminate(hit.intersect, scene, octo, instances, shadow_lod, stats) * material.scattering;
+    if (KIND == MATERIAL_DIFFUSE) {
+        return;
+    }
+    LodSelection bounce_lod(ray.lod.tolerance * options.lod_secondary_scale, hit.instance, hit.level);
+    float fresnel_intensity = 1 - material.scattering;
+    float reflection_intensity = KIND == MATERIAL_MIRROR ? 1 : fresnel(ray, hit, material.refraction_index);
+    Ray reflection_ray = reflect(ray, hit);
+    reflection_ray.lod = bounce_lod;
+    trace_ray<MAX_REFLECTIONS>(canvas, scene, octo, instances, options, reflection_ray, i, j,
+                               multiplier * fresnel_intensity * reflection_intensity, reflection_count + 1,
+                               max_reflections, stats);
+    if (KIND == MATERIAL_DIELECTRIC && reflection_intensity + EPS < 1.0) {
+        float refraction_intensity = 1 - reflection_intensity;
+        Ray refraction_ray = refract(ray, hit, material.refraction_index);
+        refraction_ray.lod = bounce_lod;
+        trace_ray<MAX_REFLECTIONS>(canvas, scene, octo, instances, options, refraction_ray, i, j,
+                                   multiplier * refraction_intensity * fresnel_intensity, reflection_count + 1,
+                                   max_reflections, stats);
+    }
+}
+
+// Shades a hit with the shade() specialisation for its material's kind.
+template <int MAX_REFLECTIONS>
+static void shade_hit(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                      const RenderOptions &options, const Ray &ray, const RaycastResult &hit, int i, int j,
+                      float multiplier, int reflection_count, int max_reflections, RenderStats &stats) {
+    const Material &material = scene.materials[hit.triangle.material];
+    switch (material.kind) {
+    case MATERIAL_DIFFUSE:
+        shade<MATERIAL_DIFFUSE, MAX_REFLECTIONS>(canvas, scene, octo, instances, options, ray, hit, material, i, j,
+                                                 multiplier, reflection_count, max_reflections, stats);
+        break;
+    case MATERIAL_MIRROR:
+        shade<MATERIAL_MIRROR, MAX_REFLECTIONS>(canvas, scene, octo, instances, options, ray, hit, material, i, j,
+                                                multiplier, reflection_count, max_reflections, stats);
+        break;
+    default:
+        shade<MATERIAL_DIELECTRIC, MAX_REFLECTIONS>(canvas, scene, octo, instances, options, ray, hit, material, i,
+                                                    j, multiplier, reflection_count, max_reflections, stats);
+    }
+}
+
+// With MAX_REFLECTIONS fixed at compile time the depth test folds into a constant comparison.
+template <int MAX_REFLECTIONS>
+static void trace_ray(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                      const RenderOptions &options, const Ray &ray, int i, int j, float multiplier,
+                      int reflection_count, int max_reflections, RenderStats &stats) {
+    int limit = MAX_REFLECTIONS == RUNTIME_REFLECTIONS ? max_reflections : MAX_REFLECTIONS;
+    if (reflection_count >= limit || multiplier < EPS) {
         return;
     }
-    RaycastResult hit = intersect(scene, octo, ray.origin, ray.ray);
+    if (reflection_count == 0) {
+        STAT_ADD(stats, primary_rays, 1);
+    } else {
+        STAT_ADD(stats, secondary_rays, 1);
+    }
+    STAT_MAX(stats, max_depth, reflection_count);
+    RaycastResult hit = intersect(scene, octo, instances, ray.origin, ray.ray, ray.lod, stats);
     if (hit.hit) {
-        canvas[i][j] += local_illuminate(hit, scene, octo) * hit.triangle.scattering;
-        if (hit.triangle.scattering + EPS < 1) {
-            float fresnel_intensity = 1 - hit.triangle.scattering;
-            float reflection_intensity = fresnel(ray, hit);
-            Ray reflection_ray = reflect(ray, hit);
-            render_ray(canvas, scene, octo, reflection_ray, i, j, multiplier * fresnel_intensity * reflection_intensity,
-                       reflection_count + 1, max_reflections);
-            if (reflection_intensity + EPS < 1.0) {
-                float refraction_intensity = 1 - reflection_intensity;
-                Ray refraction_ray = refract(ray, hit);
-                render_ray(canvas, scene, octo, refraction_ray, i, j,
-                           multiplier * refraction_intensity * fresnel_intensity, reflection_count + 1,
-                           max_reflections);
-            }
+        shade_hit<MAX_REFLECTIONS>(canvas, scene, octo, instances, options, ray, hit, i, j, multiplier,
+                                   reflection_count, max_reflections, stats);
+    }
+}
+
+void render_ray(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                const RenderOptions &options, const Ray &ray, int i, int j, float multiplier, int reflection_count,
+                int max_reflections, RenderStats &stats) {
+    if (max_reflections == DEFAULT_MAX_REFLECTIONS) {
+        trace_ray<DEFAULT_MAX_REFLECTIONS>(canvas, scene, octo, instances, options, ray, i, j, multiplier,
+                                           reflection_count, max_reflections, stats);
+    } else {
+        trace_ray<RUNTIME_REFLECTIONS>(canvas, scene, octo, instances, options, ray, i, j, multiplier,
+                                       reflection_count, max_reflections, stats);
+    }
+}
+
+/**
+ * render_ray() for a camera ray whose nearest triangle of scene.geometry was rasterised, -1 for
+ * none, away from any triangle's edge. The ray is tested against that triangle alone and against
+ * instances up to its hit. Samples near an edge, where the ray test could decide coverage or the
+ * nearest triangle differently, are traced by the caller instead; a covered sample the ray test
+ * still misses, such as on a triangle seen edge-on, falls back to a full traversal.
+ **/
+void render_primary(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                    const RenderOptions &options, const Ray &ray, int i, int j, int triangle, int max_reflections,
+                    RenderStats &stats) {
+    if (max_reflections <= 0) {
+        return;
+    }
+    STAT_ADD(stats, primary_rays, 1);
+    RaycastResult hit(false);
+    if (triangle >= 0) {
+        hit = raycast(ray.origin, ray.ray, scene.geometry[triangle]);
+        STAT_ADD(stats, triangle_tests, 1);
+        STAT_ADD(stats, triangle_hits, hit.hit);
+    }
+    if (triangle >= 0 && !hit.hit) {
+        hit = intersect(scene, octo, instances, ray.origin, ray.ray, ray.lod, stats);
+    } else {
+        hit.primitive = triangle;
+        RaycastResult instance_hit = intersect_instances(scene, instances, ray.origin, ray.ray,
+                                                         hit.hit ? hit.distance : inf, ray.lod, stats);
+        if (instance_hit.hit) {
+            hit = instance_hit;
         }
     }
+    if (!hit.hit) {
+        return;
+    }
+    if (max_reflections == DEFAULT_MAX_REFLECTIONS) {
+        shade_hit<DEFAULT_MAX_REFLECTIONS>(canvas, scene, octo, instances, options, ray, hit, i, j, 1, 0,
+                                           max_reflections, stats);
+    } else {
+        shade_hit<RUNTIME_REFLECTIONS>(canvas, scene, octo, instances, options, ray, hit, i, j, 1, 0,
+                                       max_reflections, stats);
+    }
 }
 
 Ray get_initial_ray(const Canvas &canvas, const Camera &camera, int ray_id) {
@@ -241,43 +445,226 @@ Ray get_initial_ray(const Canvas &canvas, const Camera &camera, int ray_id) {
     return ray;
 }
 
-void subrender(Canvas &canvas, const Scene &scene, const Octree &octo, const Camera &camera, queue<int> &block_queue,
-               mutex &queue_lock) {
+// Running total of the work counter a heatmap mode tracks; the per-pixel cost is its difference.
+long heatmap_counter(const RenderStats &stats, int heatmap_mode) {
+    switch (heatmap_mode) {
+    case HEATMAP_TRIANGLE_TESTS:
+        return stats.triangle_tests;
+    case HEATMAP_NODES_VISITED:
+        return stats.nodes_visited;
+    case HEATMAP_RAYS:
+        return stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+    case HEATMAP_NANOSECONDS:
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+    return 0;
+}
+
+// Traces the pixels from start_ray_id up to, but not including, end_ray_id or the canvas' end.
+void render_tile(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                 const Camera &camera, const RenderOptions &options, int start_ray_id, int end_ray_id,
+                 RenderStats &stats) {
+    bool heatmap = options.heatmap != nullptr && options.heatmap_mode != HEATMAP_NONE;
+    // Angle one pixel subtends at the camera, which turns the pixel error budget into a ray's tolerance.
+    float pixel_angle = camera.focal_plane_width / canvas.width / camera.focal_plane_distance;
+    TraceSpan tile_span("tile", start_ray_id);
+    auto block_start = std::chrono::steady_clock::now();
+    int max_px = min(end_ray_id, canvas.end_ray_id());
+    for (int ray_id = start_ray_id; ray_id < max_px; ray_id++) {
+        int i = ray_id / canvas.width;
+        int j = ray_id % canvas.width;
+        Ray ray = get_initial_ray(canvas, camera, ray_id);
+        ray.lod.tolerance = options.lod_pixel_error * pixel_angle;
+        long work_before = heatmap ? heatmap_counter(stats, options.heatmap_mode) : 0;
+        if (options.visibility != nullptr && !options.visibility->on_edge[ray_id]) {
+            render_primary(canvas, scene, octo, instances, options, ray, i, j, options.visibility->triangles[ray_id],
+                           camera.max_reflections, stats);
+        } else {
+            render_ray(canvas, scene, octo, instances, options, ray, i, j, 1, 0, camera.max_reflections, stats);
+        }
+        if (heatmap) {
+            (*options.heatmap)[i][j] = heatmap_counter(stats, options.heatmap_mode) - work_before;
+        }
+    }
+    stats.busy_seconds += seconds_since(block_start);
+}
+
+void subrender(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+               const Camera &camera, const RenderOptions &options, vector<queue<std::pair<int, int>>> &block_queues,
+               int home_queue, mutex &queue_lock, RenderStats &stats) {
     while (true) {
         queue_lock.lock();
         // printf("%lu render blocks remaining...\n", block_queue.size());
+        int queue_id = home_queue;
+        for (int q = 0; q < block_queues.size() && block_queues[queue_id].empty(); q++) {
+            // Our own region is done, help out elsewhere rather than sit idle.
+            queue_id = q;
+        }
+        queue<std::pair<int, int>> &block_queue = block_queues[queue_id];
         if (block_queue.empty()) {
             queue_lock.unlock();
             break;
         }
-        int start_ray_id = block_queue.front();
+        auto [start_ray_id, end_ray_id] = block_queue.front();
         block_queue.pop();
         queue_lock.unlock();
-        int max_px = min(start_ray_id + PIXEL_BLOCK_SIZE, canvas.width * canvas.height);
-        for (int ray_id = start_ray_id; ray_id < max_px; ray_id++) {
-            int i = ray_id / canvas.width;
-            int j = ray_id % canvas.width;
-            Ray ray = get_initial_ray(canvas, camera, ray_id);
-            render_ray(canvas, scene, octo, ray, i, j, 1, 0, camera.max_reflections);
-        }
+        render_tile(canvas, scene, octo, instances, camera, options, start_ray_id, end_ray_id, stats);
+    }
+}
+
+// Memory held by the scene's acceleration structures: its octree and every mesh level.
+size_t build_bytes(const Scene &scene, const Octree &octo) {
+    size_t bytes = octo.memory_bytes();
+    for (const shared_ptr<Mesh> &mesh : scene.meshes) {
+        bytes += mesh->memory_bytes();
     }
+    return bytes;
 }
 
-void render(Canvas &canvas, const Scene &scene, const Camera &camera) {
-    int n_workers = max((int)thread::hardware_concurrency() - 1, 1);
-    Octree octo(scene);
-    queue<int> blocks;
+void render(Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options,
+            RenderStats *stats) {
+    auto build_start = std::chrono::steady_clock::now();
+    trace_begin("octree build");
+    Octree octo(scene, options.octree_cache_dir, options.octree_depth, options.parallel_limits());
+    InstanceTree instances(scene);
+    trace_end();
+    render(canvas, scene, octo, instances, camera, options, stats, seconds_since(build_start));
+}
+
+void render(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+            const Camera &camera, const RenderOptions &options, RenderStats *stats, double build_seconds) {
+    TraceSpan render_span("render");
+    int n_workers = options.n_threads > 0 ? options.n_threads : max((int)thread::hardware_concurrency() - 1, 1);
+    vector<int> cpus = options.cpus.empty() ? allowed_cpus() : options.cpus;
+    vector<vector<int>> nodes = options.numa ? numa_nodes(cpus) : vector<vector<int>>{cpus};
+    int n_nodes = nodes.size();
+
+    // Spread the workers over the CPUs, and so over the nodes, in proportion to each node's share.
+    vector<int> worker_node(n_workers);
+    vector<vector<int>> worker_cpus(n_workers);
+    vector<int> node_workers(n_nodes, 0);
+    vector<std::pair<int, int>> node_cpus;
+    for (int node = 0; node < n_nodes; node++) {
+        for (int cpu : nodes[node]) {
+            node_cpus.push_back({node, cpu});
+        }
+    }
+    for (int i = 0; i < n_workers && !node_cpus.empty(); i++) {
+        auto [node, cpu] = node_cpus[(long)i * node_cpus.size() / n_workers];
+        worker_node[i] = node;
+        node_workers[node]++;
+        if (options.pin_threads) {
+            worker_cpus[i] = {cpu};
+        } else if (options.numa || !options.cpus.empty()) {
+            worker_cpus[i] = nodes[node];
+        }
+    }
+
+    auto build_start = std::chrono::steady_clock::now();
+    // Replicas are copied by a thread on the target node so their pages are allocated there.
+    vector<const Octree *> node_octrees(n_nodes, &octo);
+    int n_replicas = 0;
+    if (options.numa && options.numa_replicate_octree && n_nodes > 1) {
+        TraceSpan replicate_span("octree replication");
+        vector<thread> copiers;
+        for (int node = 0; node < n_nodes; node++) {
+            if (node_workers[node] == 0) {
+                continue;
+            }
+            n_replicas++;
+            copiers.push_back(thread([&, node]() {
+                pin_current_thread(nodes[node]);
+                node_octrees[node] = new Octree(octo);
+            }));
+        }
+        for (thread &t : copiers) {
+            t.join();
+        }
+    }
+    RenderOptions tile_options = options;
+    VisibilityBuffer visibility;
+    double raster_seconds = 0;
+    if (options.raster_primary) {
+        auto raster_start = std::chrono::steady_clock::now();
+        visibility = rasterize(scene, camera, canvas.width, canvas.height, n_workers);
+        tile_options.visibility = &visibility;
+        raster_seconds = seconds_since(raster_start);
+    }
+    build_seconds += seconds_since(build_start);
+
+    // One contiguous, page-aligned canvas region per node, sized by its worker count.
+    auto render_start = std::chrono::steady_clock::now();
+    const int PAGE_PIXELS = 4096 / sizeof(float);
+    int n_pixels = canvas.width * canvas.height;
+    vector<int> region_start(n_nodes + 1, n_pixels);
+    region_start[0] = 0;
+    for (int node = 0, assigned = 0; node < n_nodes - 1; node++) {
+        assigned += node_workers[node];
+        long boundary = (long)n_pixels * assigned / n_workers;
+        region_start[node + 1] = min((int)(boundary / PAGE_PIXELS * PAGE_PIXELS), n_pixels);
+    }
+    // A region's last tile stops at the region's end, so that no pixel is traced by two workers.
+    vector<queue<std::pair<int, int>>> blocks(n_nodes);
     mutex queue_lock;
-    for (int i = 0; i < canvas.width * canvas.height; i += PIXEL_BLOCK_SIZE) {
-        blocks.push(i);
+    for (int node = 0; node < n_nodes; node++) {
+        for (int i = region_start[node]; i < region_start[node + 1]; i += options.tile_pixels) {
+            blocks[node].push({i, min(i + options.tile_pixels, region_start[node + 1])});
+        }
     }
+    // Every region is touched from its node before any worker starts, since a worker may take its first
+    // tile while a touch of the same region would still be rewriting the pixels behind it.
+    if (options.numa) {
+        vector<thread> touchers;
+        for (int node = 0; node < n_nodes; node++) {
+            if (region_start[node + 1] == region_start[node]) {
+                continue;
+            }
+            touchers.push_back(thread([&, node]() {
+                pin_current_thread(nodes[node]);
+                first_touch(&canvas.buffer[region_start[node]],
+                            (region_start[node + 1] - region_start[node]) * sizeof(float));
+            }));
+        }
+        for (thread &t : touchers) {
+            t.join();
+        }
+    }
+    vector<RenderStats> worker_stats(n_workers);
     vector<thread> threads;
     for (int i = 0; i < n_workers; i++) {
-        threads.push_back(
-            thread(subrender, ref(canvas), ref(scene), ref(octo), ref(camera), ref(blocks), ref(queue_lock)));
+        int node = worker_node[i];
+        threads.push_back(thread([&, i, node]() {
+            pin_current_thread(worker_cpus[i]);
+            subrender(canvas, scene, *node_octrees[node], instances, camera, tile_options, blocks, node,
+                      queue_lock, worker_stats[i]);
+        }));
     }
     for (thread &t : threads) {
         t.join();
     }
+    double render_seconds = seconds_since(render_start);
+    for (const Octree *replica : node_octrees) {
+        if (replica != &octo) {
+            delete replica;
+        }
+    }
+    trace_begin("expose");
     camera.expose(canvas);
+    trace_end();
+    if (stats != nullptr) {
+        *stats = RenderStats();
+        for (RenderStats &worker : worker_stats) {
+            // Whatever part of the render a worker was not tracing for, it spent on the queue or waiting on
+            // the other workers to finish.
+            worker.idle_seconds = max(render_seconds - worker.busy_seconds, 0.0);
+            stats->merge(worker);
+        }
+        stats->build_seconds = build_seconds;
+        stats->raster_seconds = raster_seconds;
+        stats->build_bytes = octo.memory_bytes() * n_replicas + build_bytes(scene, octo);
+        stats->octree_cached = octo.mapping != nullptr;
+        stats->render_seconds = render_seconds;
+    }
 }
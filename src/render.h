@@ -3,13 +3,20 @@
 #include "linalg.h"
 #include "stdio.h"
 #include "octree.h"
+#include "parallel.h"
+#include "trace.h"
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <ostream>
 #include <queue>
 #include <string.h>
+#include <string>
+#include <sys/mman.h>
 #include <thread>
 #include <vector>
 using std::abs;
@@ -19,8 +26,10 @@ using std::max;
 using std::min;
 using std::mutex;
 using std::queue;
+using std::shared_ptr;
 using std::ref;
 using std::sqrt;
+using std::string;
 using std::swap;
 using std::thread;
 using std::vector;
@@ -28,12 +37,42 @@ using std::vector;
 // enum declarations
 const int AUTO_LINEAR_EXPOSURE = 0;
 const int MANUAL_LINEAR_EXPOSURE = 1;
+const int HEATMAP_NONE = 0;
+const int HEATMAP_TRIANGLE_TESTS = 1;
+const int HEATMAP_NODES_VISITED = 2;
+const int HEATMAP_RAYS = 3;
+const int HEATMAP_NANOSECONDS = 4;
+// Pixels per render tile: two cache lines of the float canvas.
+const int BLOCK_SIZE = 64;
+const int PIXEL_BLOCK_SIZE = 2 * BLOCK_SIZE / sizeof(float);
+const int MATERIAL_DIFFUSE = 0;
+const int MATERIAL_MIRROR = 1;
+const int MATERIAL_DIELECTRIC = 2;
+const int DEFAULT_MAX_REFLECTIONS = 8;
+const int NODE_FORMAT_AUTO = 0;
+const int NODE_FORMAT_OCTREE = 1;
+const int NODE_FORMAT_COMPRESSED = 2;
+
+// Render counters are on by default; build with -DRENDER_STATS=0 to compile them out entirely.
+#ifndef RENDER_STATS
+#define RENDER_STATS 1
+#endif
+#if RENDER_STATS
+#define STAT_ADD(stats, field, n) ((stats).field += (n))
+#define STAT_MAX(stats, field, n) ((stats).field = max((stats).field, (n)))
+#else
+#define STAT_ADD(stats, field, n) ((void)0)
+#define STAT_MAX(stats, field, n) ((void)0)
+#endif
 
 // forward declarations
 struct Triangle;
 struct Canvas;
 struct BoundingBox;
 class Octree;
+class InstanceTree;
+class CompressedBvh;
+struct VisibilityBuffer;
 
 Triangle const operator-(const Triangle &tri, const Vec3 &vec);
 Triangle const operator+(const Triangle &tri, const Vec3 &vec);
@@ -41,8 +80,8 @@ Triangle const operator+(const Triangle &tri, const Vec3 &vec);
 struct Triangle {
   public:
     Vec3 v0, v1, v2, normal;
-    float refraction_index = 1.5;
-    float scattering = 0.1; // opacity
+    // Index into the owning scene's material table.
+    int material = 0;
     /**
      * Create a triangle using CW winding order.
      **/
@@ -52,20 +91,20 @@ struct Triangle {
         v1 = other.v1;
         v2 = other.v2;
         normal = other.normal;
-        refraction_index = other.refraction_index;
-        scattering = other.scattering;
+        material = other.material;
     }
     Triangle(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2) : v0(v0), v1(v1), v2(v2) {
         normal = ((v1 - v0) % (v2 - v1)).normalize();
     };
+    // The normal argument is not used: normals always follow the winding of v0, v1, v2, whatever a
+    // file recorded.
     Triangle(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2, const Vec3 &normal)
         : v0(v0), v1(v1), v2(v2) {
         this->normal = ((v1 - v0) % (v2 - v1)).normalize();
     };
 
-    Triangle(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2, const Vec3 &normal,
-             float refraction_index, float scattering)
-        : v0(v0), v1(v1), v2(v2), refraction_index(refraction_index), scattering(scattering) {
+    Triangle(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2, const Vec3 &normal, int material)
+        : v0(v0), v1(v1), v2(v2), material(material) {
         this->normal = ((v1 - v0) % (v2 - v1)).normalize();
     };
     void operator=(const Triangle &other) {
@@ -73,12 +112,26 @@ struct Triangle {
         v1 = other.v1;
         v2 = other.v2;
         normal = other.normal;
-        refraction_index = other.refraction_index;
-        scattering = other.scattering;
+        material = other.material;
     }
     BoundingBox get_bounds() const;
 };
 
+/**
+ * Surface response, shared through the scene's material table by every primitive using it.
+ * scattering is the share of light a hit scatters diffusely (its opacity); the rest is split
+ * between reflection and refraction by the Fresnel equations at refraction_index, or all
+ * reflected when the index is infinite. kind is derived from the two so that shading can be
+ * specialised: diffuse surfaces spawn no secondary rays and mirrors never refract.
+ **/
+struct Material {
+  public:
+    float refraction_index = 1.5;
+    float scattering = 0.1;
+    int kind = MATERIAL_DIELECTRIC;
+    Material(float refraction_index, float scattering);
+};
+
 struct Light {
   public:
     Vec3 loc;
@@ -106,13 +159,187 @@ struct Camera {
           focal_plane_height(height) {
         exposure_mode = AUTO_LINEAR_EXPOSURE;
     }
-    int max_reflections = 8;
+    int max_reflections = DEFAULT_MAX_REFLECTIONS;
 };
 
-struct Scene {
+/**
+ * One level of detail of a mesh: its triangles, their acceleration structure (exactly one of
+ * octree and bvh is set), and how far (in object units) the level may stray from the full-detail
+ * surface.
+ **/
+struct MeshLevel {
   public:
     vector<Triangle> geometry;
+    Octree *octree = nullptr;
+    CompressedBvh *bvh = nullptr;
+    float error = 0;
+};
+
+/**
+ * Geometry uploaded once and placed any number of times through instances. levels[0] is the
+ * geometry as given; each further level is decimated to about a quarter of the one before, down to
+ * n_levels levels or MIN_LOD_TRIANGLES triangles. Every level gets its own octree or compressed
+ * BVH in the mesh's object space when the mesh is created; NODE_FORMAT_AUTO picks the BVH for
+ * levels of at least COMPRESSED_MIN_TRIANGLES triangles.
+ **/
+struct Mesh {
+  public:
+    vector<MeshLevel> levels;
+    BoundingBox bounds;
+    Mesh(const vector<Triangle> &geometry, int n_levels = 1, int node_format = NODE_FORMAT_AUTO,
+         const ParallelLimits &limits = ParallelLimits());
+    Mesh(const Mesh &other) = delete;
+    ~Mesh();
+    int level_for(float max_error) const;
+    size_t memory_bytes() const;
+};
+
+/**
+ * A placement of a mesh. A material other than -1 replaces the mesh triangles' own on every hit
+ * on the instance.
+ **/
+struct Instance {
+  public:
+    int mesh = 0;
+    Affine object_to_world;
+    Affine world_to_object;
+    // Largest stretch of the transform, turning object-space errors into world-space bounds.
+    float scale = 1;
+    int material = -1;
+    Instance(){};
+    Instance(int mesh, const Affine &object_to_world);
+};
+
+/**
+ * A scene's own triangles, shared by copies of the scene until one of them writes: copying only
+ * takes a reference, and edit() copies the array first if another scene still holds it. Octrees
+ * keep pointers into the array, so sharing it is what lets a scene snapshot's octree serve later
+ * versions with the same geometry. A scene must not be copied while another thread edits it.
+ **/
+class SharedGeometry {
+  public:
+    SharedGeometry() : triangles(std::make_shared<vector<Triangle>>()) {}
+    operator const vector<Triangle> &() const { return *triangles; }
+    const Triangle &operator[](size_t i) const { return (*triangles)[i]; }
+    const Triangle *data() const { return triangles->data(); }
+    size_t size() const { return triangles->size(); }
+    bool empty() const { return triangles->empty(); }
+    // True when both hold the same array. A holder keeps it alive and unedited, so this is identity.
+    bool shares(const SharedGeometry &other) const { return triangles == other.triangles; }
+    // The triangles for writing, unshared first.
+    vector<Triangle> &edit() {
+        if (triangles.use_count() > 1) {
+            triangles = std::make_shared<vector<Triangle>>(*triangles);
+        }
+        return *triangles;
+    }
+
+  private:
+    shared_ptr<vector<Triangle>> triangles;
+};
+
+struct Scene {
+  public:
+    // materials[0] is the default of triangles that name none.
+    vector<Material> materials;
+    SharedGeometry geometry;
     vector<Light> lights;
+    vector<shared_ptr<Mesh>> meshes;
+    vector<Instance> instances;
+    Scene() : materials(1, Material(1.5, 0.1)) {}
+    // Index of the material with these parameters, adding it to the table if it is new.
+    int material_id(float refraction_index, float scattering);
+};
+
+// Defined here rather than in octree.h, which is included before Triangle is complete.
+inline const Triangle *Octree::get_triangle(unsigned ref) const { return &triangles[triangle_indices[ref]]; }
+
+/**
+ * Render counters. Every worker owns one (cache-line aligned, so no false sharing) and they are
+ * merged into a single summary once the workers have joined.
+ **/
+struct alignas(64) RenderStats {
+  public:
+    long primary_rays = 0;
+    long secondary_rays = 0;
+    long shadow_rays = 0;
+    long triangle_tests = 0;
+    long triangle_hits = 0;
+    long nodes_visited = 0;
+    int max_depth = 0;
+    double busy_seconds = 0;
+    double idle_seconds = 0;
+    double build_seconds = 0;
+    // Time spent rasterising primary visibility, included in build_seconds.
+    double raster_seconds = 0;
+    double render_seconds = 0;
+    size_t build_bytes = 0;
+    bool octree_cached = false;
+    // Set by relight() when it shaded from its G-buffer instead of tracing the scene.
+    bool gbuffer_reused = false;
+    // Filled in by merge(), one entry per merged worker.
+    vector<double> worker_busy_seconds;
+    vector<double> worker_idle_seconds;
+    void merge(const RenderStats &other);
+};
+
+/**
+ * Per-render settings that are not part of the camera.
+ * heatmap: optional canvas, same size as the render target, that receives the work spent on each
+ * pixel as selected by heatmap_mode. The counter-based modes need RENDER_STATS.
+ * n_threads: worker count, 0 uses all but one hardware thread.
+ * cpus: CPUs the workers may run on, empty means whatever the process is allowed. The octree and
+ * mesh builds a render starts are held to the same count and CPUs (see parallel_limits()).
+ * pin_threads: bind each worker to a single CPU instead of the whole set.
+ * numa: place workers by NUMA node and give each node a contiguous canvas region, first-touched by
+ * its own workers. numa_replicate_octree additionally gives each node its own copy of the octree.
+ * octree_cache_dir: where built octrees are saved and mapped back from, empty disables the cache.
+ * tile_pixels: pixels per work item handed to a worker.
+ * octree_depth: depth of the scene octree's leaf grid, clamped to 1..MAX_OCTREE_DEPTH.
+ * raster_primary: find each camera ray's first hit on the scene's own geometry by rasterising it
+ * instead of traversing the octree, then trace only the bounces and shadow rays. Instanced meshes
+ * are still traced, up to the rasterised hit. render() and render_async() only; strips and relight
+ * always trace.
+ * visibility: the rasterised first hits render_tile() starts from, set by the renderer when
+ * raster_primary is on.
+ **/
+struct RenderOptions {
+  public:
+    int heatmap_mode = HEATMAP_NONE;
+    Canvas *heatmap = nullptr;
+    int n_threads = 0;
+    vector<int> cpus;
+    bool pin_threads = false;
+    bool numa = false;
+    bool numa_replicate_octree = false;
+    string octree_cache_dir;
+    // Level-of-detail budget for instanced meshes. Camera rays accept lod_pixel_error pixels of
+    // geometric error where they land, every bounce lod_secondary_scale times its parent's budget
+    // and shadow rays lod_shadow_scale times that of the ray that found the shaded point. 0 keeps
+    // every ray on full detail.
+    float lod_pixel_error = 0.5;
+    float lod_secondary_scale = 4;
+    float lod_shadow_scale = 4;
+    int tile_pixels = PIXEL_BLOCK_SIZE;
+    int octree_depth = DEFAULT_OCTREE_DEPTH;
+    bool raster_primary = false;
+    const VisibilityBuffer *visibility = nullptr;
+    ParallelLimits parallel_limits() const { return ParallelLimits{n_threads, cpus}; }
+};
+
+/**
+ * How a ray picks levels of detail of instanced meshes. The instance a ray leaves from is traced at
+ * the level it was hit at, so a surface never shadows or reflects off a finer or coarser copy of
+ * itself; every other instance gets the coarsest level within tolerance times its distance.
+ **/
+struct LodSelection {
+  public:
+    // Geometric error accepted per unit of distance along the ray, 0 for full detail.
+    float tolerance = 0;
+    int instance = -1;
+    int level = 0;
+    LodSelection(){};
+    LodSelection(float tolerance, int instance, int level) : tolerance(tolerance), instance(instance), level(level){};
 };
 
 struct RaycastResult {
@@ -121,6 +348,13 @@ struct RaycastResult {
     Triangle triangle;
     float distance = 999999;
     bool hit = false;
+    // The instance and level of detail the triangle came from, -1 for the scene's own geometry.
+    int instance = -1;
+    int level = 0;
+    // Index of the triangle in its geometry, and the hit's weights on v1 and v2.
+    int primitive = -1;
+    float u = 0;
+    float v = 0;
     RaycastResult(Vec3 intersect, float t, Triangle tri) : intersect(intersect), distance(t) {
         triangle = tri;
         hit = true;
@@ -133,13 +367,29 @@ struct Canvas {
   public:
     int width, height;
     float *buffer;
+    // The rows held in buffer. A strip canvas holds a window of a taller image, and is indexed by
+    // image row.
+    int first_row = 0;
+    int n_rows;
+
+    // Anonymous mappings come zeroed and untouched, so each page lands on the NUMA node of the
+    // thread that first writes it. A failed mapping throws std::bad_alloc, as new would.
+    Canvas(int rows, int cols) : width(cols), height(rows), n_rows(rows) { map(); }
+    Canvas(int rows, int cols, int strip_rows) : width(cols), height(rows), n_rows(strip_rows) { map(); }
+    ~Canvas() { munmap(buffer, bytes()); }
+    size_t bytes() const { return max((size_t)width * n_rows * sizeof(float), sizeof(float)); }
+    float *operator[](int row) { return &buffer[(size_t)(row - first_row) * width]; }
+    // One past the last pixel id held; the last strip of an image may run past its bottom.
+    int end_ray_id() const { return min(first_row + n_rows, height) * width; }
 
-    Canvas(int rows, int cols) : width(cols), height(rows) {
-        buffer = new float[width * height];
-        memset(buffer, 0.0f, width * height * sizeof(float));
+  private:
+    void map() {
+        void *memory = mmap(nullptr, bytes(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        buffer = (float *)memory;
     }
-    ~Canvas() { delete[] buffer; }
-    float *operator[](int row) { return &buffer[row * width]; }
 };
 
 struct Ray {
@@ -147,11 +397,38 @@ struct Ray {
     Vec3 origin;
     Vec3 ray;
     float refraction_index = 1;
+    LodSelection lod;
 };
 
-void render_ray(Canvas &canvas, const Scene &scene, const Octree& octo, const Ray &ray, int i, int j, float multiplier,
-                int reflection_count, int max_reflections);
-void subrender(Canvas &canvas, const Scene &scene, const Octree &octo, const Camera &camera, queue<int> &block_queue, mutex &queue_lock);
+double seconds_since(std::chrono::steady_clock::time_point start);
+RaycastResult raycast(const Vec3 &origin, const Vec3 &ray, const Triangle &tri);
+RaycastResult intersect_octree(const Octree &octo, const Vec3 &origin, const Vec3 &ray, float t_max,
+                               RenderStats &stats);
+bool any_intersect_octree(const Octree &octo, const Vec3 &origin, const Vec3 &ray, float t_max, RenderStats &stats);
+RaycastResult intersect(const Scene &scene, const Octree &octo, const InstanceTree &instances, const Vec3 &origin,
+                        const Vec3 &ray, const LodSelection &lod, RenderStats &stats);
+float local_illuminate(const Vec3 &point, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                       const LodSelection &lod, RenderStats &stats);
+float fresnel(const Ray &incident, const RaycastResult &intersect, float refraction_index);
+Ray refract(const Ray &incident, const RaycastResult &intersect, float refraction_index);
+Ray reflect(const Ray &incident, const RaycastResult &intersect);
+void render_ray(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                const RenderOptions &options, const Ray &ray, int i, int j, float multiplier, int reflection_count,
+                int max_reflections, RenderStats &stats);
+void render_primary(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                    const RenderOptions &options, const Ray &ray, int i, int j, int triangle, int max_reflections,
+                    RenderStats &stats);
+void render_tile(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                 const Camera &camera, const RenderOptions &options, int start_ray_id, int end_ray_id,
+                 RenderStats &stats);
+void subrender(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+               const Camera &camera, const RenderOptions &options, vector<queue<std::pair<int, int>>> &block_queues,
+               int home_queue, mutex &queue_lock, RenderStats &stats);
 Ray get_initial_ray(const Canvas &canvas, const Camera &camera, int ray_id);
-void render(Canvas &canvas, const Scene &scene, const Camera &camera);
+size_t build_bytes(const Scene &scene, const Octree &octo);
+void render(Canvas &canvas, const Scene &scene, const Camera &camera, const RenderOptions &options = RenderOptions(),
+            RenderStats *stats = nullptr);
+// render() with the octree and instance tree already built, which took build_seconds.
+void render(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+            const Camera &camera, const RenderOptions &options, RenderStats *stats, double build_seconds = 0);
 #endif
@@ -0,0 +1,283 @@
+#include "scene_file.h"
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+const size_t STL_HEADER_BYTES = 84;
+const size_t STL_RECORD_BYTES = 50;
+// Levels of detail a mesh gets unless its line says otherwise, as in add_mesh.
+const int DEFAULT_MESH_LEVELS = 4;
+
+// Reads a binary STL as four points per triangle, its normal then its vertices, with read_stl's
+// (x, y, z) -> (x, -z, y) swap.
+static bool read_stl(const string &path, vector<Vec3> &corners) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    std::streamoff file_bytes = in.tellg();
+    char header[STL_HEADER_BYTES];
+    if (file_bytes < (std::streamoff)STL_HEADER_BYTES || !in.seekg(0) || !in.read(header, STL_HEADER_BYTES)) {
+        return false;
+    }
+    uint32_t n;
+    memcpy(&n, header + 80, sizeof(n));
+    // The count comes from the file, so it is checked against the file's size before anything is allocated.
+    if (n == 0 || (size_t)n * STL_RECORD_BYTES > (size_t)file_bytes - STL_HEADER_BYTES) {
+        return false;
+    }
+    vector<char> records((size_t)n * STL_RECORD_BYTES);
+    if (!in.read(records.data(), records.size())) {
+        return false;
+    }
+    corners.reserve((size_t)n * 4);
+    for (size_t t = 0; t < n; t++) {
+        for (int k = 0; k < 4; k++) {
+            float xyz[3];
+            memcpy(xyz, &records[t * STL_RECORD_BYTES + 12 * k], sizeof(xyz));
+            corners.push_back(Vec3(xyz[0], -xyz[2], xyz[1]));
+        }
+    }
+    return true;
+}
+
+/**
+ * The triangles of an STL after the stl and mesh directives' options. The arithmetic is done in
+ * double and rounded once, as numpy does for stl_forge, so both build the same vertices.
+ **/
+static bool load_triangles(const string &path, int material, bool center, const Vec3 &translate, bool flip_y,
+                           vector<Triangle> &triangles) {
+    vector<Vec3> corners;
+    if (!read_stl(path, corners)) {
+        return false;
+    }
+    double mean[3] = {0, 0, 0};
+    size_t n_triangles = corners.size() / 4;
+    if (center) {
+        for (size_t t = 0; t < n_triangles; t++) {
+            for (int k = 1; k < 4; k++) {
+                mean[0] += corners[t * 4 + k].x;
+                mean[1] += corners[t * 4 + k].y;
+                mean[2] += corners[t * 4 + k].z;
+            }
+        }
+        for (double &m : mean) {
+            m /= n_triangles * 3;
+        }
+    }
+    auto place = [&](const Vec3 &v) {
+        double y = (double)v.y - mean[1] + translate.y;
+        return Vec3((double)v.x - mean[0] + translate.x, flip_y ? -y : y, (double)v.z - mean[2] + translate.z);
+    };
+    triangles.reserve(triangles.size() + n_triangles);
+    for (size_t t = 0; t < n_triangles; t++) {
+        const Vec3 *c = &corners[t * 4];
+        triangles.push_back(Triangle(place(c[1]), place(c[2]), place(c[3]), c[0], material));
+    }
+    return true;
+}
+
+// Parses tokens[at] as a float; "inf" is accepted.
+static bool parse_float(const vector<string> &tokens, size_t at, float &value) {
+    if (at >= tokens.size()) {
+        return false;
+    }
+    char *end;
+    value = strtof(tokens[at].c_str(), &end);
+    return *end == '\0' && end != tokens[at].c_str();
+}
+
+static bool parse_int(const vector<string> &tokens, size_t at, int &value) {
+    if (at >= tokens.size()) {
+        return false;
+    }
+    char *end;
+    value = strtol(tokens[at].c_str(), &end, 10);
+    return *end == '\0' && end != tokens[at].c_str();
+}
+
+static bool parse_vec3(const vector<string> &tokens, size_t at, Vec3 &value) {
+    return parse_float(tokens, at, value.x) && parse_float(tokens, at + 1, value.y) &&
+           parse_float(tokens, at + 2, value.z);
+}
+
+// Twelve floats from tokens[at] on, a 3x4 object-to-world matrix in rows as add_instance takes it.
+static bool parse_matrix(const vector<string> &tokens, size_t at, Affine &value) {
+    float m[12];
+    for (int k = 0; k < 12; k++) {
+        if (!parse_float(tokens, at + k, m[k])) {
+            return false;
+        }
+    }
+    value = Affine(Mat3(Vec3(m[0], m[4], m[8]), Vec3(m[1], m[5], m[9]), Vec3(m[2], m[6], m[10])),
+                   Vec3(m[3], m[7], m[11]));
+    return true;
+}
+
+// Everything one line can get wrong; returns the reason, empty when the line was applied.
+static string apply_line(const vector<string> &tokens, SceneDescription &description) {
+    Scene &scene = description.scene;
+    Camera &camera = description.camera;
+    const string &directive = tokens[0];
+    auto material = [&](const string &name, int &id) {
+        auto found = description.materials.find(name);
+        id = found == description.materials.end() ? -1 : found->second;
+        return id >= 0;
+    };
+
+    if (directive == "resolution") {
+        if (!parse_int(tokens, 1, description.width) || !parse_int(tokens, 2, description.height) ||
+            description.width <= 0 || description.height <= 0 || tokens.size() != 3) {
+            return "expected resolution <width> <height>";
+        }
+    } else if (directive == "camera") {
+        if (!parse_vec3(tokens, 1, camera.loc)) {
+            return "expected camera <x> <y> <z>";
+        }
+        for (size_t at = 4; at < tokens.size();) {
+            const string &option = tokens[at];
+            if (option == "rotation" && parse_vec3(tokens, at + 1, camera.rotation)) {
+                at += 4;
+            } else if (option == "focal" && parse_float(tokens, at + 1, camera.focal_plane_distance) &&
+                       parse_float(tokens, at + 2, camera.focal_plane_width) &&
+                       parse_float(tokens, at + 3, camera.focal_plane_height)) {
+                at += 4;
+            } else if (option == "exposure" && parse_float(tokens, at + 1, camera.max_exposure_energy)) {
+                camera.exposure_mode = MANUAL_LINEAR_EXPOSURE;
+                at += 2;
+            } else if (option == "reflections" && parse_int(tokens, at + 1, camera.max_reflections)) {
+                at += 2;
+            } else {
+                return "bad camera option " + option;
+            }
+        }
+    } else if (directive == "material") {
+        float scattering, refraction_index;
+        if (tokens.size() != 4 || !parse_float(tokens, 2, scattering) || !parse_float(tokens, 3, refraction_index)) {
+            return "expected material <name> <scattering> <refraction index>";
+        }
+        description.materials[tokens[1]] = scene.material_id(refraction_index, scattering);
+    } else if (directive == "stl" || directive == "mesh") {
+        bool is_mesh = directive == "mesh";
+        size_t first_option = is_mesh ? 4 : 3;
+        if (tokens.size() < first_option) {
+            return is_mesh ? "expected mesh <name> <path> <material>" : "expected stl <path> <material>";
+        }
+        const string &path = tokens[first_option - 2];
+        int material_id;
+        if (!material(tokens[first_option - 1], material_id)) {
+            return "unknown material " + tokens[first_option - 1];
+        }
+        bool center = false, flip_y = false;
+        Vec3 translate(0, 0, 0);
+        int n_levels = DEFAULT_MESH_LEVELS;
+        for (size_t at = first_option; at < tokens.size();) {
+            const string &option = tokens[at];
+            if (option == "center") {
+                center = true;
+                at++;
+            } else if (option == "flip_y") {
+                flip_y = true;
+                at++;
+            } else if (option == "translate" && !is_mesh && parse_vec3(tokens, at + 1, translate)) {
+                at += 4;
+            } else if (option == "lod" && is_mesh && parse_int(tokens, at + 1, n_levels) && n_levels > 0) {
+                at += 2;
+            } else {
+                return "bad " + directive + " option " + option;
+            }
+        }
+        vector<Triangle> triangles;
+        vector<Triangle> &target = is_mesh ? triangles : scene.geometry.edit();
+        if (!load_triangles(path, material_id, center, translate, flip_y, target)) {
+            return "could not read STL " + path;
+        }
+        if (is_mesh) {
+            description.meshes[tokens[1]] = scene.meshes.size();
+            scene.meshes.push_back(
+                std::make_shared<Mesh>(triangles, n_levels, NODE_FORMAT_AUTO, description.build_limits));
+        }
+    } else if (directive == "instance") {
+        auto mesh = tokens.size() > 1 ? description.meshes.find(tokens[1]) : description.meshes.end();
+        if (mesh == description.meshes.end()) {
+            return "expected instance <mesh> with a mesh defined earlier";
+        }
+        Vec3 translate(0, 0, 0), scale(1, 1, 1), rotation(0, 0, 0);
+        Affine matrix;
+        int override_material = -1;
+        for (size_t at = 2; at < tokens.size();) {
+            const string &option = tokens[at];
+            if (option == "material" && at + 1 < tokens.size() && material(tokens[at + 1], override_material)) {
+                at += 2;
+            } else if (option == "translate" && parse_vec3(tokens, at + 1, translate)) {
+                at += 4;
+            } else if (option == "scale" && parse_vec3(tokens, at + 1, scale)) {
+                at += 4;
+            } else if (option == "scale" && parse_float(tokens, at + 1, scale.x)) {
+                scale.y = scale.z = scale.x;
+                at += 2;
+            } else if (option == "rotate" && parse_vec3(tokens, at + 1, rotation)) {
+                at += 4;
+            } else if (option == "matrix" && parse_matrix(tokens, at + 1, matrix)) {
+                at += 13;
+            } else {
+                return "bad instance option " + option;
+            }
+        }
+        // Scaled, then rotated, then through the matrix, then translated: each column is a mapped axis.
+        Vec3 axes[3] = {Vec3(scale.x, 0, 0), Vec3(0, scale.y, 0), Vec3(0, 0, scale.z)};
+        for (Vec3 &axis : axes) {
+            axis = matrix.direction(axis.rotate(rotation));
+        }
+        Affine object_to_world(Mat3(axes[0], axes[1], axes[2]), matrix.translation + translate);
+        if (!object_to_world.invertible()) {
+            return "instance transform is singular";
+        }
+        Instance instance(mesh->second, object_to_world);
+        instance.material = override_material;
+        scene.instances.push_back(instance);
+    } else if (directive == "triangle") {
+        int material_id;
+        Vec3 v[4];
+        if (tokens.size() != 14 || !parse_vec3(tokens, 2, v[0]) || !parse_vec3(tokens, 5, v[1]) ||
+            !parse_vec3(tokens, 8, v[2]) || !parse_vec3(tokens, 11, v[3])) {
+            return "expected triangle <material> <9 vertex coordinates> <3 normal coordinates>";
+        }
+        if (!material(tokens[1], material_id)) {
+            return "unknown material " + tokens[1];
+        }
+        scene.geometry.edit().push_back(Triangle(v[0], v[1], v[2], v[3], material_id));
+    } else if (directive == "light") {
+        Light light;
+        if (tokens.size() != 5 || !parse_vec3(tokens, 1, light.loc) || !parse_float(tokens, 4, light.intensity)) {
+            return "expected light <x> <y> <z> <intensity>";
+        }
+        scene.lights.push_back(light);
+    } else {
+        return "unknown directive " + directive;
+    }
+    return "";
+}
+
+bool read_scene_file(const string &path, SceneDescription &description, string &error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = path + ": could not open";
+        return false;
+    }
+    description.materials["default"] = 0;
+    string line;
+    for (int line_number = 1; std::getline(in, line); line_number++) {
+        std::istringstream words(line.substr(0, line.find('#')));
+        vector<string> tokens;
+        for (string word; words >> word;) {
+            tokens.push_back(word);
+        }
+        if (tokens.empty()) {
+            continue;
+        }
+        string reason = apply_line(tokens, description);
+        if (!reason.empty()) {
+            error = path + ":" + std::to_string(line_number) + ": " + reason;
+            return false;
+        }
+    }
+    return true;
+}
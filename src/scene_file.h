@@ -0,0 +1,48 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+#include "render.h"
+#include <map>
+#include <string>
+using std::map;
+using std::string;
+
+// A scene, camera and image size read from a scene file.
+struct SceneDescription {
+  public:
+    Scene scene;
+    Camera camera;
+    int width = 300;
+    int height = 300;
+    // Material ids by name; "default" is the scene's material 0.
+    map<string, int> materials;
+    // Mesh ids by name.
+    map<string, int> meshes;
+    // Threads and CPUs the mesh builds may use, set by the caller before reading.
+    ParallelLimits build_limits;
+};
+
+/**
+ * Reads a scene file: one directive per line, '#' starts a comment. Paths are relative to the
+ * working directory. Geometry comes from binary STL files, with model_lib.read_stl's axis swap.
+ *
+ *   resolution <width> <height>
+ *   camera <x> <y> <z> [rotation <pitch> <yaw> <roll>] [focal <distance> <width> <height>]
+ *          [exposure <max energy>] [reflections <n>]
+ *   material <name> <scattering> <refraction index>         (an index of inf makes a mirror)
+ *   stl <path> <material> [center] [translate <x> <y> <z>] [flip_y]
+ *   mesh <name> <path> <material> [center] [flip_y] [lod <levels>]
+ *   instance <mesh> [material <name>] [scale <s> | scale <x> <y> <z>] [rotate <pitch> <yaw> <roll>]
+ *            [matrix <3x4 object-to-world matrix, row by row>] [translate <x> <y> <z>]
+ *   triangle <material> <9 vertex coordinates> <3 normal coordinates>
+ *   light <x> <y> <z> <intensity>
+ *
+ * stl adds to the scene's own geometry, as stl_forge does: center moves the vertex mean to the
+ * origin, translate follows, and flip_y negates y last. mesh uploads geometry for instances, as
+ * add_mesh does. An instance's mesh is scaled, rotated like the camera (radians), put through
+ * matrix as add_instance's transform would, and translated last, whatever order the options come
+ * in. Without exposure the camera exposes automatically. Returns false with error set
+ * to "<path>:<line>: <reason>" on the first bad line.
+ **/
+bool read_scene_file(const string &path, SceneDescription &description, string &error);
+
+#endif
@@ -0,0 +1,320 @@
+#include "simplify.h"
+#include "parallel.h"
+#include <array>
+#include <limits>
+#include <queue>
+#include <stdint.h>
+#include <unordered_map>
+using std::array;
+using std::priority_queue;
+using std::unordered_map;
+
+// Open borders get a plane perpendicular to their face, weighted so that they erode last.
+const double BOUNDARY_WEIGHT = 100;
+// Collapses that turn a surviving face by more than this (cosine between old and new normal) are refused.
+const double MIN_NORMAL_COSINE = 0.2;
+
+struct Quadric {
+  public:
+    // Upper triangle of the symmetric 4x4 matrix: aa ab ac ad bb bc bd cc cd dd.
+    double q[10] = {0};
+    void add_plane(double a, double b, double c, double d, double weight) {
+        double plane[4] = {a, b, c, d};
+        int k = 0;
+        for (int i = 0; i < 4; i++) {
+            for (int j = i; j < 4; j++) {
+                q[k++] += weight * plane[i] * plane[j];
+            }
+        }
+    }
+    void operator+=(const Quadric &other) {
+        for (int k = 0; k < 10; k++) {
+            q[k] += other.q[k];
+        }
+    }
+    // Sum of squared distances from p to the accumulated planes.
+    double error(const Vec3 &p) const {
+        double x = p.x, y = p.y, z = p.z;
+        return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x + q[4] * y * y + 2 * q[5] * y * z +
+               2 * q[6] * y + q[7] * z * z + 2 * q[8] * z + q[9];
+    }
+    // Point of least error by Cramer's rule, false when the quadric is close to singular.
+    bool optimum(Vec3 &p) const {
+        double r0 = -q[3], r1 = -q[6], r2 = -q[8];
+        double det = q[0] * (q[4] * q[7] - q[5] * q[5]) - q[1] * (q[1] * q[7] - q[5] * q[2]) +
+                     q[2] * (q[1] * q[5] - q[4] * q[2]);
+        double scale = q[0] + q[4] + q[7];
+        if (fabs(det) <= 1e-9 * scale * scale * scale) {
+            return false;
+        }
+        double x = r0 * (q[4] * q[7] - q[5] * q[5]) - q[1] * (r1 * q[7] - q[5] * r2) + q[2] * (r1 * q[5] - q[4] * r2);
+        double y = q[0] * (r1 * q[7] - q[5] * r2) - r0 * (q[1] * q[7] - q[5] * q[2]) + q[2] * (q[1] * r2 - r1 * q[2]);
+        double z = q[0] * (q[4] * r2 - r1 * q[5]) - q[1] * (q[1] * r2 - r1 * q[2]) + r0 * (q[1] * q[5] - q[4] * q[2]);
+        p = Vec3(x / det, y / det, z / det);
+        return true;
+    }
+};
+
+struct Collapse {
+  public:
+    double cost;
+    int a, b;
+    // Vertex stamps when the cost was computed; any later change to either end makes the entry stale.
+    unsigned stamp_a, stamp_b;
+    Vec3 position;
+    // Reversed so that priority_queue pops the cheapest collapse first.
+    bool operator<(const Collapse &other) const { return cost > other.cost; }
+};
+
+struct Corner {
+  public:
+    float x, y, z;
+    unsigned index;
+    bool operator<(const Corner &other) const {
+        if (x != other.x) {
+            return x < other.x;
+        }
+        if (y != other.y) {
+            return y < other.y;
+        }
+        return z < other.z;
+    }
+};
+
+static uint64_t edge_key(int a, int b) {
+    return a < b ? ((uint64_t)a << 32) | (unsigned)b : ((uint64_t)b << 32) | (unsigned)a;
+}
+
+class Decimator {
+  public:
+    vector<Vec3> positions;
+    vector<Quadric> quadrics;
+    vector<unsigned> stamps;
+    vector<bool> vertex_alive;
+    vector<vector<int>> vertex_faces;
+    vector<array<int, 3>> faces;
+    vector<bool> face_alive;
+    size_t n_live_faces = 0;
+    priority_queue<Collapse> heap;
+    const vector<Triangle> &source;
+
+    Decimator(const vector<Triangle> &geometry, const ParallelLimits &limits) : source(geometry) {
+        weld(limits);
+        accumulate_quadrics();
+        for (const auto &edge : edge_count) {
+            push_edge(edge.first >> 32, edge.first & 0xffffffff);
+        }
+    }
+
+    void push_edge(int a, int b) {
+        Quadric q = quadrics[a];
+        q += quadrics[b];
+        Vec3 midpoint = (positions[a] + positions[b]) / 2;
+        Vec3 candidates[4] = {positions[a], positions[b], midpoint, midpoint};
+        int n_candidates = 3;
+        Vec3 optimum;
+        // The optimum of a nearly flat neighbourhood can lie far away; only trust it near the edge.
+        float reach = (positions[a] - positions[b]).magnitude() * 2;
+        if (q.optimum(optimum) && (optimum - midpoint).magnitude() <= reach) {
+            candidates[n_candidates++] = optimum;
+        }
+        Collapse collapse;
+        collapse.cost = inf_cost;
+        for (int c = 0; c < n_candidates; c++) {
+            double cost = q.error(candidates[c]);
+            if (cost < collapse.cost) {
+                collapse.cost = cost;
+                collapse.position = candidates[c];
+            }
+        }
+        collapse.cost = max(collapse.cost, 0.0);
+        collapse.a = a;
+        collapse.b = b;
+        collapse.stamp_a = stamps[a];
+        collapse.stamp_b = stamps[b];
+        heap.push(collapse);
+    }
+
+    bool flips(int a, int b, const Vec3 &position) const {
+        for (int v : {a, b}) {
+            for (int f : vertex_faces[v]) {
+                if (!face_alive[f]) {
+                    continue;
+                }
+                const array<int, 3> &face = faces[f];
+                bool has_a = face[0] == a || face[1] == a || face[2] == a;
+                bool has_b = face[0] == b || face[1] == b || face[2] == b;
+                if (has_a && has_b) {
+                    continue;
+                }
+                Vec3 p[3], moved[3];
+                for (int k = 0; k < 3; k++) {
+                    p[k] = positions[face[k]];
+                    moved[k] = face[k] == v ? position : p[k];
+                }
+                Vec3 before = (p[1] - p[0]) % (p[2] - p[0]);
+                Vec3 after = (moved[1] - moved[0]) % (moved[2] - moved[0]);
+                float after_length = after.magnitude();
+                float min_dot = MIN_NORMAL_COSINE * before.magnitude() * after_length;
+                if (after_length < EPS * EPS || (before ^ after) < min_dot) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void collapse(const Collapse &c) {
+        int a = c.a, b = c.b;
+        positions[a] = c.position;
+        quadrics[a] += quadrics[b];
+        vertex_alive[b] = false;
+        stamps[a]++;
+        stamps[b]++;
+        for (int f : vertex_faces[b]) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            array<int, 3> &face = faces[f];
+            if (face[0] == a || face[1] == a || face[2] == a) {
+                face_alive[f] = false;
+                n_live_faces--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++) {
+                if (face[k] == b) {
+                    face[k] = a;
+                }
+            }
+            vertex_faces[a].push_back(f);
+        }
+        vertex_faces[b].clear();
+        vector<int> live_faces;
+        vector<int> neighbours;
+        for (int f : vertex_faces[a]) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            live_faces.push_back(f);
+            for (int v : faces[f]) {
+                if (v != a && std::find(neighbours.begin(), neighbours.end(), v) == neighbours.end()) {
+                    neighbours.push_back(v);
+                }
+            }
+        }
+        vertex_faces[a] = live_faces;
+        for (int v : neighbours) {
+            push_edge(a, v);
+        }
+    }
+
+    vector<Triangle> snapshot() const {
+        vector<Triangle> geometry;
+        geometry.reserve(n_live_faces);
+        for (size_t f = 0; f < faces.size(); f++) {
+            if (face_alive[f]) {
+                const Triangle &tri = source[f];
+                geometry.push_back(Triangle(positions[faces[f][0]], positions[faces[f][1]], positions[faces[f][2]],
+                                            tri.normal, tri.material));
+            }
+        }
+        return geometry;
+    }
+
+  private:
+    const double inf_cost = std::numeric_limits<double>::infinity();
+    unordered_map<uint64_t, int> edge_count;
+
+    void weld(const ParallelLimits &limits) {
+        vector<Corner> corners(source.size() * 3);
+        for (size_t t = 0; t < source.size(); t++) {
+            const Vec3 *v[3] = {&source[t].v0, &source[t].v1, &source[t].v2};
+            for (int k = 0; k < 3; k++) {
+                corners[3 * t + k] = Corner{v[k]->x, v[k]->y, v[k]->z, (unsigned)(3 * t + k)};
+            }
+        }
+        parallel_sort(limits, corners);
+        vector<int> vertex_of(corners.size());
+        for (size_t c = 0; c < corners.size(); c++) {
+            if (c == 0 || corners[c - 1] < corners[c]) {
+                positions.push_back(Vec3(corners[c].x, corners[c].y, corners[c].z));
+            }
+            vertex_of[corners[c].index] = positions.size() - 1;
+        }
+        quadrics.resize(positions.size());
+        stamps.resize(positions.size());
+        vertex_alive.assign(positions.size(), true);
+        vertex_faces.resize(positions.size());
+        faces.resize(source.size());
+        face_alive.assign(source.size(), false);
+        for (size_t t = 0; t < source.size(); t++) {
+            faces[t] = {vertex_of[3 * t], vertex_of[3 * t + 1], vertex_of[3 * t + 2]};
+            const array<int, 3> &face = faces[t];
+            if (face[0] == face[1] || face[1] == face[2] || face[2] == face[0]) {
+                continue;
+            }
+            face_alive[t] = true;
+            n_live_faces++;
+            for (int k = 0; k < 3; k++) {
+                vertex_faces[face[k]].push_back(t);
+                edge_count[edge_key(face[k], face[(k + 1) % 3])]++;
+            }
+        }
+    }
+
+    void accumulate_quadrics() {
+        for (size_t f = 0; f < faces.size(); f++) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            const array<int, 3> &face = faces[f];
+            Vec3 normal = (positions[face[1]] - positions[face[0]]) % (positions[face[2]] - positions[face[0]]);
+            if (normal.magnitude() < EPS * EPS) {
+                continue;
+            }
+            normal = normal.normalize();
+            Quadric plane;
+            plane.add_plane(normal.x, normal.y, normal.z, -(normal ^ positions[face[0]]), 1);
+            for (int k = 0; k < 3; k++) {
+                quadrics[face[k]] += plane;
+                int a = face[k], b = face[(k + 1) % 3];
+                if (edge_count[edge_key(a, b)] != 1) {
+                    continue;
+                }
+                Vec3 border = ((positions[b] - positions[a]) % normal).normalize();
+                Quadric constraint;
+                constraint.add_plane(border.x, border.y, border.z, -(border ^ positions[a]), BOUNDARY_WEIGHT);
+                quadrics[a] += constraint;
+                quadrics[b] += constraint;
+            }
+        }
+    }
+};
+
+vector<vector<Triangle>> simplify_levels(const vector<Triangle> &geometry, const vector<size_t> &targets,
+                                         vector<float> &errors, const ParallelLimits &limits) {
+    vector<vector<Triangle>> levels;
+    Decimator decimator(geometry, limits);
+    double max_cost = 0;
+    size_t next = 0;
+    while (next < targets.size()) {
+        if (decimator.n_live_faces <= targets[next]) {
+            levels.push_back(decimator.snapshot());
+            errors.push_back(sqrt(max_cost));
+            next++;
+            continue;
+        }
+        if (decimator.heap.empty()) {
+            break;
+        }
+        Collapse c = decimator.heap.top();
+        decimator.heap.pop();
+        if (!decimator.vertex_alive[c.a] || !decimator.vertex_alive[c.b] || decimator.stamps[c.a] != c.stamp_a ||
+            decimator.stamps[c.b] != c.stamp_b || decimator.flips(c.a, c.b, c.position)) {
+            continue;
+        }
+        max_cost = max(max_cost, c.cost);
+        decimator.collapse(c);
+    }
+    return levels;
+}
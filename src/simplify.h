@@ -0,0 +1,19 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+#include "render.h"
+#include <vector>
+using std::vector;
+
+/**
+ * Quadric-error edge-collapse decimation (Garland & Heckbert). Corners at identical positions are
+ * welded first, so triangle soups from STL files simplify like indexed meshes. Collapses run from
+ * cheapest to most expensive; each time the surviving face count reaches the next entry of
+ * targets (largest first), the current mesh is emitted as one level and the square root of the
+ * largest quadric error accepted so far is appended to errors, a bound on how far that level
+ * strays from the input's planes. Faces keep their source triangle's winding and material id.
+ * Fewer levels than targets come back once nothing more can be collapsed.
+ **/
+vector<vector<Triangle>> simplify_levels(const vector<Triangle> &geometry, const vector<size_t> &targets,
+                                         vector<float> &errors, const ParallelLimits &limits);
+
+#endif
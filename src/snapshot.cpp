@@ -0,0 +1,72 @@
+#include "snapshot.h"
+
+SceneSnapshot::SceneSnapshot(uint64_t version, const Scene &scene, const SceneSnapshot *previous)
+    : version(version), scene(scene) {
+    if (previous == nullptr) {
+        return;
+    }
+    // The previous version keeps its triangles alive, so the same address means the same array.
+    std::lock_guard<mutex> guard(previous->build_lock);
+    if (previous->shared_octree != nullptr && previous->scene.geometry.data() == this->scene.geometry.data() &&
+        previous->scene.geometry.size() == this->scene.geometry.size()) {
+        shared_octree = previous->shared_octree;
+        octree_cache_dir = previous->octree_cache_dir;
+        octree_depth = previous->octree_depth;
+    }
+}
+
+shared_ptr<const Octree> SceneSnapshot::octree(const RenderOptions &options) const {
+    {
+        std::lock_guard<mutex> guard(build_lock);
+        if (shared_octree == nullptr) {
+            TraceSpan build_span("octree build");
+            shared_octree = std::make_shared<const Octree>(scene, options.octree_cache_dir, options.octree_depth,
+                                                           options.parallel_limits());
+            octree_cache_dir = options.octree_cache_dir;
+            octree_depth = options.octree_depth;
+        }
+        if (options.octree_cache_dir == octree_cache_dir && options.octree_depth == octree_depth) {
+            return shared_octree;
+        }
+    }
+    TraceSpan build_span("octree build");
+    return std::make_shared<const Octree>(scene, options.octree_cache_dir, options.octree_depth,
+                                          options.parallel_limits());
+}
+
+shared_ptr<const InstanceTree> SceneSnapshot::instance_tree() const {
+    std::lock_guard<mutex> guard(build_lock);
+    if (instances == nullptr) {
+        instances = std::make_shared<const InstanceTree>(scene);
+    }
+    return instances;
+}
+
+void SceneVersions::edit(const std::function<void(Scene &)> &change) {
+    std::lock_guard<mutex> guard(lock);
+    change(working);
+    edited = true;
+}
+
+shared_ptr<const SceneSnapshot> SceneVersions::snapshot() {
+    std::lock_guard<mutex> guard(lock);
+    if (edited || latest == nullptr) {
+        uint64_t next = latest == nullptr ? 1 : latest->version + 1;
+        latest = std::make_shared<const SceneSnapshot>(next, working, latest.get());
+        edited = false;
+    }
+    return latest;
+}
+
+uint64_t SceneVersions::version() const {
+    std::lock_guard<mutex> guard(lock);
+    return latest == nullptr ? 0 : latest->version;
+}
+
+void render(Canvas &canvas, const SceneSnapshot &snapshot, const Camera &camera, const RenderOptions &options,
+            RenderStats *stats) {
+    auto build_start = std::chrono::steady_clock::now();
+    shared_ptr<const Octree> octo = snapshot.octree(options);
+    shared_ptr<const InstanceTree> instances = snapshot.instance_tree();
+    render(canvas, snapshot.scene, *octo, *instances, camera, options, stats, seconds_since(build_start));
+}
@@ -0,0 +1,66 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include "render.h"
+#include "octree.h"
+#include "instance.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+using std::mutex;
+using std::shared_ptr;
+
+/**
+ * One immutable version of a scene, with the octree and instance tree built for it. Renders hold
+ * a snapshot by shared_ptr for as long as they trace it, so the version, and the triangles its
+ * octree points into, are freed only when the last render of it finishes. The trees are built by
+ * the first render that asks for them and reused by every later one; the octree is the one for
+ * the first asker's octree_depth and octree_cache_dir, and renders with other settings get a
+ * private octree instead.
+ **/
+class SceneSnapshot {
+  public:
+    const uint64_t version;
+    const Scene scene;
+    // previous, when given, lends its octree if it was built over the same shared triangles.
+    SceneSnapshot(uint64_t version, const Scene &scene, const SceneSnapshot *previous = nullptr);
+    SceneSnapshot(const SceneSnapshot &other) = delete;
+    shared_ptr<const Octree> octree(const RenderOptions &options) const;
+    shared_ptr<const InstanceTree> instance_tree() const;
+
+  private:
+    mutable mutex build_lock;
+    mutable shared_ptr<const Octree> shared_octree;
+    mutable string octree_cache_dir;
+    mutable int octree_depth = 0;
+    mutable shared_ptr<const InstanceTree> instances;
+};
+
+/**
+ * An edited scene and its published versions. Edits go to a working copy; snapshot() publishes
+ * the working copy as the next version if anything was edited since the last one, and returns
+ * the latest version either way. Publishing copies the scene, which shares its triangles with the
+ * working copy until the next edit of the geometry; a version whose triangles are unchanged keeps
+ * the previous version's octree. Both calls may come from any thread.
+ **/
+class SceneVersions {
+  public:
+    SceneVersions() = default;
+    SceneVersions(const SceneVersions &other) = delete;
+    void edit(const std::function<void(Scene &)> &change);
+    shared_ptr<const SceneSnapshot> snapshot();
+    // Number of the latest published version, 0 before the first.
+    uint64_t version() const;
+
+  private:
+    mutable mutex lock;
+    Scene working;
+    bool edited = true;
+    shared_ptr<const SceneSnapshot> latest;
+};
+
+// render() of a snapshot, with its shared trees.
+void render(Canvas &canvas, const SceneSnapshot &snapshot, const Camera &camera,
+            const RenderOptions &options = RenderOptions(), RenderStats *stats = nullptr);
+
+#endif
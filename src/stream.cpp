@@ -0,0 +1,486 @@
+#include "stream.h"
+#include "parallel.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char CLUSTER_FILE_MAGIC[8] = "TPCLUST";
+const uint32_t CLUSTER_FILE_VERSION = 2;
+const size_t CLUSTER_TRIANGLES = 4096;
+const size_t CLUSTER_PAGE_BYTES = 4096;
+// Read-ahead hints cover runs of needed clusters up to this size, bridging gaps of one cluster.
+const size_t PREFETCH_BYTES = 32 << 20;
+const size_t STREAM_BLOCK_RAYS = 1024;
+const size_t STL_HEADER_BYTES = 84;
+const size_t STL_RECORD_BYTES = 50;
+const float stream_inf = std::numeric_limits<float>::infinity();
+
+/**
+ * Header of a cluster file. The records follow at records_offset; each cluster's triangles start
+ * on a page boundary at its record's offset.
+ **/
+struct ClusterFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t n_triangles;
+    uint64_t n_clusters;
+    uint64_t records_offset;
+};
+
+struct ClusterRecord {
+    uint64_t offset;
+    uint32_t n_triangles;
+    uint32_t padding;
+    float min_xyz[3];
+    float max_xyz[3];
+};
+
+// Geometry only: streamed meshes are queried, never shaded, so there is no material to keep.
+struct PackedTriangle {
+    float v[9];
+    uint32_t source;
+};
+
+// A ray waiting for a cluster that was not resident when the batch started.
+struct Deferral {
+    unsigned ray;
+    unsigned cluster;
+    float entry;
+};
+
+static size_t round_to_page(size_t bytes) {
+    return (bytes + CLUSTER_PAGE_BYTES - 1) / CLUSTER_PAGE_BYTES * CLUSTER_PAGE_BYTES;
+}
+
+static const char *map_file(const string &path, size_t &bytes) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void *memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    bytes = info.st_size;
+    return (const char *)memory;
+}
+
+// Vertex k of STL triangle t, with read_stl's (x, y, z) -> (x, -z, y) swap and the optional y flip.
+static Vec3 stl_vertex(const char *stl, size_t t, int k, bool flip_y) {
+    float xyz[3];
+    memcpy(xyz, stl + STL_HEADER_BYTES + t * STL_RECORD_BYTES + 12 * (k + 1), sizeof(xyz));
+    return Vec3(xyz[0], flip_y ? xyz[2] : -xyz[2], xyz[1]);
+}
+
+static BoundingBox record_bounds(const ClusterRecord &record) {
+    BoundingBox box;
+    box.min_xyz = Vec3(record.min_xyz[0], record.min_xyz[1], record.min_xyz[2]);
+    box.max_xyz = Vec3(record.max_xyz[0], record.max_xyz[1], record.max_xyz[2]);
+    return box;
+}
+
+// Written to a temporary file and renamed into place, like the octree cache.
+bool write_cluster_file(const string &stl_path, const string &path, bool flip_y, const ParallelLimits &limits) {
+    size_t stl_bytes = 0;
+    const char *stl = map_file(stl_path, stl_bytes);
+    if (stl == nullptr) {
+        return false;
+    }
+    uint32_t n = 0;
+    if (stl_bytes >= STL_HEADER_BYTES) {
+        memcpy(&n, stl + 80, sizeof(n));
+    }
+    if (n == 0 || stl_bytes < STL_HEADER_BYTES + (size_t)n * STL_RECORD_BYTES) {
+        munmap((void *)stl, stl_bytes);
+        return false;
+    }
+    madvise((void *)stl, stl_bytes, MADV_SEQUENTIAL);
+    auto centroid = [&](size_t t) {
+        return (stl_vertex(stl, t, 0, flip_y) + stl_vertex(stl, t, 1, flip_y) + stl_vertex(stl, t, 2, flip_y)) / 3;
+    };
+    BoundingBox centroids;
+    centroids.min_xyz = centroid(0);
+    centroids.max_xyz = centroids.min_xyz;
+    for (size_t t = 1; t < n; t++) {
+        BoundingBox point;
+        point.min_xyz = centroid(t);
+        point.max_xyz = point.min_xyz;
+        centroids.extend(point);
+    }
+    vector<uint64_t> keys(n);
+    parallel_for(limits, n, [&](size_t t) { keys[t] = ((uint64_t)morton_code_30(centroid(t), centroids) << 32) | t; });
+    parallel_sort(limits, keys);
+    // Clusters gather triangles from all over the STL from here on.
+    madvise((void *)stl, stl_bytes, MADV_RANDOM);
+
+    ClusterFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CLUSTER_FILE_MAGIC, sizeof(header.magic));
+    header.version = CLUSTER_FILE_VERSION;
+    header.record_size = sizeof(ClusterRecord);
+    header.n_triangles = n;
+    header.n_clusters = (n + CLUSTER_TRIANGLES - 1) / CLUSTER_TRIANGLES;
+    header.records_offset = 64;
+    vector<ClusterRecord> records(header.n_clusters);
+    size_t offset = round_to_page(header.records_offset + header.n_clusters * sizeof(ClusterRecord));
+    string tmp_path;
+    FILE *out = create_temp_file(path, tmp_path);
+    if (out == nullptr) {
+        munmap((void *)stl, stl_bytes);
+        return false;
+    }
+    vector<PackedTriangle> packed;
+    vector<char> padding(CLUSTER_PAGE_BYTES, 0);
+    bool ok = fseek(out, offset, SEEK_SET) == 0;
+    for (size_t c = 0; c < header.n_clusters && ok; c++) {
+        size_t first = c * CLUSTER_TRIANGLES;
+        size_t count = min(CLUSTER_TRIANGLES, (size_t)n - first);
+        packed.resize(count);
+        ClusterRecord &record = records[c];
+        memset(&record, 0, sizeof(record));
+        record.offset = offset;
+        record.n_triangles = count;
+        for (size_t k = 0; k < count; k++) {
+            uint32_t t = (uint32_t)keys[first + k];
+            PackedTriangle &tri = packed[k];
+            for (int v = 0; v < 3; v++) {
+                Vec3 vertex = stl_vertex(stl, t, v, flip_y);
+                float xyz[3] = {vertex.x, vertex.y, vertex.z};
+                for (int axis = 0; axis < 3; axis++) {
+                    tri.v[3 * v + axis] = xyz[axis];
+                    bool first_vertex = k == 0 && v == 0;
+                    record.min_xyz[axis] = first_vertex ? xyz[axis] : min(record.min_xyz[axis], xyz[axis]);
+                    record.max_xyz[axis] = first_vertex ? xyz[axis] : max(record.max_xyz[axis], xyz[axis]);
+                }
+            }
+            tri.source = t;
+        }
+        size_t bytes = count * sizeof(PackedTriangle);
+        ok = fwrite(packed.data(), sizeof(PackedTriangle), count, out) == count;
+        size_t padding_bytes = round_to_page(bytes) - bytes;
+        ok = ok && (padding_bytes == 0 || fwrite(padding.data(), padding_bytes, 1, out) == 1);
+        offset += round_to_page(bytes);
+    }
+    munmap((void *)stl, stl_bytes);
+    ok = ok && fseek(out, 0, SEEK_SET) == 0;
+    ok = ok && fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(padding.data(), header.records_offset - sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(records.data(), sizeof(ClusterRecord), records.size(), out) == records.size();
+    ok = (fclose(out) == 0) && ok;
+    ok = ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        unlink(tmp_path.c_str());
+    }
+    return ok;
+}
+
+ResidentCluster::ResidentCluster(const ClusterRecord &record, const char *mapping, const ParallelLimits &limits) {
+    const PackedTriangle *packed = (const PackedTriangle *)(mapping + record.offset);
+    geometry.reserve(record.n_triangles);
+    sources.reserve(record.n_triangles);
+    for (size_t k = 0; k < record.n_triangles; k++) {
+        const PackedTriangle &tri = packed[k];
+        geometry.push_back(Triangle(Vec3(tri.v[0], tri.v[1], tri.v[2]), Vec3(tri.v[3], tri.v[4], tri.v[5]),
+                                    Vec3(tri.v[6], tri.v[7], tri.v[8])));
+        sources.push_back(tri.source);
+    }
+    bvh = new CompressedBvh(geometry, limits);
+    bytes = sizeof(*this) + geometry.size() * (sizeof(Triangle) + sizeof(unsigned)) + bvh->memory_bytes();
+}
+
+ResidentCluster::~ResidentCluster() { delete bvh; }
+
+// Any mismatch in the header or size leaves the geometry unmapped, like a stale octree cache.
+StreamedGeometry::StreamedGeometry(const string &path, size_t cache_bytes, const ParallelLimits &thread_limits)
+    : cache_bytes(cache_bytes), thread_limits(thread_limits) {
+    size_t bytes = 0;
+    const char *memory = map_file(path, bytes);
+    if (memory == nullptr) {
+        return;
+    }
+    const ClusterFileHeader *header = (const ClusterFileHeader *)memory;
+    bool ok = bytes >= sizeof(ClusterFileHeader) &&
+              memcmp(header->magic, CLUSTER_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == CLUSTER_FILE_VERSION && header->record_size == sizeof(ClusterRecord) &&
+              header->n_clusters > 0 && header->records_offset + header->n_clusters * sizeof(ClusterRecord) <= bytes;
+    const ClusterRecord *file_records = (const ClusterRecord *)(memory + (ok ? header->records_offset : 0));
+    size_t triangles = 0;
+    for (size_t c = 0; ok && c < header->n_clusters; c++) {
+        const ClusterRecord &record = file_records[c];
+        ok = record.offset % CLUSTER_PAGE_BYTES == 0 &&
+             record.offset + record.n_triangles * sizeof(PackedTriangle) <= bytes;
+        triangles += record.n_triangles;
+    }
+    if (!ok || triangles != header->n_triangles) {
+        munmap((void *)memory, bytes);
+        return;
+    }
+    mapping = memory;
+    mapping_bytes = bytes;
+    records = file_records;
+    n_clusters = header->n_clusters;
+    n_triangles = header->n_triangles;
+    // Cluster pages are read when and as far ahead as the hints below say, not by fault-driven read-ahead.
+    madvise((void *)mapping, mapping_bytes, MADV_RANDOM);
+    resident.assign(n_clusters, nullptr);
+    build_nodes(0, n_clusters);
+}
+
+StreamedGeometry::~StreamedGeometry() {
+    for (ResidentCluster *cluster : resident) {
+        delete cluster;
+    }
+    if (mapping != nullptr) {
+        munmap((void *)mapping, mapping_bytes);
+    }
+}
+
+// Clusters are already in Morton order, so halving the range keeps neighbours together.
+int StreamedGeometry::build_nodes(int first, int count) {
+    int index = nodes.size();
+    nodes.push_back(ClusterNode());
+    if (count == 1) {
+        nodes[index].bounds = record_bounds(records[first]);
+        nodes[index].cluster = first;
+        return index;
+    }
+    int left = build_nodes(first, count / 2);
+    int right = build_nodes(first + count / 2, count - count / 2);
+    BoundingBox bounds = nodes[left].bounds;
+    bounds.extend(nodes[right].bounds);
+    nodes[index].bounds = bounds;
+    nodes[index].left = left;
+    nodes[index].right = right;
+    return index;
+}
+
+// Calls visit(cluster, entry) for every cluster whose bounds the ray reaches before t_max.
+template <typename F>
+void StreamedGeometry::traverse(const Vec3 &origin, const Vec3 &ray, float t_max, F visit) const {
+    Vec3 inv_ray = 1.f / ray;
+    int stack[64];
+    int depth = 0;
+    stack[depth++] = 0;
+    while (depth > 0) {
+        const ClusterNode &node = nodes[stack[--depth]];
+        float entry;
+        if (!node.bounds.hit_by(origin, inv_ray, t_max, &entry)) {
+            continue;
+        }
+        if (node.left == -1) {
+            visit(node.cluster, entry);
+        } else if (depth + 2 <= 64) {
+            stack[depth++] = node.right;
+            stack[depth++] = node.left;
+        }
+    }
+}
+
+/**
+ * Makes needed[next_needed] resident. When it lies past the last read-ahead hint, a new hint
+ * covers it and the following needed clusters, so neighbouring clusters arrive in one long read.
+ * Once copied out, a cluster's pages are dropped from the mapping again.
+ **/
+const ResidentCluster &StreamedGeometry::page_in(unsigned cluster, size_t &prefetched_until,
+                                                 const vector<unsigned> &needed, size_t next_needed) {
+    if (resident[cluster] != nullptr) {
+        lru.splice(lru.begin(), lru, resident[cluster]->lru);
+        return *resident[cluster];
+    }
+    const ClusterRecord &record = records[cluster];
+    size_t record_bytes = record.n_triangles * sizeof(PackedTriangle);
+    if (record.offset + record_bytes > prefetched_until) {
+        size_t end = record.offset + record_bytes;
+        for (size_t k = next_needed + 1; k < needed.size(); k++) {
+            const ClusterRecord &next = records[needed[k]];
+            size_t next_end = next.offset + next.n_triangles * sizeof(PackedTriangle);
+            if (next.offset > end + CLUSTER_TRIANGLES * sizeof(PackedTriangle) + CLUSTER_PAGE_BYTES ||
+                next_end - record.offset > PREFETCH_BYTES) {
+                break;
+            }
+            if (resident[needed[k]] == nullptr) {
+                end = next_end;
+            }
+        }
+        madvise((void *)(mapping + record.offset), end - record.offset, MADV_WILLNEED);
+        prefetched_until = end;
+    }
+    ResidentCluster *loaded = new ResidentCluster(record, mapping, thread_limits);
+    madvise((void *)(mapping + record.offset), record_bytes, MADV_DONTNEED);
+    stats.cluster_loads++;
+    stats.bytes_paged_in += record_bytes;
+    while (!lru.empty() && stats.resident_bytes + loaded->bytes > cache_bytes) {
+        unsigned victim = lru.back();
+        lru.pop_back();
+        stats.resident_bytes -= resident[victim]->bytes;
+        delete resident[victim];
+        resident[victim] = nullptr;
+        stats.cluster_evictions++;
+    }
+    lru.push_front(cluster);
+    loaded->lru = lru.begin();
+    resident[cluster] = loaded;
+    stats.resident_bytes += loaded->bytes;
+    stats.peak_resident_bytes = max(stats.peak_resident_bytes, stats.resident_bytes);
+    return *loaded;
+}
+
+/**
+ * Runs a batch in two passes. The first traces every ray against the clusters already resident,
+ * nearest first, and defers the clusters that are not. The second walks the deferred clusters in
+ * file order, paging each in once and testing all of its waiting rays in parallel; rays whose hit
+ * so far lies before a cluster's entry distance are skipped.
+ **/
+template <bool ANY_HIT>
+void StreamedGeometry::trace(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                             vector<RaycastResult> &hits) {
+    std::lock_guard<mutex> lock(batch_mutex);
+    hits.assign(n_rays, RaycastResult(false));
+    if (mapping == nullptr) {
+        return;
+    }
+    vector<float> limits(n_rays);
+    vector<Deferral> deferred;
+    vector<unsigned> used;
+    mutex merge_mutex;
+    auto test = [&](const ResidentCluster &cluster, size_t r, RenderStats &stats) {
+        Vec3 origin(origins[3 * r], origins[3 * r + 1], origins[3 * r + 2]);
+        Vec3 ray(directions[3 * r], directions[3 * r + 1], directions[3 * r + 2]);
+        if (ANY_HIT) {
+            hits[r].hit = any_intersect_bvh(*cluster.bvh, origin, ray, limits[r], stats);
+            return;
+        }
+        RaycastResult res = intersect_bvh(*cluster.bvh, origin, ray, limits[r], stats);
+        if (res.hit && res.distance < limits[r]) {
+            hits[r] = res;
+            hits[r].primitive = cluster.sources[res.primitive];
+            limits[r] = res.distance;
+        }
+    };
+    {
+        TraceSpan span("resident clusters", n_rays);
+        parallel_for_blocks(thread_limits, n_rays, STREAM_BLOCK_RAYS, [&](size_t begin, size_t end) {
+            RenderStats stats;
+            vector<Deferral> block_deferred;
+            vector<unsigned> block_used;
+            vector<std::pair<float, unsigned>> candidates;
+            long block_deferred_rays = 0;
+            for (size_t r = begin; r < end; r++) {
+                Vec3 origin(origins[3 * r], origins[3 * r + 1], origins[3 * r + 2]);
+                Vec3 ray(directions[3 * r], directions[3 * r + 1], directions[3 * r + 2]);
+                limits[r] = t_max == nullptr ? stream_inf : t_max[r];
+                candidates.clear();
+                traverse(origin, ray, limits[r],
+                         [&](unsigned cluster, float entry) { candidates.push_back({entry, cluster}); });
+                std::sort(candidates.begin(), candidates.end());
+                bool was_deferred = false;
+                for (const auto &candidate : candidates) {
+                    if (candidate.first > limits[r] || (ANY_HIT && hits[r].hit)) {
+                        break;
+                    }
+                    const ResidentCluster *cluster = resident[candidate.second];
+                    if (cluster == nullptr) {
+                        block_deferred.push_back({(unsigned)r, candidate.second, candidate.first});
+                        was_deferred = true;
+                        continue;
+                    }
+                    block_used.push_back(candidate.second);
+                    test(*cluster, r, stats);
+                }
+                block_deferred_rays += was_deferred;
+            }
+            std::lock_guard<mutex> merge_lock(merge_mutex);
+            deferred.insert(deferred.end(), block_deferred.begin(), block_deferred.end());
+            used.insert(used.end(), block_used.begin(), block_used.end());
+            this->stats.deferred_rays += block_deferred_rays;
+        });
+    }
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    for (unsigned cluster : used) {
+        lru.splice(lru.begin(), lru, resident[cluster]->lru);
+    }
+    if (deferred.empty()) {
+        return;
+    }
+    TraceSpan span("deferred clusters", deferred.size());
+    std::sort(deferred.begin(), deferred.end(), [](const Deferral &a, const Deferral &b) {
+        return a.cluster != b.cluster ? a.cluster < b.cluster : a.ray < b.ray;
+    });
+    vector<unsigned> needed;
+    vector<size_t> group_begin;
+    for (size_t d = 0; d < deferred.size(); d++) {
+        if (d == 0 || deferred[d].cluster != deferred[d - 1].cluster) {
+            needed.push_back(deferred[d].cluster);
+            group_begin.push_back(d);
+        }
+    }
+    group_begin.push_back(deferred.size());
+    size_t prefetched_until = 0;
+    for (size_t g = 0; g < needed.size(); g++) {
+        bool waiting = false;
+        for (size_t d = group_begin[g]; d < group_begin[g + 1] && !waiting; d++) {
+            waiting = !(ANY_HIT && hits[deferred[d].ray].hit) && deferred[d].entry <= limits[deferred[d].ray];
+        }
+        if (!waiting) {
+            continue;
+        }
+        const ResidentCluster &cluster = page_in(needed[g], prefetched_until, needed, g);
+        size_t group_rays = group_begin[g + 1] - group_begin[g];
+        parallel_for_blocks(thread_limits, group_rays, STREAM_BLOCK_RAYS, [&](size_t begin, size_t end) {
+            RenderStats stats;
+            for (size_t d = group_begin[g] + begin; d < group_begin[g] + end; d++) {
+                const Deferral &deferral = deferred[d];
+                if ((ANY_HIT && hits[deferral.ray].hit) || deferral.entry > limits[deferral.ray]) {
+                    continue;
+                }
+                test(cluster, deferral.ray, stats);
+            }
+        });
+    }
+}
+
+void StreamedGeometry::intersect(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                                 float *distances, int *primitives, int *instance_ids, float *barycentrics) {
+    TraceSpan span("intersect streamed rays", n_rays);
+    vector<RaycastResult> hits;
+    trace<false>(n_rays, origins, directions, t_max, hits);
+    for (size_t r = 0; r < n_rays; r++) {
+        const RaycastResult &hit = hits[r];
+        if (distances != nullptr) {
+            distances[r] = hit.hit ? hit.distance : stream_inf;
+        }
+        if (primitives != nullptr) {
+            primitives[r] = hit.hit ? hit.primitive : -1;
+        }
+        if (instance_ids != nullptr) {
+            instance_ids[r] = -1;
+        }
+        if (barycentrics != nullptr) {
+            barycentrics[2 * r] = hit.hit ? hit.u : 0;
+            barycentrics[2 * r + 1] = hit.hit ? hit.v : 0;
+        }
+    }
+}
+
+void StreamedGeometry::occluded(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                                uint8_t *mask) {
+    TraceSpan span("occluded streamed rays", n_rays);
+    vector<RaycastResult> hits;
+    trace<true>(n_rays, origins, directions, t_max, hits);
+    for (size_t r = 0; r < n_rays; r++) {
+        if (r % 8 == 0) {
+            mask[r / 8] = 0;
+        }
+        mask[r / 8] |= hits[r].hit << (r % 8);
+    }
+}
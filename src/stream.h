@@ -0,0 +1,109 @@
+#ifndef STREAM_H
+#define STREAM_H
+#include "render.h"
+#include "octree.h"
+#include "bvh.h"
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+using std::list;
+using std::mutex;
+using std::string;
+using std::vector;
+
+struct ClusterRecord;
+
+/**
+ * Converts a binary STL file into a cluster file for StreamedGeometry without holding its
+ * triangles in memory: the STL is mapped, its triangles sorted by the Morton code of their
+ * centroids (8 bytes each) and written out in runs of CLUSTER_TRIANGLES, each starting on a page.
+ * Vertices get the same axis swap as model_lib.read_stl, then flip_y. The sort runs within limits.
+ * Returns false on I/O errors or a malformed STL.
+ **/
+bool write_cluster_file(const string &stl_path, const string &path, bool flip_y,
+                        const ParallelLimits &limits = ParallelLimits());
+
+/**
+ * Copy-out of one cluster while it is paged in, with a compressed BVH over its triangles. sources
+ * holds each triangle's index in the STL.
+ **/
+struct ResidentCluster {
+  public:
+    vector<Triangle> geometry;
+    vector<unsigned> sources;
+    CompressedBvh *bvh = nullptr;
+    size_t bytes = 0;
+    list<unsigned>::iterator lru;
+    ResidentCluster(const ClusterRecord &record, const char *mapping, const ParallelLimits &limits);
+    ResidentCluster(const ResidentCluster &other) = delete;
+    ~ResidentCluster();
+};
+
+struct ClusterNode {
+  public:
+    BoundingBox bounds;
+    // Inner nodes: child indices. Leaves have left == -1 and hold a single cluster.
+    int left = -1;
+    int right = -1;
+    int cluster = 0;
+};
+
+struct StreamStats {
+  public:
+    long cluster_loads = 0;
+    long cluster_evictions = 0;
+    long deferred_rays = 0;
+    long bytes_paged_in = 0;
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+};
+
+/**
+ * Ray queries against a mesh too large for memory. The cluster file is mapped read-only; only the
+ * cluster records and a binary tree over their bounds stay resident, and clusters are copied out
+ * and given a BVH when a ray first needs them, up to cache_bytes, evicting the least recently used.
+ * A batch first traces every ray through the clusters already resident, deferring the rest; the
+ * deferred rays are then grouped by cluster and the clusters loaded once each in file order, with
+ * read-ahead hinted over runs of neighbouring clusters so the disk sees a few long reads. Primitive
+ * ids are triangle indices in the source STL. One batch runs at a time, on the threads thread_limits
+ * allows.
+ **/
+class StreamedGeometry {
+  public:
+    size_t cache_bytes;
+    ParallelLimits thread_limits;
+    const char *mapping = nullptr;
+    size_t mapping_bytes = 0;
+    const ClusterRecord *records = nullptr;
+    size_t n_clusters = 0;
+    size_t n_triangles = 0;
+    vector<ClusterNode> nodes;
+    vector<ResidentCluster *> resident;
+    // Most recently used first.
+    list<unsigned> lru;
+    StreamStats stats;
+    // Leaves mapping null when the file is missing or not a cluster file.
+    StreamedGeometry(const string &path, size_t cache_bytes, const ParallelLimits &thread_limits = ParallelLimits());
+    StreamedGeometry(const StreamedGeometry &other) = delete;
+    ~StreamedGeometry();
+    // Same contract as RayQuery::intersect; instance_ids are always -1.
+    void intersect(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                   float *distances, int *primitives, int *instance_ids, float *barycentrics);
+    void occluded(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+                  uint8_t *mask);
+
+  private:
+    mutex batch_mutex;
+    int build_nodes(int first, int count);
+    template <typename F>
+    void traverse(const Vec3 &origin, const Vec3 &ray, float t_max, F visit) const;
+    const ResidentCluster &page_in(unsigned cluster, size_t &prefetched_until, const vector<unsigned> &needed,
+                                   size_t next_needed);
+    template <bool ANY_HIT>
+    void trace(size_t n_rays, const float *origins, const float *directions, const float *t_max,
+               vector<RaycastResult> &hits);
+};
+
+#endif
@@ -0,0 +1,261 @@
+#include "strips.h"
+#include "octree.h"
+#include "instance.h"
+#include <atomic>
+#include <unistd.h>
+using std::atomic;
+
+const float inf = std::numeric_limits<float>::infinity();
+const uint8_t PNG_SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+// Largest stored deflate block.
+const size_t STORED_BLOCK_BYTES = 65535;
+const uint32_t ADLER_MODULO = 65521;
+// Bytes Adler-32 can sum before its 32-bit accumulators need reducing.
+const size_t ADLER_RUN = 5552;
+
+static uint32_t crc32(const uint8_t *bytes, size_t n, uint32_t crc = 0) {
+    static const vector<uint32_t> table = []() {
+        vector<uint32_t> entries(256);
+        for (uint32_t k = 0; k < 256; k++) {
+            uint32_t c = k;
+            for (int bit = 0; bit < 8; bit++) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            entries[k] = c;
+        }
+        return entries;
+    }();
+    crc = ~crc;
+    for (size_t k = 0; k < n; k++) {
+        crc = table[(crc ^ bytes[k]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void put_u32(vector<uint8_t> &bytes, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        bytes.push_back(value >> shift);
+    }
+}
+
+StripWriter::StripWriter(const string &path, int format, int width, int height)
+    : format(format), width(width), height(height) {
+    out = fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+        return;
+    }
+    if (format == IMAGE_FORMAT_PFM) {
+        failed = fprintf(out, "Pf\n%d %d\n-1.0\n", width, height) < 0;
+        data_offset = ftell(out);
+        return;
+    }
+    vector<uint8_t> header;
+    put_u32(header, width);
+    put_u32(header, height);
+    // 8-bit greyscale, deflate, adaptive filtering, no interlace.
+    header.insert(header.end(), {8, 0, 0, 0, 0});
+    failed = fwrite(PNG_SIGNATURE, sizeof(PNG_SIGNATURE), 1, out) != 1;
+    write_chunk("IHDR", header);
+}
+
+StripWriter::~StripWriter() {
+    if (out != nullptr) {
+        fclose(out);
+    }
+}
+
+void StripWriter::write_chunk(const char type[4], const vector<uint8_t> &data) {
+    vector<uint8_t> framing;
+    put_u32(framing, data.size());
+    framing.insert(framing.end(), type, type + 4);
+    uint32_t crc = crc32(data.data(), data.size(), crc32((const uint8_t *)type, 4));
+    failed = failed || fwrite(framing.data(), framing.size(), 1, out) != 1 ||
+             (!data.empty() && fwrite(data.data(), data.size(), 1, out) != 1);
+    framing.clear();
+    put_u32(framing, crc);
+    failed = failed || fwrite(framing.data(), framing.size(), 1, out) != 1;
+}
+
+bool StripWriter::write(const float *rows, int n_rows) {
+    if (!ok() || n_rows <= 0 || rows_written + n_rows > height) {
+        failed = true;
+        return false;
+    }
+    if (format == IMAGE_FORMAT_PFM) {
+        // PFM stores the bottom row first.
+        for (int r = 0; r < n_rows && !failed; r++) {
+            long offset = data_offset + (long)(height - 1 - rows_written - r) * width * sizeof(float);
+            failed = fseek(out, offset, SEEK_SET) != 0 ||
+                     fwrite(rows + (size_t)r * width, sizeof(float), width, out) != (size_t)width;
+        }
+        rows_written += n_rows;
+        return !failed;
+    }
+
+    // Filter type 0 then the row's bytes, for every row of the band.
+    vector<uint8_t> raw((size_t)n_rows * (width + 1));
+    for (int r = 0; r < n_rows; r++) {
+        uint8_t *line = &raw[(size_t)r * (width + 1)];
+        line[0] = 0;
+        for (int j = 0; j < width; j++) {
+            float value = rows[(size_t)r * width + j];
+            line[j + 1] = value > 0 ? (value < 1 ? (uint8_t)(value * 255 + 0.5f) : 255) : 0;
+        }
+    }
+    for (size_t start = 0; start < raw.size(); start += ADLER_RUN) {
+        size_t end = min(raw.size(), start + ADLER_RUN);
+        for (size_t k = start; k < end; k++) {
+            adler_a += raw[k];
+            adler_b += adler_a;
+        }
+        adler_a %= ADLER_MODULO;
+        adler_b %= ADLER_MODULO;
+    }
+    chunk.clear();
+    if (rows_written == 0) {
+        // zlib header: deflate with a 32K window, no dictionary, fastest level.
+        chunk.insert(chunk.end(), {0x78, 0x01});
+    }
+    rows_written += n_rows;
+    for (size_t start = 0; start < raw.size(); start += STORED_BLOCK_BYTES) {
+        size_t length = min(STORED_BLOCK_BYTES, raw.size() - start);
+        bool final = rows_written == height && start + length == raw.size();
+        chunk.insert(chunk.end(), {(uint8_t)final, (uint8_t)length, (uint8_t)(length >> 8), (uint8_t)~length,
+                                   (uint8_t)(~length >> 8)});
+        chunk.insert(chunk.end(), raw.begin() + start, raw.begin() + start + length);
+    }
+    if (rows_written == height) {
+        put_u32(chunk, adler_b << 16 | adler_a);
+    }
+    write_chunk("IDAT", chunk);
+    return !failed;
+}
+
+bool StripWriter::close() {
+    if (out == nullptr) {
+        return false;
+    }
+    bool complete = rows_written == height;
+    if (format == IMAGE_FORMAT_PNG) {
+        write_chunk("IEND", vector<uint8_t>());
+    }
+    failed = (fclose(out) != 0) || failed;
+    out = nullptr;
+    return complete && !failed;
+}
+
+// Camera::expose for a run of pixels.
+static void expose_pixels(float *pixels, size_t n, float max_exposure) {
+    for (size_t k = 0; k < n; k++) {
+        pixels[k] = pixels[k] / max_exposure;
+        if (pixels[k] > 1) {
+            pixels[k] = 1;
+        }
+    }
+}
+
+bool render_strips(const Scene &scene, const Camera &camera, int width, int height, const RenderOptions &options,
+                   const string &path, int format, int strip_rows, RenderStats *stats) {
+    TraceSpan render_span("render strips");
+    strip_rows = max(1, min(strip_rows, height));
+    int n_workers = options.n_threads > 0 ? options.n_threads : max((int)thread::hardware_concurrency() - 1, 1);
+    auto build_start = std::chrono::steady_clock::now();
+    trace_begin("octree build");
+    Octree octo(scene, options.octree_cache_dir, options.octree_depth, options.parallel_limits());
+    InstanceTree instances(scene);
+    trace_end();
+    double build_seconds = seconds_since(build_start);
+
+    auto render_start = std::chrono::steady_clock::now();
+    bool auto_exposure = camera.exposure_mode == AUTO_LINEAR_EXPOSURE;
+    string raw_path = path + ".raw";
+    FILE *raw = nullptr;
+    StripWriter *writer = nullptr;
+    bool ok;
+    if (auto_exposure) {
+        raw = fopen(raw_path.c_str(), "w+b");
+        ok = raw != nullptr;
+    } else {
+        writer = new StripWriter(path, format, width, height);
+        ok = writer->ok();
+    }
+    RenderOptions strip_options = options;
+    strip_options.heatmap = nullptr;
+    Canvas first(height, width, strip_rows), second(height, width, strip_rows);
+    Canvas *strips[2] = {&first, &second};
+    float peak = -inf;
+    vector<RenderStats> worker_stats(n_workers);
+    int n_strips = (height + strip_rows - 1) / strip_rows;
+    for (int s = 0; s <= n_strips && ok; s++) {
+        vector<thread> threads;
+        atomic<int> next_tile(0);
+        if (s < n_strips) {
+            Canvas *canvas = strips[s % 2];
+            canvas->first_row = s * strip_rows;
+            memset(canvas->buffer, 0, canvas->bytes());
+            int begin = canvas->first_row * width;
+            int n_tiles = (canvas->end_ray_id() - begin + options.tile_pixels - 1) / options.tile_pixels;
+            for (int w = 0; w < n_workers; w++) {
+                threads.push_back(thread([&, w, canvas, begin, n_tiles]() {
+                    for (int tile = next_tile++; tile < n_tiles; tile = next_tile++) {
+                        int start = begin + tile * options.tile_pixels;
+                        render_tile(*canvas, scene, octo, instances, camera, strip_options, start,
+                                    start + options.tile_pixels, worker_stats[w]);
+                    }
+                }));
+            }
+        }
+        if (s > 0) {
+            // The previous strip, written out while this one is traced.
+            TraceSpan write_span("write strip", s - 1);
+            Canvas &done = *strips[(s - 1) % 2];
+            int rows = done.end_ray_id() / width - done.first_row;
+            size_t n_pixels = (size_t)rows * width;
+            if (auto_exposure) {
+                for (size_t k = 0; k < n_pixels; k++) {
+                    peak = max(peak, done.buffer[k]);
+                }
+                ok = fwrite(done.buffer, sizeof(float), n_pixels, raw) == n_pixels;
+            } else {
+                expose_pixels(done.buffer, n_pixels, camera.max_exposure_energy);
+                ok = writer->write(done.buffer, rows);
+            }
+        }
+        for (thread &t : threads) {
+            t.join();
+        }
+    }
+
+    if (auto_exposure && ok) {
+        TraceSpan expose_span("expose strips");
+        writer = new StripWriter(path, format, width, height);
+        ok = writer->ok() && fseek(raw, 0, SEEK_SET) == 0;
+        vector<float> band((size_t)strip_rows * width);
+        for (int row = 0; row < height && ok; row += strip_rows) {
+            int rows = min(strip_rows, height - row);
+            size_t n_pixels = (size_t)rows * width;
+            ok = fread(band.data(), sizeof(float), n_pixels, raw) == n_pixels;
+            expose_pixels(band.data(), n_pixels, peak);
+            ok = ok && writer->write(band.data(), rows);
+        }
+    }
+    if (raw != nullptr) {
+        fclose(raw);
+        unlink(raw_path.c_str());
+    }
+    ok = writer != nullptr && writer->close() && ok;
+    delete writer;
+    double render_seconds = seconds_since(render_start);
+    if (stats != nullptr) {
+        *stats = RenderStats();
+        for (RenderStats &worker : worker_stats) {
+            worker.idle_seconds = max(render_seconds - worker.busy_seconds, 0.0);
+            stats->merge(worker);
+        }
+        stats->build_seconds = build_seconds;
+        stats->build_bytes = build_bytes(scene, octo);
+        stats->octree_cached = octo.mapping != nullptr;
+        stats->render_seconds = render_seconds;
+    }
+    return ok;
+}
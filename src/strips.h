@@ -0,0 +1,55 @@
+#ifndef STRIPS_H
+#define STRIPS_H
+#include "render.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+const int IMAGE_FORMAT_PFM = 0;
+const int IMAGE_FORMAT_PNG = 1;
+
+/**
+ * Writes a greyscale image in bands of rows, top to bottom, without holding more than one band.
+ * PFM keeps the floats as given, rows placed bottom-up as the format requires. PNG takes values in
+ * [0, 1] as 8 bits; each band becomes one IDAT chunk of stored (uncompressed) deflate blocks, so
+ * no compression library is needed and nothing is buffered across bands.
+ **/
+class StripWriter {
+  public:
+    int format;
+    int width, height;
+    int rows_written = 0;
+    StripWriter(const string &path, int format, int width, int height);
+    StripWriter(const StripWriter &other) = delete;
+    ~StripWriter();
+    // False once opening or any write has failed.
+    bool ok() const { return out != nullptr && !failed; }
+    bool write(const float *rows, int n_rows);
+    // Finishes the file; false if any part of it could not be written.
+    bool close();
+
+  private:
+    FILE *out = nullptr;
+    bool failed = false;
+    // Where PFM pixel data starts.
+    long data_offset = 0;
+    uint32_t adler_a = 1, adler_b = 0;
+    vector<uint8_t> chunk;
+    void write_chunk(const char type[4], const vector<uint8_t> &data);
+};
+
+/**
+ * Renders the scene to an image file a strip of strip_rows rows at a time, so memory stays bounded
+ * by two strips whatever the resolution: the workers trace one strip while the calling thread
+ * exposes and writes the one before. MANUAL_LINEAR_EXPOSURE cameras expose each strip as it is
+ * done. Automatic exposure needs the whole image's peak, so the raw strips are spooled to
+ * <path>.raw first and exposed on a second pass over that file, which is then removed. Heatmaps
+ * are not written. Returns false on I/O errors.
+ **/
+bool render_strips(const Scene &scene, const Camera &camera, int width, int height, const RenderOptions &options,
+                   const string &path, int format, int strip_rows, RenderStats *stats = nullptr);
+
+#endif
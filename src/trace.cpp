@@ -0,0 +1,177 @@
+#include "trace.h"
+#include "stdio.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <vector>
+using std::mutex;
+using std::unique_ptr;
+using std::vector;
+
+std::atomic<bool> trace_active(false);
+
+struct TraceBuffer {
+  public:
+    int tid;
+    vector<TraceEvent> events;
+    std::atomic<size_t> written{0};
+    // The trace the buffer holds events of; only its owner thread changes it, under registry_lock.
+    int generation;
+    // Set under registry_lock once no thread will record into the buffer again.
+    bool orphaned = false;
+    TraceBuffer(int tid, size_t capacity, int generation) : tid(tid), events(capacity), generation(generation) {}
+};
+
+struct OpenSpan {
+    char name[TRACE_NAME_LENGTH];
+    long start_ns;
+};
+
+static mutex registry_lock;
+static vector<unique_ptr<TraceBuffer>> registry;
+static size_t events_per_thread = DEFAULT_TRACE_EVENTS_PER_THREAD;
+static std::atomic<int> generation(0);
+// Threads that have recorded into the current trace, numbering their buffers.
+static int n_trace_threads = 0;
+static long trace_origin_ns = 0;
+
+struct ThreadTraceState {
+    TraceBuffer *buffer = nullptr;
+    vector<OpenSpan> open_spans;
+    ~ThreadTraceState() {
+        if (buffer != nullptr) {
+            std::lock_guard<mutex> guard(registry_lock);
+            buffer->orphaned = true;
+        }
+    }
+};
+
+static thread_local ThreadTraceState thread_state;
+
+/**
+ * A thread takes its buffer over into a new trace on its first record there, the only time a lock
+ * is taken: it resets the buffer itself, so no other thread ever writes to it, or replaces it if the
+ * capacity changed.
+ **/
+static TraceBuffer *thread_buffer() {
+    int current = generation.load(std::memory_order_acquire);
+    TraceBuffer *buffer = thread_state.buffer;
+    if (buffer == nullptr || buffer->generation != current) {
+        std::lock_guard<mutex> guard(registry_lock);
+        if (buffer != nullptr && buffer->events.size() == events_per_thread) {
+            buffer->tid = n_trace_threads++;
+            buffer->written.store(0, std::memory_order_relaxed);
+            buffer->generation = current;
+        } else {
+            if (buffer != nullptr) {
+                buffer->orphaned = true;
+            }
+            registry.push_back(unique_ptr<TraceBuffer>(new TraceBuffer(n_trace_threads++, events_per_thread, current)));
+            thread_state.buffer = registry.back().get();
+        }
+    }
+    return thread_state.buffer;
+}
+
+// Only buffers no thread can still hold are freed; the others are reset by their owners.
+void trace_start(size_t capacity) {
+    registry_lock.lock();
+    registry.erase(std::remove_if(registry.begin(), registry.end(),
+                                  [](const unique_ptr<TraceBuffer> &buffer) { return buffer->orphaned; }),
+                   registry.end());
+    events_per_thread = capacity > 0 ? capacity : DEFAULT_TRACE_EVENTS_PER_THREAD;
+    trace_origin_ns = trace_now_ns();
+    n_trace_threads = 0;
+    generation++;
+    registry_lock.unlock();
+    trace_active.store(true);
+}
+
+void trace_stop() { trace_active.store(false); }
+
+void trace_record(const char *name, long start_ns, long end_ns, long arg) {
+    if (!trace_enabled()) {
+        return;
+    }
+    TraceBuffer *buffer = thread_buffer();
+    size_t slot = buffer->written.load(std::memory_order_relaxed);
+    TraceEvent &event = buffer->events[slot % buffer->events.size()];
+    strncpy(event.name, name, TRACE_NAME_LENGTH - 1);
+    event.name[TRACE_NAME_LENGTH - 1] = '\0';
+    event.start_ns = start_ns;
+    event.end_ns = end_ns;
+    event.arg = arg;
+    buffer->written.store(slot + 1, std::memory_order_release);
+}
+
+void trace_begin(const char *name) {
+    if (trace_enabled()) {
+        // Copied, the caller's string (e.g. one passed in from Python) may not outlive the span.
+        OpenSpan span;
+        strncpy(span.name, name, TRACE_NAME_LENGTH - 1);
+        span.name[TRACE_NAME_LENGTH - 1] = '\0';
+        span.start_ns = trace_now_ns();
+        thread_state.open_spans.push_back(span);
+    }
+}
+
+void trace_end() {
+    if (thread_state.open_spans.empty()) {
+        return;
+    }
+    OpenSpan &span = thread_state.open_spans.back();
+    trace_record(span.name, span.start_ns, trace_now_ns());
+    thread_state.open_spans.pop_back();
+}
+
+static void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', out);
+        }
+        if ((unsigned char)*str >= 0x20) {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Should only be called once the traced threads are done recording, e.g. after render() returns.
+bool trace_write(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == nullptr) {
+        return false;
+    }
+    registry_lock.lock();
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    int current = generation.load(std::memory_order_acquire);
+    for (unique_ptr<TraceBuffer> &buffer : registry) {
+        if (buffer->generation != current) {
+            continue;
+        }
+        fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, ", first ? "" : ",\n",
+                buffer->tid);
+        fprintf(out, "\"args\": {\"name\": \"thread %d\"}}", buffer->tid);
+        first = false;
+        size_t written = buffer->written.load(std::memory_order_acquire);
+        size_t capacity = buffer->events.size();
+        size_t oldest = written > capacity ? written - capacity : 0;
+        for (size_t i = oldest; i < written; i++) {
+            const TraceEvent &event = buffer->events[i % capacity];
+            fprintf(out, ",\n{\"name\": ");
+            write_json_string(out, event.name);
+            fprintf(out, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", buffer->tid,
+                    (event.start_ns - trace_origin_ns) / 1000.0, (event.end_ns - event.start_ns) / 1000.0);
+            if (event.arg >= 0) {
+                fprintf(out, ", \"args\": {\"arg\": %ld}", event.arg);
+            }
+            fprintf(out, "}");
+        }
+    }
+    fprintf(out, "\n]}\n");
+    registry_lock.unlock();
+    return fclose(out) == 0;
+}
@@ -0,0 +1,67 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+
+/**
+ * Timeline tracing. While a trace is active, every thread records spans into its own fixed-size
+ * ring buffer (single writer, no locks on the hot path; the oldest spans are overwritten when it
+ * fills up). trace_write() dumps all buffers as Chrome trace / Perfetto JSON.
+ * trace_start() may be called at any time, also while a trace is active and threads are recording:
+ * it starts a new trace, which each thread joins on its next record by resetting its own buffer.
+ * Buffers live as long as their thread, so a span closing across a restart is never written into
+ * freed memory; those of exited threads are freed by the next trace_start().
+ **/
+
+const size_t TRACE_NAME_LENGTH = 40;
+const size_t DEFAULT_TRACE_EVENTS_PER_THREAD = 1 << 16;
+
+struct TraceEvent {
+  public:
+    char name[TRACE_NAME_LENGTH];
+    long start_ns;
+    long end_ns;
+    long arg;
+};
+
+extern std::atomic<bool> trace_active;
+
+inline bool trace_enabled() { return trace_active.load(std::memory_order_relaxed); }
+inline long trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void trace_start(size_t events_per_thread = DEFAULT_TRACE_EVENTS_PER_THREAD);
+void trace_stop();
+bool trace_write(const char *path);
+void trace_record(const char *name, long start_ns, long end_ns, long arg = -1);
+// Open/close a span on the calling thread; spans nest.
+void trace_begin(const char *name);
+void trace_end();
+
+/**
+ * Records a span covering its own lifetime. Costs one relaxed load when tracing is off.
+ **/
+class TraceSpan {
+  public:
+    TraceSpan(const char *name, long arg = -1) : name(name), arg(arg) {
+        if (trace_enabled()) {
+            start_ns = trace_now_ns();
+        }
+    }
+    ~TraceSpan() {
+        if (start_ns >= 0) {
+            trace_record(name, start_ns, trace_now_ns(), arg);
+        }
+    }
+
+  private:
+    const char *name;
+    long arg;
+    long start_ns = -1;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include "tune.h"
+#include "octree.h"
+#include "instance.h"
+#include <atomic>
+#include <random>
+#include <unistd.h>
+using std::atomic;
+
+const int TILE_CANDIDATES[] = {8, 16, 32, 64, 128};
+const int DEPTH_CANDIDATES[] = {5, 6, 7, 8};
+// Sampled pixels come in runs of the largest tile, so every candidate tiles them exactly.
+const int SAMPLE_RUN_PIXELS = 128;
+// Each trial is timed this many times and the fastest kept, to keep scheduling noise out.
+const int TRIAL_REPEATS = 2;
+
+// Vertex hash of the scene's own geometry and every mesh's full-detail level, with the instance count.
+static uint64_t scene_hash(const Scene &scene, const ParallelLimits &limits) {
+    const uint64_t FNV_PRIME = 1099511628211ull;
+    uint64_t hash = geometry_hash(scene.geometry, limits);
+    for (const shared_ptr<Mesh> &mesh : scene.meshes) {
+        hash = (hash ^ geometry_hash(mesh->levels[0].geometry, limits)) * FNV_PRIME;
+    }
+    return (hash ^ scene.instances.size()) * FNV_PRIME;
+}
+
+static string tune_path(const Scene &scene, const string &cache_dir, const ParallelLimits &limits) {
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx-", (unsigned long long)scene_hash(scene, limits));
+    return cache_dir + name + host + ".tune";
+}
+
+static bool load_tuning(const string &path, TuneResult &result) {
+    FILE *in = fopen(path.c_str(), "r");
+    if (in == nullptr) {
+        return false;
+    }
+    TuneResult saved;
+    bool ok = fscanf(in, "tile_pixels %d octree_depth %d n_threads %d estimated_seconds %lf", &saved.tile_pixels,
+                     &saved.octree_depth, &saved.n_threads, &saved.estimated_seconds) == 4;
+    fclose(in);
+    if (!ok || saved.tile_pixels <= 0 || saved.octree_depth != clamp_octree_depth(saved.octree_depth) ||
+        saved.n_threads < 0) {
+        return false;
+    }
+    saved.loaded = true;
+    result = saved;
+    return true;
+}
+
+static bool save_tuning(const string &path, const TuneResult &result) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (out == nullptr) {
+        return false;
+    }
+    fprintf(out, "tile_pixels %d\noctree_depth %d\nn_threads %d\nestimated_seconds %f\n", result.tile_pixels,
+            result.octree_depth, result.n_threads, result.estimated_seconds);
+    return fclose(out) == 0;
+}
+
+// Traces the sampled runs in tiles of options.tile_pixels on options.n_threads workers.
+static double time_sample(Canvas &canvas, const Scene &scene, const Octree &octo, const InstanceTree &instances,
+                          const Camera &camera, const RenderOptions &options, const vector<int> &runs) {
+    vector<std::pair<int, int>> tiles;
+    for (int run : runs) {
+        for (int start = run; start < run + SAMPLE_RUN_PIXELS; start += options.tile_pixels) {
+            tiles.push_back({start, min(start + options.tile_pixels, run + SAMPLE_RUN_PIXELS)});
+        }
+    }
+    int n_workers = options.n_threads > 0 ? options.n_threads : max((int)thread::hardware_concurrency() - 1, 1);
+    double best = 0;
+    for (int repeat = 0; repeat < TRIAL_REPEATS; repeat++) {
+        vector<RenderStats> worker_stats(n_workers);
+        atomic<size_t> next_tile(0);
+        auto start = std::chrono::steady_clock::now();
+        vector<thread> threads;
+        for (int w = 0; w < n_workers; w++) {
+            threads.push_back(thread([&, w]() {
+                for (size_t tile = next_tile++; tile < tiles.size(); tile = next_tile++) {
+                    render_tile(canvas, scene, octo, instances, camera, options, tiles[tile].first, tiles[tile].second,
+                                worker_stats[w]);
+                }
+            }));
+        }
+        for (thread &t : threads) {
+            t.join();
+        }
+        double seconds = seconds_since(start);
+        best = repeat == 0 ? seconds : min(best, seconds);
+    }
+    return best;
+}
+
+TuneResult autotune(const Scene &scene, const Camera &camera, int width, int height, const RenderOptions &options,
+                    int n_samples, uint32_t seed, const string &cache_dir) {
+    TraceSpan tune_span("autotune");
+    TuneResult result;
+    string path = cache_dir.empty() ? "" : tune_path(scene, cache_dir, options.parallel_limits());
+    if (!path.empty() && load_tuning(path, result)) {
+        return result;
+    }
+
+    // Runs wholly inside the canvas, a seeded random subset of them in canvas order.
+    int n_pixels = width * height;
+    vector<int> runs;
+    for (int run = 0; run + SAMPLE_RUN_PIXELS <= n_pixels; run += SAMPLE_RUN_PIXELS) {
+        runs.push_back(run);
+    }
+    std::mt19937 random(seed);
+    std::shuffle(runs.begin(), runs.end(), random);
+    int n_runs = min((int)runs.size(), max(1, (n_samples + SAMPLE_RUN_PIXELS - 1) / SAMPLE_RUN_PIXELS));
+    runs.resize(n_runs);
+    std::sort(runs.begin(), runs.end());
+    if (runs.empty()) {
+        return result;
+    }
+    double scale = (double)n_pixels / (n_runs * SAMPLE_RUN_PIXELS);
+    bool count_build = options.octree_cache_dir.empty();
+    Canvas canvas(height, width);
+    InstanceTree instances(scene);
+    RenderOptions trial = options;
+    trial.heatmap = nullptr;
+    trial.heatmap_mode = HEATMAP_NONE;
+
+    Octree *best_octree = nullptr;
+    double build_seconds = 0;
+    for (int depth : DEPTH_CANDIDATES) {
+        auto build_start = std::chrono::steady_clock::now();
+        Octree *octo = new Octree(scene, "", depth, options.parallel_limits());
+        double depth_build_seconds = count_build ? seconds_since(build_start) : 0;
+        double seconds = time_sample(canvas, scene, *octo, instances, camera, trial, runs) * scale +
+                         depth_build_seconds;
+        result.n_trials++;
+        if (best_octree == nullptr || seconds < result.estimated_seconds) {
+            delete best_octree;
+            best_octree = octo;
+            build_seconds = depth_build_seconds;
+            result.octree_depth = depth;
+            result.estimated_seconds = seconds;
+        } else {
+            delete octo;
+        }
+    }
+
+    for (int tile_pixels : TILE_CANDIDATES) {
+        trial.tile_pixels = tile_pixels;
+        double seconds = time_sample(canvas, scene, *best_octree, instances, camera, trial, runs) * scale +
+                         build_seconds;
+        result.n_trials++;
+        if (seconds < result.estimated_seconds) {
+            result.tile_pixels = tile_pixels;
+            result.estimated_seconds = seconds;
+        }
+    }
+    trial.tile_pixels = result.tile_pixels;
+
+    int hardware_threads = max((int)thread::hardware_concurrency(), 1);
+    vector<int> thread_candidates = {max(hardware_threads - 1, 1), hardware_threads};
+    for (int n_threads = 1; n_threads < hardware_threads - 1; n_threads *= 2) {
+        thread_candidates.push_back(n_threads);
+    }
+    std::sort(thread_candidates.begin(), thread_candidates.end());
+    thread_candidates.erase(std::unique(thread_candidates.begin(), thread_candidates.end()), thread_candidates.end());
+    result.n_threads = trial.n_threads;
+    for (int n_threads : thread_candidates) {
+        trial.n_threads = n_threads;
+        double seconds = time_sample(canvas, scene, *best_octree, instances, camera, trial, runs) * scale +
+                         build_seconds;
+        result.n_trials++;
+        if (seconds < result.estimated_seconds) {
+            result.n_threads = n_threads;
+            result.estimated_seconds = seconds;
+        }
+    }
+    delete best_octree;
+
+    if (!path.empty() && !save_tuning(path, result)) {
+        fprintf(stderr, "could not write tuning %s\n", path.c_str());
+    }
+    return result;
+}
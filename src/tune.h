@@ -0,0 +1,36 @@
+#ifndef TUNE_H
+#define TUNE_H
+#include "render.h"
+#include <stdint.h>
+#include <string>
+using std::string;
+
+/**
+ * Render settings picked by autotune(). estimated_seconds is the calibration's estimate of a full
+ * render under them: the sample's trace time scaled to the canvas, plus the octree build when
+ * there is no octree cache to amortise it.
+ **/
+struct TuneResult {
+  public:
+    int tile_pixels = PIXEL_BLOCK_SIZE;
+    int octree_depth = DEFAULT_OCTREE_DEPTH;
+    int n_threads = 0;
+    double estimated_seconds = 0;
+    int n_trials = 0;
+    // Set when the settings came from a saved calibration instead of a new one.
+    bool loaded = false;
+};
+
+/**
+ * Calibrates tile size, octree depth and worker count for rendering the scene through camera onto
+ * a width by height canvas. A seeded sample of about n_samples pixels, in runs as long as the
+ * largest tile, is traced under each candidate, one knob at a time: the depth first (each
+ * candidate octree built and timed), then the tile size and finally the worker count. The other
+ * fields of options apply as given. With a cache_dir, results are saved per scene and host as
+ * <cache_dir>/<scene hash>-<hostname>.tune and read back instead of calibrating again. The camera's
+ * max_reflections is left alone, since it changes the image.
+ **/
+TuneResult autotune(const Scene &scene, const Camera &camera, int width, int height, const RenderOptions &options,
+                    int n_samples, uint32_t seed, const string &cache_dir);
+
+#endif